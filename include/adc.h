@@ -3,9 +3,15 @@
 
 #include <inttypes.h>
 #include "mc6821.h"
+#include "cassette.h"
+#include "ring_buffer.h"
+#include "blip.h"
 
 
-#define SOUND_BUFFER_SIZE 40000
+#define SOUND_BUFFER_SIZE 0x10000  // must be a power of 2
+#define SOUND_SAMPLE_RATE 44100
+#define SOUND_BLOCK_SAMPLES 256     // samples synthesized at once
+#define SOUND_MAX_RATE_ADJUST 0.005f  // the output rate is nudged by up to 0.5% to keep the target latency
 
 
 struct adc_status {
@@ -21,21 +27,33 @@ struct adc_status {
     struct mc6821_status *pia2;
 
     uint8_t sound_enabled;  // 0: off, 1: on
-    uint8_t sound_samples[SOUND_BUFFER_SIZE];
-    int sound_samples_size;
-    uint64_t next_sound_sample_time_ns;
+    uint8_t single_bit_sound;
+    struct blip_buffer sound_synth;
+    struct ring_buffer sound_buffer;  // produced by the emulation, consumed by the SDL audio thread
+    SDL_AtomicInt sound_overruns;   // samples dropped because the buffer was full
+    SDL_AtomicInt sound_underruns;  // audio callbacks that couldn't be fully served, counted by the audio thread
+    uint32_t sound_target_samples;  // buffered samples aimed for, from the latency setting
+    float sound_rate_adjust;   // relative change of the sample period, positive when the buffer is too full
+    float _sound_fill_average;
+    uint8_t _sound_primed;     // audio thread: the buffer reached the target since the last underrun
+    uint64_t next_sound_block_time_ns;
     SDL_AudioStream *stream;
 
     uint8_t cassette_motor;  // 0: off, 1: on
-    int cassette_audio_len;
-    int cassette_audio_location;
-    uint8_t *cassette_audio_buf;
+    struct cassette_status *cassette;
     uint64_t next_cassette_sample_time_ns;
+
+    uint64_t _virtual_time_ns;  // time of the last adc_process call, used to time the DAC changes
 };
 
 struct adc_status *adc_initialize(struct mc6821_status *pia1, struct mc6821_status *pia2);
 void adc_reset(struct adc_status *adc);
 int adc_load_cassette(struct adc_status *adc, const char *path);
+void adc_swap_cassette(struct adc_status *adc, struct cassette_status *cassette);
 void adc_process(struct adc_status *adc, uint64_t virtual_time_ns);
+void adc_open_audio(struct adc_status *adc);
+void adc_set_sound_latency(struct adc_status *adc, int latency_ms);
+uint32_t adc_sound_buffer_fill(struct adc_status *adc);
+float adc_sound_latency_ms(struct adc_status *adc);
 
 #endif
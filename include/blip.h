@@ -0,0 +1,31 @@
+#ifndef __BLIP__
+#define __BLIP__
+
+#include <inttypes.h>
+
+#define BLIP_PHASES 32          // sub-sample positions of the kernel
+#define BLIP_TAPS 16            // kernel length in samples
+#define BLIP_MAX_SAMPLES 1024   // samples that can be pending before blip_read is called
+
+
+/*
+    Band-limited step synthesis
+    The amplitude changes are recorded with their virtual time, each one adds a band-limited
+    impulse (windowed sinc) to a buffer of deltas; integrating the deltas gives the output samples
+    without the aliasing of point sampling the level
+*/
+struct blip_buffer {
+    double sample_period_ns;    // virtual time of an output sample
+    uint64_t start_ns;          // virtual time of the first pending sample
+    float amplitude;            // current amplitude
+    float integrator;           // amplitude before the first pending sample
+    float deltas[BLIP_MAX_SAMPLES + BLIP_TAPS];
+};
+
+void blip_init(struct blip_buffer *b, int sample_rate);
+void blip_reset(struct blip_buffer *b, uint64_t time_ns);
+void blip_set_amplitude(struct blip_buffer *b, uint64_t time_ns, float amplitude);
+uint64_t blip_end_time(struct blip_buffer *b, int count);
+void blip_read(struct blip_buffer *b, uint8_t *samples, int count);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef __BLOCK_DEVICE__
+#define __BLOCK_DEVICE__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define BLOCK_SIZE 512
+
+// IDE like task file at $FF50-$FF57, relative to $FF40
+#define BLOCK_REG_DATA 0x10
+#define BLOCK_REG_ERROR 0x11      // read: error, write: features (ignored)
+#define BLOCK_REG_COUNT 0x12      // sectors of the command, 0 for 256
+#define BLOCK_REG_LBA_0 0x13
+#define BLOCK_REG_LBA_1 0x14
+#define BLOCK_REG_LBA_2 0x15
+#define BLOCK_REG_LBA_3 0x16      // bits 0-3, the LBA has 28 bits
+#define BLOCK_REG_COMMAND 0x17    // read: status, write: command
+
+#define BLOCK_COMMAND_READ 0x20
+#define BLOCK_COMMAND_WRITE 0x30
+#define BLOCK_COMMAND_FLUSH 0xe7
+#define BLOCK_COMMAND_IDENTIFY 0xec
+
+#define BLOCK_STATUS_ERROR 0x01
+#define BLOCK_STATUS_DATA_REQUEST 0x08
+#define BLOCK_STATUS_READY 0x40
+
+#define BLOCK_ERROR_ABORTED 0x04
+#define BLOCK_ERROR_NOT_FOUND 0x10
+
+/*
+    A hard disk on the cartridge port: 512 bytes sectors addressed by their LBA, stored in a host file
+    The file is mapped read/write, the sectors are copied at once between the mapping and the transfer buffer,
+    there is no seek or rotation time
+*/
+struct block_device {
+#ifdef _WIN32
+    HANDLE file_handle;
+    HANDLE map_handle;
+#endif
+    uint8_t *data;            // the mapped file, NULL without a file
+    size_t length;
+    bool is_write_protect;
+    char *path;
+
+    uint8_t registers[8];     // the task file, by BLOCK_REG_* - BLOCK_REG_DATA
+    uint8_t status;
+    uint8_t command;
+    uint32_t lba;             // of the sector being transferred
+    int remaining;            // sectors left in the command
+    uint8_t buffer[BLOCK_SIZE];
+    const uint8_t *transfer;  // the sector being read, in the mapping or in the buffer
+    int transfer_pos;
+};
+
+struct block_device *block_device_create(void);
+int block_device_open(struct block_device *device, const char *path);
+void block_device_close(struct block_device *device);
+void block_device_reset(struct block_device *device);
+uint8_t block_device_read_register(void *data, uint16_t addr);
+void block_device_write_register(void *data, uint16_t addr, uint8_t value);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __CARTRIDGE__
+#define __CARTRIDGE__
+
+#include <inttypes.h>
+
+#define CARTRIDGE_NONE -1
+#define CARTRIDGE_DISK_CONTROLLER 0
+#define CARTRIDGE_BLOCK_DEVICE 1
+#define CARTRIDGE_DEVICE_COUNT 2
+
+/*
+    A device plugged in the cartridge port, its registers are selected by SCS ($FF40-$FF5F)
+    read and write get the address relative to the start of the range the device is mapped to
+*/
+struct cartridge_device {
+    const char *name;
+    void *data;
+    uint8_t (*read)(void *data, uint16_t addr);
+    void (*write)(void *data, uint16_t addr, uint8_t value);
+};
+
+#endif
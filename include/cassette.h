@@ -0,0 +1,95 @@
+#ifndef __CASSETTE__
+#define __CASSETTE__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <SDL3/SDL_audio.h>
+#include <SDL3/SDL_iostream.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_atomic.h>
+#include "ring_buffer.h"
+
+#define CASSETTE_SAMPLE_RATE 9600
+
+#define CASSETTE_FORMAT_NONE 0
+#define CASSETTE_FORMAT_WAV 1
+#define CASSETTE_FORMAT_CAS 2
+
+#define CASSETTE_WAV_WINDOW_SIZE 0x20000  // converted samples kept around the playback position (must be a power of 2)
+
+
+/*
+    Records the cassette output while the motor is on
+    The emulation pushes the data into the ring buffer and a writer thread does the file I/O
+*/
+struct cassette_recorder {
+    int format;                 // CASSETTE_FORMAT_WAV or CASSETTE_FORMAT_CAS
+    FILE *fp;
+    struct ring_buffer buffer;
+    SDL_Thread *thread;
+    SDL_AtomicInt running;
+    SDL_AtomicInt data_length;  // bytes written to the file, updated by the writer thread
+    SDL_AtomicInt write_error;  // set by the writer thread when the file can't be written, the UI stops the recording
+    uint32_t overruns;          // bytes dropped because the writer thread was behind
+
+    // CAS: the bits are decoded from the DAC level changes, the bytes are aligned on the $3C sync byte
+    int _level_high;
+    uint64_t _last_rise_ns;
+    uint16_t _shift;            // last 16 bits, $55 $3C when the sync byte was received
+    int _leader_bits;           // bits received before the sync byte
+    int _synced;
+    int _block_pos;             // bytes of the block received after the sync byte
+    int _block_length;          // type, length, data and checksum bytes
+    uint8_t _value;
+    int _bit_pos;
+};
+
+struct cassette_status {
+    int format;
+    int audio_len;        // length in samples (CASSETTE_SAMPLE_RATE)
+    int audio_location;   // playback position in samples
+
+    // WAV: the samples converted to U8 mono, used when the file can't be streamed
+    uint8_t *audio_buf;
+
+    // WAV streaming: the file is converted in chunks into a ring buffer ahead of the playback position
+    SDL_IOStream *_wav_file;
+    SDL_AudioStream *_wav_converter;
+    int64_t _wav_data_offset;   // data chunk position in the file
+    int64_t _wav_data_length;   // data chunk length in bytes
+    int64_t _wav_data_read;     // bytes of the data chunk already sent to the converter
+    int _wav_frame_size;
+    int _wav_freq;
+    int _wav_out_freq;          // rate of the converted samples, CASSETTE_SAMPLE_RATE for the playback
+    int _wav_window_start;      // location of the oldest sample in the window
+    int _wav_window_end;        // location after the newest sample in the window
+    uint8_t *_wav_window;
+
+    // CAS: the byte stream, the samples are generated on the fly
+    uint8_t *cas_data;
+    size_t cas_length;
+    int _cas_location;    // sample position of the cursor
+    size_t _cas_byte;
+    int _cas_bit;
+    int _cas_phase;
+
+    // the fast load found no block from the start to the end of the last search, it's not searched again
+    int _sync_search_start;
+    int _sync_search_end;
+
+    struct cassette_recorder *recorder;  // NULL when not recording
+    SDL_AtomicInt load_progress;         // percent, while a long conversion runs in cassette_load
+};
+
+struct cassette_status *cassette_create(void);
+int cassette_load(struct cassette_status *cassette, const char *path);
+void cassette_unload(struct cassette_status *cassette);
+uint8_t cassette_get_sample(struct cassette_status *cassette, int location);
+int cassette_record_start(struct cassette_status *cassette, const char *path);
+void cassette_record_stop(struct cassette_status *cassette);
+void cassette_record_sample(struct cassette_status *cassette, uint8_t sample);
+void cassette_record_level(struct cassette_status *cassette, float level, uint64_t time_ns);
+int cassette_read_block(struct cassette_status *cassette, uint8_t *block_type, uint8_t *block_length, uint8_t *block_data);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef __CRC16__
+#define __CRC16__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// CRC-CCITT of the WD1793 (polynomial 0x1021), preset to FFFF before the address marks
+#define CRC16_INIT 0xffff
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t length);
+uint16_t crc16_update_byte(uint16_t crc, uint8_t value);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __DISK_DIRECTORY__
+#define __DISK_DIRECTORY__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "disk_image.h"
+
+// RS-DOS single sided 35 tracks disk
+#define RSDOS_TRACKS 35
+#define RSDOS_SECTORS 18
+#define RSDOS_SECTOR_LENGTH 256
+#define RSDOS_DIRECTORY_TRACK 17
+#define RSDOS_FAT_SECTOR 2
+#define RSDOS_FIRST_DIRECTORY_SECTOR 3
+#define RSDOS_DIRECTORY_SECTORS 9
+#define RSDOS_ENTRY_LENGTH 32
+#define RSDOS_ENTRIES (RSDOS_DIRECTORY_SECTORS * RSDOS_SECTOR_LENGTH / RSDOS_ENTRY_LENGTH)
+#define RSDOS_GRANULES 68
+#define RSDOS_GRANULE_SECTORS 9
+#define RSDOS_GRANULE_LENGTH (RSDOS_GRANULE_SECTORS * RSDOS_SECTOR_LENGTH)
+
+#define DISK_DIRECTORY_SECTOR_EMPTY 0     // not read from the host file yet
+#define DISK_DIRECTORY_SECTOR_LOADED 1
+#define DISK_DIRECTORY_SECTOR_MODIFIED 2
+
+
+/*
+    A host directory seen as an RS-DOS disk
+    The FAT and the directory are built when it's opened, the sectors of the files are read when they are first used.
+    The new and modified files are written back to the directory when the disk is flushed
+*/
+struct disk_directory {
+    char *path;
+    char *host_names[RSDOS_ENTRIES];          // host file of each directory entry when the disk was built
+    uint8_t directory[RSDOS_DIRECTORY_SECTORS * RSDOS_SECTOR_LENGTH];  // the directory when it was last written to the host
+    int granule_entry[RSDOS_GRANULES];        // entry whose host file has the content of the granule, -1 for none
+    uint32_t granule_offset[RSDOS_GRANULES];  // position of the granule in the host file
+    uint8_t sector_state[RSDOS_TRACKS * RSDOS_SECTORS];
+};
+
+bool disk_directory_is_directory(const char *path);
+int disk_directory_open(struct disk_image *image, const char *path);
+void disk_directory_close(struct disk_image *image);
+uint8_t *disk_directory_sector_data(struct disk_image *image, struct disk_sector *sector, int for_write);
+int disk_directory_flush(struct disk_image *image);
+
+#endif
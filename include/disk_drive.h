@@ -3,9 +3,35 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
-#ifdef _WIN32
-#include <windows.h>
-#endif
+#include "disk_image.h"
+
+#define DISK_REVOLUTION_NS 200000000   // 300 RPM
+#define DISK_INDEX_PULSE_NS 4000000
+#define DISK_RNF_REVOLUTIONS 5         // a missing sector is searched during 5 index pulses
+
+#define DISK_TRACE_SIZE 256             // commands kept by the trace
+
+// activity of a drive since the emulator started (or the statistics were reset)
+struct disk_drive_stats {
+    uint64_t commands;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t seeks;              // restore, seek and step commands
+    uint64_t seek_distance;      // tracks stepped
+    uint64_t settle_ns;          // head load delays
+    uint64_t rotation_ns;        // waiting for the sectors to come under the head
+    uint64_t halt_ns;            // emulated time with the HALT line asserted
+};
+
+struct disk_trace_entry {
+    uint64_t time_ns;            // emulated time when the command was written
+    uint64_t duration_ns;        // until the end of the command
+    uint8_t drive_no;
+    uint8_t command;
+    uint8_t track;
+    uint8_t sector;
+    uint8_t status;              // when the next command started
+};
 
 struct disk_drive_status {
     union {
@@ -52,20 +78,26 @@ struct disk_drive_status {
 
     uint64_t next_command_after_nano;
     void (*_next_command)(struct disk_drive_status *drive);
+    const uint64_t *clock_ns;       // the emulated time, the disks rotate with it
+    uint64_t _track_write_start_ns;
 
     uint8_t _seek_track_target;
+    uint8_t _id_field[6];     // read address: track, side, sector, length code, CRC
+    uint8_t _track_field;     // write track: the field being written
+    uint8_t _data_mark;
 
-#ifdef _WIN32
-    HANDLE _drive_file_handle[4];
-    HANDLE _drive_map_handle[4];
-#endif
-    uint8_t* _drive_data[4];
-    size_t _drive_data_length[4];
-    bool is_write_protect[4];
+    struct disk_drive_stats stats[4];
+    struct disk_trace_entry trace[DISK_TRACE_SIZE];  // ring buffer, when app_settings.disk_trace is set
+    int trace_next;
+    int trace_count;
+    int _trace_current;       // entry of the running command, -1 for none
+    bool _trace_running;
+    uint64_t _halt_start_ns;
+    int _halt_drive_no;
+
+    struct disk_image images[4];
     int step_direction;
-    int tracks;
-    int sectors;
-    int sector_length;
+    int sector_length;        // of the current sector, set when it's looked up
     int sector_data_pos;
 
     bool irq;
@@ -77,7 +109,16 @@ uint8_t disk_drive_read_register(void *drive, uint16_t address);
 void disk_drive_write_register(void *drive, uint16_t address, uint8_t value);
 void disk_drive_process_next(struct disk_drive_status *drive);
 int disk_drive_load_disk(struct disk_drive_status *drive, int drive_no, const char *path);
-uint8_t *_get_drive_data(struct disk_drive_status *drive);
+int disk_drive_write_mode(int drive_no);
+void disk_drive_swap_image(struct disk_drive_status *drive, int drive_no, struct disk_image *image);
+void disk_drive_flush(struct disk_drive_status *drive, int force);
 int disk_drive_create_empty_image(const char* path);
+int disk_drive_fast_read(struct disk_drive_status *drive, uint8_t *buffer, int length);
+int disk_drive_fast_write_length(struct disk_drive_status *drive);
+void disk_drive_fast_write(struct disk_drive_status *drive, const uint8_t *buffer, int length);
+void disk_drive_reset_activity(struct disk_drive_status *drive);
+int disk_drive_format_activity(struct disk_drive_status *drive, char *text, int length);
+char *disk_drive_format_trace(struct disk_drive_status *drive);
+int disk_drive_save_trace(const char *trace, const char *path);
 
 #endif
@@ -0,0 +1,108 @@
+#ifndef __DISK_IMAGE__
+#define __DISK_IMAGE__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define DISK_MAX_TRACKS 80
+#define DISK_MAX_SECTOR_ID 256
+
+#define DISK_WRITE_THROUGH 0   // the file is mapped read/write, the writes go directly to the file
+#define DISK_WRITE_BACK 1      // the writes are cached and the file is replaced when it's flushed
+#define DISK_WRITE_VOLATILE 2  // the writes are cached and never written to the file
+#define DISK_WRITE_OVERLAY 3   // volatile on a base file shared read only by several instances, even when it's not writable
+
+#define DISK_FLUSH_DELAY_NS 2000000000  // idle time before the modified sectors are flushed
+
+#define DISK_ANGLE_UNITS 0x10000  // a revolution, for the position of the sectors on the track
+#define DISK_RAW_TRACK_LENGTH 6250  // bytes of a double density track at 300 RPM
+
+#define DISK_SECTOR_ID_CRC_ERROR 0x01
+#define DISK_SECTOR_DATA_CRC_ERROR 0x02
+#define DISK_SECTOR_DELETED 0x04      // F8 data address mark
+
+
+// a sector found in the image, the data is in the mapped file
+struct disk_sector {
+    uint8_t track;        // ID field
+    uint8_t side;
+    uint8_t id;
+    uint8_t size_code;    // length = 128 << size_code
+    uint32_t id_offset;   // DMK: position of the ID address mark in the file, 0 when the format has none
+    uint32_t offset;      // position of the data in the file
+    uint16_t length;
+    uint8_t flags;        // DISK_SECTOR_*, from the CRCs and the marks of the file
+};
+
+struct disk_image;
+struct disk_directory;
+
+/*
+    A disk image format, probe tells if the mapped file is in this format
+    and build_index fills the geometry and the sector list of the image
+*/
+struct disk_format {
+    const char *name;
+    int (*probe)(struct disk_image *image);
+    int (*build_index)(struct disk_image *image);
+};
+
+struct disk_image {
+#ifdef _WIN32
+    HANDLE file_handle;
+    HANDLE map_handle;
+#endif
+    uint8_t *data;
+    size_t length;
+    bool is_write_protect;
+    const struct disk_format *format;
+    struct disk_directory *directory;   // when the disk is built from a host directory, data is then in memory
+    char *path;
+    int write_mode;
+
+    // write back cache of the modified sectors, by sector_list index (NULL when the sector wasn't modified)
+    // it's emptied when it's flushed, so every cached sector is dirty
+    uint8_t **sector_cache;
+    int dirty_count;          // cached sectors
+    uint64_t last_write_ns;
+    int flush_id;             // the flush running on the media loader, 0 for none
+
+    int tracks;
+    int sides;
+    size_t header_length;
+    size_t track_length;      // DMK: raw track length, including the IDAM table
+
+    // the sectors in physical order, grouped by track/side
+    struct disk_sector *sector_list;
+    int sector_count;
+    int *track_sector_start;  // first sector of each track/side in sector_list, tracks * sides + 1 entries
+    int *sector_index;        // track/side and sector id -> sector_list index or -1, tracks * sides * DISK_MAX_SECTOR_ID entries
+
+    // raw tracks for the read track command, by track/side (NULL until the track is read)
+    uint8_t **track_cache;
+    int *track_cache_length;
+    int track_cache_interleave;
+};
+
+int disk_image_open(struct disk_image *image, const char *path, int write_mode);
+void disk_image_close(struct disk_image *image);
+int disk_image_flush(struct disk_image *image);
+int disk_image_copy_writes(struct disk_image *image, struct disk_image *copy);
+int disk_image_flush_copy(struct disk_image *image);
+int disk_image_take_writes(struct disk_image *image, struct disk_image *flushed);
+void disk_image_discard(struct disk_image *image);
+uint8_t *disk_image_sector_data(struct disk_image *image, struct disk_sector *sector, int for_write);
+struct disk_sector *disk_image_find_sector(struct disk_image *image, int track, int side, int id);
+int disk_image_track_sector_count(struct disk_image *image, int track, int side);
+struct disk_sector *disk_image_track_sector(struct disk_image *image, int track, int side, int position);
+uint32_t disk_image_sector_angle(struct disk_image *image, struct disk_sector *sector, int interleave);
+void disk_image_sector_written(struct disk_image *image, struct disk_sector *sector, bool deleted);
+void disk_image_id_field(struct disk_image *image, struct disk_sector *sector, uint8_t *id_field);
+int disk_image_inject_crc_error(struct disk_image *image, int track, int side, int id);
+const uint8_t *disk_image_raw_track(struct disk_image *image, int track, int side, int interleave, int *length);
+
+#endif
@@ -7,7 +7,54 @@
 #include "video.h"
 #include "adc.h"
 #include "disk_drive.h"
+#include "media_loader.h"
+#include "block_device.h"
+#include "cartridge.h"
+#include "multipak.h"
+#include "rom_pak.h"
 
+#define MACHINE_COMMAND_QUEUE_LENGTH 256
+
+struct machine_status;
+
+// runs on the emulation side between two fields, the text is a copy freed after the call
+typedef void (*machine_command_fn)(struct machine_status *machine, int arg, float value, const char *text);
+
+struct machine_command {
+    machine_command_fn fn;
+    int arg;
+    float value;
+    char *text;
+};
+
+// runs on the main thread with the UI: the message boxes and the settings file belong to it. The data is freed after the call
+typedef void (*machine_ui_fn)(struct machine_status *machine, int arg, const char *text, void *data);
+
+struct machine_ui_command {
+    machine_ui_fn fn;
+    int arg;
+    char *text;
+    void *data;
+};
+
+// what the UI shows of the machine, copied at the end of each field
+struct machine_snapshot {
+    bool instruction_fault;
+    bool disk_busy;
+    bool disk_motor_on;
+    bool disk_loaded;         // drive 0 has an image
+    bool cassette_motor;
+    int cassette_location;
+    int cassette_length;
+    bool recording;
+    bool recording_error;     // the writer thread failed, the recording must be stopped
+    uint32_t recorded_length;
+    bool sound_enabled;
+    float adc_level;
+    int switch_selection;
+    float sound_latency_ms;
+    float sound_rate_adjust;
+};
 
 struct machine_status {
     SDL_Window* window;
@@ -19,6 +66,11 @@ struct machine_status {
     struct video_status *video;
     struct adc_status *adc;
     struct disk_drive_status *disk_drive;
+    struct block_device *block_device;
+    struct cartridge_device cartridge_devices[CARTRIDGE_DEVICE_COUNT];
+    struct rom_pak cartridge_pak;      // the program pak, when there's no Multi-Pak
+    struct multipak *multipak;
+    struct media_loader *loader;
     int cart_sense;
 
     uint64_t _next_disk_drive_call;  // tracks the disk timing
@@ -27,14 +79,49 @@ struct machine_status {
     bool settings_page_is_open;
 
     int _joy_emulation[2];    // enable/disable keyboard/mouse joystick emulation
+    float _joy_axes[4];       // the emulated joystick positions, the emulation gets them by command
     SDL_Joystick *joysticks[2];
     SDL_JoystickID joystick_ids[2];
+
+    SDL_Thread *thread;     // NULL when the emulation runs on the main thread
+    SDL_AtomicInt thread_running;
+
+    // UI to emulation commands, the producers share a spin lock, the emulation pulls them lock free
+    struct machine_command commands[MACHINE_COMMAND_QUEUE_LENGTH];
+    SDL_AtomicInt command_start;
+    SDL_AtomicInt command_end;
+    SDL_SpinLock command_push_lock;
+
+    // emulation and file dialog results for the main thread, the same way back
+    struct machine_ui_command ui_commands[MACHINE_COMMAND_QUEUE_LENGTH];
+    SDL_AtomicInt ui_command_start;
+    SDL_AtomicInt ui_command_end;
+    SDL_SpinLock ui_command_push_lock;
+
+    // emulation to UI, the lock is only held to copy
+    SDL_Mutex *snapshot_lock;
+    struct machine_snapshot snapshot;
+    SDL_AtomicInt activity_request;   // the UI shows the disk activity
+    char activity[0x8000];
 };
 
 
 void machine_init(struct machine_status *machine);
 void machine_reset(struct machine_status *machine);
-int machine_process_frame(struct machine_status *machine);
+void machine_update_cartridge_port(struct machine_status *machine);
+void machine_process_frame(struct machine_status *machine);
+bool machine_audio_paced(struct machine_status *machine);
+bool machine_frame_due(struct machine_status *machine);
+void machine_resync_time(struct machine_status *machine);
+int machine_post(struct machine_status *machine, machine_command_fn fn, int arg, float value, const char *text);
+int machine_post_ui(struct machine_status *machine, machine_ui_fn fn, int arg, const char *text, void *data);
+void machine_run_ui_commands(struct machine_status *machine);
+void machine_get_snapshot(struct machine_status *machine, struct machine_snapshot *snapshot);
+void machine_get_disk_activity(struct machine_status *machine, char *text, int length);
+void machine_command_reset(struct machine_status *machine, int arg, float value, const char *text);
+void machine_post_reset(struct machine_status *machine, bool autostart);
+int machine_start_thread(struct machine_status *machine);
+void machine_stop_thread(struct machine_status *machine);
 void machine_handle_input_begin(struct machine_status *machine);
 int machine_handle_input(struct machine_status *machine, SDL_Event *event);
 void machine_send_key(uint32_t key_code);
@@ -0,0 +1,62 @@
+#ifndef __MEDIA_LOADER__
+#define __MEDIA_LOADER__
+
+#include <stdbool.h>
+#include <SDL3/SDL_atomic.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include "disk_image.h"
+#include "cassette.h"
+
+#define MEDIA_DISK 0
+#define MEDIA_CASSETTE 1
+#define MEDIA_FLUSH 2     // writes back the modified sectors of a disk
+
+#define MEDIA_LOADER_QUEUE_SIZE 8
+
+#define MEDIA_LOADER_IDLE 0
+#define MEDIA_LOADER_LOADING 1   // the worker opens the new media
+#define MEDIA_LOADER_READY 2     // waits for the emulation to swap it in
+#define MEDIA_LOADER_SWAPPED 3   // the worker closes the previous media
+
+struct machine_status;
+struct disk_drive_status;
+
+struct media_job {
+    int type;           // MEDIA_DISK or MEDIA_CASSETTE
+    int drive_no;
+    char *path;         // NULL to unload
+    int result;
+    int flush_id;       // MEDIA_FLUSH: the flush of the drive image
+    struct disk_image disk;   // MEDIA_FLUSH: the copy of the modified sectors, then the flushed image
+    struct cassette_status cassette;
+};
+
+/*
+    Opens the disk and cassette images on a worker thread, and writes back the modified disks
+    The emulation swaps the opened media in between two instructions and the worker closes the previous one,
+    so the machine doesn't stop while a big image is mapped, converted or flushed
+*/
+struct media_loader {
+    SDL_Thread *thread;
+    SDL_Mutex *lock;          // protects the queue and the state changes the worker waits for
+    SDL_Condition *wake;
+    SDL_AtomicInt running;
+    SDL_AtomicInt state;
+
+    struct media_job queue[MEDIA_LOADER_QUEUE_SIZE];
+    int queue_start;
+    int queue_count;
+
+    struct media_job job;     // owned by the worker, except in the READY state
+    int flush_count;          // flush ids, used by the emulation only
+};
+
+struct media_loader *media_loader_create(void);
+void media_loader_stop(struct media_loader *loader);
+int media_loader_request(struct media_loader *loader, int type, int drive_no, const char *path);
+void media_loader_apply(struct media_loader *loader, struct machine_status *machine);
+bool media_loader_status(struct media_loader *loader, char *text, int length);
+void media_loader_flush_disks(struct media_loader *loader, struct disk_drive_status *drive);
+
+#endif
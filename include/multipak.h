@@ -0,0 +1,40 @@
+#ifndef __MULTIPAK__
+#define __MULTIPAK__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "cartridge.h"
+#include "sam.h"
+#include "rom_pak.h"
+
+#define MULTIPAK_SLOTS 4
+#define MULTIPAK_SELECT_REGISTER 0x1f  // $FF7F, relative to $FF60
+
+struct multipak_slot {
+    struct cartridge_device *device;   // on SCS, NULL for none
+    struct rom_pak pak;                // on CTS, its bank register replaces the device when it's banked
+    const uint8_t *device_rom;         // on CTS when there's no pak (Disk Basic), NULL for none
+    size_t device_rom_length;
+    bool autostart;                    // a program pak, its CART line is tied to Q
+};
+
+/*
+    Multi-Pak interface: 4 slots, the slot select register at $FF7F routes SCS (bits 0-1)
+    and CTS (bits 4-5) to one of the slots. After a reset both follow the front switch
+*/
+struct multipak {
+    struct sam_status *sam;
+    struct multipak_slot slots[MULTIPAK_SLOTS];
+    uint8_t select;
+    int switch_slot;                   // 0 to 3
+    struct cartridge_device select_device;  // the register, on the sam external range
+};
+
+struct multipak *multipak_create(struct sam_status *sam);
+void multipak_reset(struct multipak *multipak);
+void multipak_apply(struct multipak *multipak);
+bool multipak_cart_sense(struct multipak *multipak);
+uint8_t multipak_read_register(void *data, uint16_t addr);
+void multipak_write_register(void *data, uint16_t addr, uint8_t value);
+
+#endif
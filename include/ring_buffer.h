@@ -0,0 +1,26 @@
+#ifndef __RING_BUFFER__
+#define __RING_BUFFER__
+
+#include <inttypes.h>
+#include <SDL3/SDL_atomic.h>
+
+/*
+    Lock free single producer / single consumer byte ring buffer
+    The head is only moved by the producer and the tail only by the consumer
+*/
+struct ring_buffer {
+    uint8_t *data;
+    uint32_t size;      // power of 2
+    SDL_AtomicInt head; // total bytes written
+    SDL_AtomicInt tail; // total bytes read
+};
+
+int ring_buffer_init(struct ring_buffer *rb, uint32_t size);
+void ring_buffer_free(struct ring_buffer *rb);
+void ring_buffer_clear(struct ring_buffer *rb);
+uint32_t ring_buffer_available(struct ring_buffer *rb);
+uint32_t ring_buffer_free_space(struct ring_buffer *rb);
+uint32_t ring_buffer_write(struct ring_buffer *rb, const uint8_t *data, uint32_t length);
+uint32_t ring_buffer_read(struct ring_buffer *rb, uint8_t *data, uint32_t length);
+
+#endif
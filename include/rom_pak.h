@@ -0,0 +1,38 @@
+#ifndef __ROM_PAK__
+#define __ROM_PAK__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include "cartridge.h"
+#include "sam.h"
+
+#define ROM_PAK_BANK_SIZE 0x4000       // seen at $C000-$FEFF
+#define ROM_PAK_MAX_LENGTH 0x100000    // 64 banks
+#define ROM_PAK_BANK_REGISTER 0x00     // $FF40, relative to $FF40
+
+/*
+    A program pak ROM, the ones bigger than 16K are bank switched: the program writes the bank number
+    to the bank register and the sam is given a pointer on the bank, nothing is copied
+*/
+struct rom_pak {
+    struct sam_status *sam;
+    uint8_t *data;                     // bank_count * ROM_PAK_BANK_SIZE, NULL when no ROM is loaded
+    size_t length;                     // of the file
+    time_t mtime;                      // of the file, a rebuilt ROM is loaded again
+    int bank_count;
+    int bank;
+    char *path;
+    struct cartridge_device bank_register;  // on SCS in place of the device of the port when the pak is banked
+};
+
+void rom_pak_init(struct rom_pak *pak, struct sam_status *sam);
+int rom_pak_load(struct rom_pak *pak, const char *path);
+void rom_pak_reset(struct rom_pak *pak);
+const uint8_t *rom_pak_bank(struct rom_pak *pak);
+bool rom_pak_is_banked(struct rom_pak *pak);
+uint8_t rom_pak_read_register(void *data, uint16_t addr);
+void rom_pak_write_register(void *data, uint16_t addr, uint8_t value);
+
+#endif
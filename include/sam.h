@@ -1,5 +1,7 @@
 #include <inttypes.h>
+#include <stddef.h>
 #include <mc6821.h>
+#include "cartridge.h"
 
 #ifndef __SAM_H__
 #define __SAM_H__
@@ -51,6 +53,7 @@ struct sam_status {
     };
 
     unsigned TY;
+    uint32_t ram_size;        // installed RAM: 4K, 16K, 32K or 64K, applies on sam_update_map
 
     uint16_t _vdg_address_0_3;
     uint16_t _vdg_address_4;
@@ -62,22 +65,32 @@ struct sam_status {
     uint8_t ram[0x10000];
     uint8_t rom0[0x2000];
     uint8_t rom1[0x2000];
-    uint8_t rom2[0x3f00];
     uint8_t rom_dsk[0x3f00];
-    int rom_load_status[4];
+    int rom_load_status[4];   // by rom_no: 0 Extended Basic, 1 Basic, 3 Disk Basic, the cartridge is a rom_pak
 
     struct mc6821_status *pia1;
     struct mc6821_status *pia2;
 
-    void *pia_cartridge;
-    uint8_t (*pia_cartridge_read)(void *p, uint16_t addr);
-    void (*pia_cartridge_write)(void *p, uint16_t addr, uint8_t value);
+    struct cartridge_device *cartridge;   // the device on the cartridge port (SCS), NULL for none
+    struct cartridge_device *external;    // $FF60-$FFBF (Multi-Pak slot select), NULL for none
+    const uint8_t *cartridge_rom;         // CTS, $C000-$FEFF, NULL for none
+    size_t cartridge_rom_length;
+
+    // decode tables, rebuilt by sam_update_map when the mapping changes
+    const uint8_t *read_pages[0x100];     // by 256 bytes page, NULL for the I/O page
+    uint8_t *write_pages[0x100];
+    const uint8_t *_vdg_pages[0x100];
+    uint8_t unmapped[0x100];              // reads 0xff
+    uint8_t discarded[0x100];             // the writes to the ROM go there
 };
 
 struct sam_status * bus_create_sam();
 void sam_reset(struct sam_status *sam);
+void sam_update_map(struct sam_status *sam);
+void sam_set_cartridge_rom(struct sam_status *sam, const uint8_t *rom, size_t length);
 uint8_t sam_read(struct sam_status *sam, uint16_t addr);
 void sam_write(struct sam_status *sam, uint16_t addr, uint8_t data);
+int sam_read_rom_file(const char *path, uint8_t *buffer, size_t max_length);
 int sam_load_rom(struct sam_status *sam, int rom_no, const char *path);
 void sam_unload_rom(struct sam_status *sam, int rom_no);
 void sam_vdg_hs_reset(struct sam_status *sam);
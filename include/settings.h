@@ -7,6 +7,9 @@
 #define Joy_Emulation_Joy1 3
 #define Joy_Emulation_Joy2 4
 
+#define Pacing_Mode_Host_Clock 0
+#define Pacing_Mode_Audio 1
+
 struct app_settings {
     char *rom_basic_path;
     char *rom_extended_basic_path;
@@ -14,19 +17,44 @@ struct app_settings {
 
     struct {
         char *path;
+        cfg_bool_t overlay;   // the writes stay in memory, the file is shared read only
     } disks[4];
 
     char *cartridge_path;
+    long int cartridge_device;     // CARTRIDGE_DISK_CONTROLLER or CARTRIDGE_BLOCK_DEVICE
+    char *block_device_path;
+    cfg_bool_t multipak;
+    long int multipak_switch;      // slot selected after a reset, 1 to 4
+    struct {
+        long int device;           // CARTRIDGE_NONE or a cartridge device
+        char *rom_path;
+    } multipak_slots[4];
     char *cassette_path;
 
     char *config_path;
 
     cfg_bool_t artifact_colors;
 
+    cfg_bool_t cassette_fast_load;
+    cfg_bool_t disk_fast_transfer;
+    long int disk_write_mode;
+    long int disk_interleave;
+    cfg_bool_t disk_rotation_timing;
+    cfg_bool_t disk_trace;
+    cfg_bool_t cassette_wav_demodulate;
+
     long int joy_emulation_mode[2];
+
+    long int ram_size;             // installed RAM in K: 4, 16, 32 or 64
+
+    long int sound_latency_ms;
+    long int pacing_mode;
+    cfg_bool_t emulation_thread;
 };
 
 extern struct app_settings app_settings;
 
 void settings_init(void);
 void settings_save(void);
+void settings_lock(void);
+void settings_unlock(void);
@@ -7,6 +7,11 @@
 #include "sam.h"
 
 
+#define VIDEO_WIDTH 256
+#define VIDEO_HEIGHT 192
+#define VIDEO_FRAME_FRESH 0x4  // flag of the middle frame index: a complete field not rendered yet
+
+
 struct video_status {
     struct sam_status *sam;
 
@@ -29,6 +34,10 @@ struct video_status {
     int _x;
     uint32_t* _pixels;
     int _pitch;
+    uint32_t* _frames[3];       // triple buffering between the emulation and the renderer
+    int _frame_back;            // emulation side, being drawn
+    SDL_AtomicInt _frame_middle;    // latest complete field
+    int _frame_front;           // renderer side
     SDL_FRect _output_port;
 };
 
@@ -38,6 +47,8 @@ void video_reset(struct video_status *v);
 
 uint64_t video_start_field(struct video_status *v);
 void video_end_field(struct video_status *v);
+int video_frame_ready(struct video_status *v);
+bool video_render(struct video_status *v);
 uint64_t video_process_next(struct video_status *v);
 
 #endif
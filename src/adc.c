@@ -4,6 +4,7 @@
 #include <SDL3/SDL_audio.h>
 #include "adc.h"
 #include "utils.h"
+#include "settings.h"
 
 void _adc_process(struct adc_status *adc) {
     int compare = 0;
@@ -18,6 +19,24 @@ void _adc_process(struct adc_status *adc) {
     mc6821_peripheral_input(adc->pia1, 0, compare ? 0x80 : 0, 0x80);
 }
 
+#define SOUND_SINGLE_BIT_LEVEL 0.15f
+
+// the sound output level (0..1), fed to the synthesizer when it changes
+void _adc_sound_update(struct adc_status *adc) {
+    float level = 0;
+
+    if (adc->sound_enabled) {
+        switch (adc->switch_selection) {
+            case 0: level = adc->adc_level / 5; break;
+            // just passthrough cassette noise
+            case 1: level = cassette_get_sample(adc->cassette, adc->cassette->audio_location) / 255.0f; break;
+        }
+    }
+    if (adc->single_bit_sound) level += SOUND_SINGLE_BIT_LEVEL;
+
+    blip_set_amplitude(&adc->sound_synth, adc->_virtual_time_ns, level);
+}
+
 void _adc_level_change_cb(struct mc6821_status *pia, int peripheral_address, uint8_t value, void *data) {
     struct adc_status *adc = (struct adc_status *)data;
 
@@ -29,7 +48,12 @@ void _adc_level_change_cb(struct mc6821_status *pia, int peripheral_address, uin
     if (value & 0b00001000) adc->adc_level += 0.14;
     if (value & 0b00000100) adc->adc_level += 0.07;
 
+    if (adc->cassette_motor) {
+        cassette_record_level(adc->cassette, adc->adc_level, adc->_virtual_time_ns);
+    }
+
     _adc_process(adc);
+    _adc_sound_update(adc);
 }
 
 void _adc_source_a_change_cb(struct mc6821_status *pia, int peripheral_address, uint8_t value, void *data) {
@@ -39,6 +63,7 @@ void _adc_source_a_change_cb(struct mc6821_status *pia, int peripheral_address,
     adc->switch_selection |= value ? 1 : 0;
 
     _adc_process(adc);
+    _adc_sound_update(adc);
 }
 
 void _adc_source_b_change_cb(struct mc6821_status *pia, int peripheral_address, uint8_t value, void *data) {
@@ -48,6 +73,15 @@ void _adc_source_b_change_cb(struct mc6821_status *pia, int peripheral_address,
     adc->switch_selection |= value ? 0b10 : 0;
 
    _adc_process(adc);
+   _adc_sound_update(adc);
+}
+
+void _adc_single_bit_sound_cb(struct mc6821_status *pia, int peripheral_address, uint8_t value, void *data) {
+    struct adc_status *adc = (struct adc_status *)data;
+
+    adc->single_bit_sound = (value & 0b10) ? 1 : 0;
+    if (adc->single_bit_sound) adc_open_audio(adc);
+    _adc_sound_update(adc);
 }
 
 void _adc_motor_cb(struct mc6821_status *pia, int peripheral_address, uint8_t value, void *data) {
@@ -61,19 +95,27 @@ void _adc_motor_cb(struct mc6821_status *pia, int peripheral_address, uint8_t va
 void SDLCALL _adc_sound_sample_cb(void *data, SDL_AudioStream *stream, int additional_amount, int total_amount)
 {
     struct adc_status *adc = (struct adc_status *)data;
-    if (additional_amount && adc->sound_samples_size) {
-        if (adc->sound_samples_size > additional_amount) {
-            SDL_PutAudioStreamData(stream, adc->sound_samples, additional_amount);
-            adc->sound_samples_size -= additional_amount;
-            memcpy(adc->sound_samples, adc->sound_samples + additional_amount, adc->sound_samples_size);
-        } else {
-            SDL_PutAudioStreamData(stream, adc->sound_samples, adc->sound_samples_size);
-            adc->sound_samples_size = 0;
-        }
+    uint8_t samples[0x1000];
+
+    // after an underrun, wait for the target latency before playing again
+    if (!adc->_sound_primed) {
+        if (ring_buffer_available(&adc->sound_buffer) < adc->sound_target_samples) return;
+        adc->_sound_primed = 1;
+    }
+
+    while (additional_amount > 0) {
+        uint32_t count = ring_buffer_read(&adc->sound_buffer, samples, additional_amount < (int)sizeof(samples) ? additional_amount : sizeof(samples));
+        if (!count) break;
+        SDL_PutAudioStreamData(stream, samples, count);
+        additional_amount -= count;
+    }
+    if (additional_amount > 0) {
+        if (adc->sound_enabled) SDL_AddAtomicInt(&adc->sound_underruns, 1);
+        adc->_sound_primed = 0;
     }
 }
 
-void _initialize_audio(struct adc_status *adc) {
+void adc_open_audio(struct adc_status *adc) {
     if (!adc->stream) {
         SDL_AudioSpec spec = {
             .format = SDL_AUDIO_U8,
@@ -82,28 +124,32 @@ void _initialize_audio(struct adc_status *adc) {
         };
         adc->stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, _adc_sound_sample_cb, adc);
         SDL_ResumeAudioDevice(SDL_GetAudioStreamDevice(adc->stream));
+        adc->next_sound_block_time_ns = 0;
     }
-    adc->sound_samples_size = 0;
-    adc->next_sound_sample_time_ns = 0;
 }
 
 void _adc_sound_cb(struct mc6821_status *pia, int peripheral_address, uint8_t value, void *data) {
     struct adc_status *adc = (struct adc_status *)data;
 
     adc->sound_enabled = value;
+    _adc_sound_update(adc);
     if (value) {
-        _initialize_audio(adc);
+        adc_open_audio(adc);
     }
     else {
         SDL_FlushAudioStream(adc->stream);
+        // taken and cleared at once, the audio thread can count an underrun at any time
+        uint32_t underruns = (uint32_t)SDL_SetAtomicInt(&adc->sound_underruns, 0);
+        uint32_t overruns = (uint32_t)SDL_SetAtomicInt(&adc->sound_overruns, 0);
+        if (underruns || overruns) {
+            log_message(LOG_INFO, "Sound buffer: %u underruns, %u overruns, latency %.1fms, rate %+.2f%%",
+                underruns, overruns, adc_sound_latency_ms(adc), -adc->sound_rate_adjust * 100);
+        }
     }
 }
 
 void adc_reset(struct adc_status *adc) {
-    if (adc->cassette_audio_buf) {
-        SDL_free(adc->cassette_audio_buf);
-        adc->cassette_audio_buf = NULL;
-    }
+    cassette_unload(adc->cassette);
 
     adc->input_joy_0 = 2.5;
     adc->input_joy_1 = 2.5;
@@ -114,12 +160,10 @@ void adc_reset(struct adc_status *adc) {
     adc->switch_selection = 0;
 
     adc->sound_enabled = 0;
-    adc->sound_samples_size = 0;
-    adc->next_sound_sample_time_ns = 0;
+    adc->single_bit_sound = 0;
+    blip_set_amplitude(&adc->sound_synth, adc->_virtual_time_ns, 0);
 
     adc->cassette_motor = 0;
-    adc->cassette_audio_len = 0;
-    adc->cassette_audio_location = 0;
     adc->next_cassette_sample_time_ns = 0;
 }
 
@@ -128,6 +172,13 @@ struct adc_status *adc_initialize(struct mc6821_status *pia1, struct mc6821_stat
     memset(adc, 0, sizeof(struct adc_status));
     adc->pia1 = pia1;
     adc->pia2 = pia2;
+    adc->cassette = cassette_create();
+    if (ring_buffer_init(&adc->sound_buffer, SOUND_BUFFER_SIZE)) {
+        log_message(LOG_ERROR, "Error initializing the sound: buffer allocation error");
+        exit(1);
+    }
+    blip_init(&adc->sound_synth, SOUND_SAMPLE_RATE);
+    adc_set_sound_latency(adc, app_settings.sound_latency_ms);
 
     adc_reset(adc);
 
@@ -136,92 +187,99 @@ struct adc_status *adc_initialize(struct mc6821_status *pia1, struct mc6821_stat
     mc6821_register_c2_cb(pia2, 0, (mc6821_cb)_adc_motor_cb, adc);
     mc6821_register_c2_cb(pia2, 1, (mc6821_cb)_adc_sound_cb, adc);
     mc6821_register_cb(pia2, 0, (mc6821_cb)_adc_level_change_cb, adc);
+    mc6821_register_cb(pia2, 1, (mc6821_cb)_adc_single_bit_sound_cb, adc);
 
     return adc;
 }
 
 int adc_load_cassette(struct adc_status *adc, const char *path) {
-    SDL_AudioSpec spec;
+    adc->next_cassette_sample_time_ns = 0;
+    return cassette_load(adc->cassette, path);
+}
 
-    if (adc->cassette_audio_buf) {
-        SDL_free(adc->cassette_audio_buf);
-        adc->cassette_audio_buf = NULL;
-    }
+// exchanges the loaded cassette with the one in cassette, the recording goes on
+void adc_swap_cassette(struct adc_status *adc, struct cassette_status *cassette) {
+    struct cassette_status previous = *adc->cassette;
+    *adc->cassette = *cassette;
+    adc->cassette->recorder = previous.recorder;
+    previous.recorder = NULL;
+    *cassette = previous;
+    adc->next_cassette_sample_time_ns = 0;
+}
 
-    if (!path) {
-        return 0;
-    }
+void adc_set_sound_latency(struct adc_status *adc, int latency_ms) {
+    if (latency_ms < 10) latency_ms = 10;
+    if (latency_ms > 500) latency_ms = 500;
+    adc->sound_target_samples = SOUND_SAMPLE_RATE * latency_ms / 1000;
+    adc->_sound_fill_average = adc->sound_target_samples;
+}
 
-    if (!SDL_LoadWAV(path, &spec, &adc->cassette_audio_buf, (Uint32*)&adc->cassette_audio_len)) {
-        log_message(LOG_ERROR, "Error cassette loading: %s: %s", path, SDL_GetError());
-        return 1;
-    }
-    adc->next_cassette_sample_time_ns = 0;
-    adc->cassette_audio_location = 0;
+// samples waiting in the ring buffer
+uint32_t adc_sound_buffer_fill(struct adc_status *adc) {
+    return ring_buffer_available(&adc->sound_buffer);
+}
 
-    if (spec.format != SDL_AUDIO_U8 || spec.channels != 1 || spec.freq != 9600) {
-        log_message(LOG_INFO, "Converting from format=%04X, channels=%d, freq=%d", spec.format, spec.channels, spec.freq);
+float adc_sound_latency_ms(struct adc_status *adc) {
+    return adc_sound_buffer_fill(adc) * 1000.0f / SOUND_SAMPLE_RATE;
+}
 
-        SDL_AudioSpec dest_spec = {
-            .channels  = 1,
-            .format  = SDL_AUDIO_U8,
-            .freq = 9600
-        };
-        Uint32 dest_audio_len;
-        Uint8 *dest_audio_buf;
-
-        if (!SDL_ConvertAudioSamples(&spec, adc->cassette_audio_buf, (int)adc->cassette_audio_len, &dest_spec, &dest_audio_buf, (int*)&dest_audio_len)) {
-            log_message(LOG_ERROR, "Format converting failed: %s", SDL_GetError());
-            SDL_free(adc->cassette_audio_buf);
-            adc->cassette_audio_buf = NULL;
-            return 1;
-        }
-        SDL_free(adc->cassette_audio_buf);
-        adc->cassette_audio_buf = dest_audio_buf;
-        adc->cassette_audio_len = dest_audio_len;
-    }
-    log_message(LOG_INFO, "Loaded wav file %s %d", path, adc->cassette_audio_len);
-    return 0;
+/*
+    The emulation runs on the host clock and the audio on the device clock, they drift apart.
+    The sample period is stretched or shrunk by up to SOUND_MAX_RATE_ADJUST
+    to bring the (smoothed) buffer fill back to the target
+*/
+void _adc_sound_rate_control(struct adc_status *adc) {
+    float fill = (float)adc_sound_buffer_fill(adc);
+    adc->_sound_fill_average += (fill - adc->_sound_fill_average) * 0.05f;
+
+    float error = (adc->_sound_fill_average - adc->sound_target_samples) / adc->sound_target_samples;
+    if (error > 1) error = 1;
+    if (error < -1) error = -1;
+    // when the audio paces the emulation, the rate must stay fixed
+    adc->sound_rate_adjust = app_settings.pacing_mode == Pacing_Mode_Audio ? 0 : error * SOUND_MAX_RATE_ADJUST;
+    adc->sound_synth.sample_period_ns = 1e9 / SOUND_SAMPLE_RATE * (1 + adc->sound_rate_adjust);
 }
 
 #define CASSETTE_SAMPLE_NS 104170
-#define SOUND_SAMPLE_NS 22675
 void adc_process(struct adc_status *adc, uint64_t virtual_time_ns) {
+    adc->_virtual_time_ns = virtual_time_ns;
+
     if (!adc->next_cassette_sample_time_ns) {
         adc->next_cassette_sample_time_ns = virtual_time_ns + CASSETTE_SAMPLE_NS;
     }
 
     if (virtual_time_ns >= adc->next_cassette_sample_time_ns) {
-        if (adc->cassette_audio_location < adc->cassette_audio_len &&
-                adc->cassette_audio_buf && adc->cassette_motor) {
-            if (adc->cassette_audio_buf[adc->cassette_audio_location] > 127)
+        struct cassette_status *cassette = adc->cassette;
+        if (cassette->audio_location < cassette->audio_len && adc->cassette_motor) {
+            if (cassette_get_sample(cassette, cassette->audio_location) > 127)
                 mc6821_peripheral_input(adc->pia2, 0, 0, 1);
             else
                 mc6821_peripheral_input(adc->pia2, 0, 1, 1);
-            adc->cassette_audio_location++;
+            cassette->audio_location++;
+            if (adc->switch_selection == 1) _adc_sound_update(adc);
+        }
+        if (adc->cassette_motor) {
+            cassette_record_sample(cassette, (uint8_t)(adc->adc_level * 255 / 4.5));
         }
         adc->next_cassette_sample_time_ns += CASSETTE_SAMPLE_NS;
     }
 
-    if (!adc->next_sound_sample_time_ns) {
-        adc->next_sound_sample_time_ns = virtual_time_ns + SOUND_SAMPLE_NS;
+    if (!adc->stream) return;
+
+    if (!adc->next_sound_block_time_ns) {
+        blip_reset(&adc->sound_synth, virtual_time_ns);
+        adc->next_sound_block_time_ns = blip_end_time(&adc->sound_synth, SOUND_BLOCK_SAMPLES);
     }
 
-    if (virtual_time_ns > adc->next_sound_sample_time_ns) {
-        if (adc->sound_enabled) {
-            uint8_t snd;
-            switch (adc->switch_selection) {
-                // just passthrough cassette noise
-                case 0: snd = (int)(adc->adc_level * 255 / 5); break;
-                case 1: if (adc->cassette_audio_location < adc->cassette_audio_len) snd = adc->cassette_audio_buf[adc->cassette_audio_location]; break;
-                default: snd = 0;
-            }
-            if (adc->sound_samples_size < SOUND_BUFFER_SIZE) {
-                adc->sound_samples[adc->sound_samples_size++] = snd;
-            } else {
-                log_message(LOG_INFO, "Sound buffer overflow");
-            }
-        }
-        adc->next_sound_sample_time_ns += SOUND_SAMPLE_NS;
+    if (virtual_time_ns >= adc->next_sound_block_time_ns) {
+        uint8_t samples[SOUND_BLOCK_SAMPLES];
+        blip_read(&adc->sound_synth, samples, SOUND_BLOCK_SAMPLES);
+        uint32_t written = ring_buffer_write(&adc->sound_buffer, samples, SOUND_BLOCK_SAMPLES);
+        if (written < SOUND_BLOCK_SAMPLES) SDL_AddAtomicInt(&adc->sound_overruns, SOUND_BLOCK_SAMPLES - written);
+        _adc_sound_rate_control(adc);
+
+        adc->next_sound_block_time_ns = blip_end_time(&adc->sound_synth, SOUND_BLOCK_SAMPLES);
+        // far behind (the emulation was paused), start again from now
+        if (virtual_time_ns >= adc->next_sound_block_time_ns) adc->next_sound_block_time_ns = 0;
     }
 }
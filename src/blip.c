@@ -0,0 +1,86 @@
+#include <string.h>
+#include <math.h>
+#include "blip.h"
+
+
+#define BLIP_PI 3.14159265358979323846
+#define BLIP_CUTOFF 0.45    // of the sample rate, a bit below Nyquist
+
+static float _blip_kernel[BLIP_PHASES][BLIP_TAPS];
+static int _blip_kernel_ready = 0;
+
+/*
+    For each phase, a Blackman windowed sinc centered between the taps at the phase offset,
+    normalized so a step always adds up to its full amplitude
+*/
+void _blip_init_kernel(void) {
+    for (int phase = 0; phase < BLIP_PHASES; phase++) {
+        double sum = 0;
+        for (int tap = 0; tap < BLIP_TAPS; tap++) {
+            double x = tap - BLIP_TAPS / 2 + 1 - (double)phase / BLIP_PHASES;
+            double sinc = x == 0 ? 2 * BLIP_CUTOFF : sin(2 * BLIP_PI * BLIP_CUTOFF * x) / (BLIP_PI * x);
+            double w = (x + BLIP_TAPS / 2) / BLIP_TAPS;
+            double window = 0.42 - 0.5 * cos(2 * BLIP_PI * w) + 0.08 * cos(4 * BLIP_PI * w);
+            _blip_kernel[phase][tap] = (float)(sinc * window);
+            sum += _blip_kernel[phase][tap];
+        }
+        for (int tap = 0; tap < BLIP_TAPS; tap++) {
+            _blip_kernel[phase][tap] /= (float)sum;
+        }
+    }
+    _blip_kernel_ready = 1;
+}
+
+void blip_init(struct blip_buffer *b, int sample_rate) {
+    if (!_blip_kernel_ready) _blip_init_kernel();
+
+    memset(b, 0, sizeof(struct blip_buffer));
+    b->sample_period_ns = 1e9 / sample_rate;
+}
+
+// drops the pending samples and restarts at time_ns, keeping the current amplitude
+void blip_reset(struct blip_buffer *b, uint64_t time_ns) {
+    memset(b->deltas, 0, sizeof(b->deltas));
+    b->integrator = b->amplitude;
+    b->start_ns = time_ns;
+}
+
+void blip_set_amplitude(struct blip_buffer *b, uint64_t time_ns, float amplitude) {
+    float delta = amplitude - b->amplitude;
+    if (delta == 0) return;
+    b->amplitude = amplitude;
+
+    double position = time_ns > b->start_ns ? (time_ns - b->start_ns) / b->sample_period_ns : 0;
+    if (position > BLIP_MAX_SAMPLES - 1) position = BLIP_MAX_SAMPLES - 1;
+    int index = (int)position;
+    int phase = (int)((position - index) * BLIP_PHASES);
+
+    float *out = b->deltas + index;
+    const float *kernel = _blip_kernel[phase];
+    for (int tap = 0; tap < BLIP_TAPS; tap++) {
+        out[tap] += kernel[tap] * delta;
+    }
+}
+
+// virtual time after the next count samples
+uint64_t blip_end_time(struct blip_buffer *b, int count) {
+    return b->start_ns + (uint64_t)(count * b->sample_period_ns);
+}
+
+// integrates the next count samples (amplitude 0..1 to U8) and moves the start time after them
+void blip_read(struct blip_buffer *b, uint8_t *samples, int count) {
+    if (count > BLIP_MAX_SAMPLES) count = BLIP_MAX_SAMPLES;
+
+    float sum = b->integrator;
+    for (int i = 0; i < count; i++) {
+        sum += b->deltas[i];
+        int value = (int)(sum * 255 + 0.5f);
+        samples[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+    }
+    b->integrator = sum;
+
+    int remaining = BLIP_MAX_SAMPLES + BLIP_TAPS - count;
+    memmove(b->deltas, b->deltas + count, remaining * sizeof(float));
+    memset(b->deltas + remaining, 0, count * sizeof(float));
+    b->start_ns = blip_end_time(b, count);
+}
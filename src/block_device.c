@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "block_device.h"
+#include "utils.h"
+
+#define BLOCK_MAX_LBA 0x0fffffff
+
+
+struct block_device *block_device_create(void) {
+    struct block_device *device = malloc(sizeof(struct block_device));
+    memset(device, 0, sizeof(struct block_device));
+    block_device_reset(device);
+    return device;
+}
+
+void block_device_reset(struct block_device *device) {
+    memset(device->registers, 0, sizeof(device->registers));
+    device->registers[BLOCK_REG_COUNT - BLOCK_REG_DATA] = 1;
+    device->status = device->data ? BLOCK_STATUS_READY : 0;
+    device->command = 0;
+    device->remaining = 0;
+    device->transfer = NULL;
+    device->transfer_pos = 0;
+}
+
+// maps the file, read only when it isn't writable
+int _block_device_map_file(struct block_device *device, const char *path) {
+    bool map_writable = !device->is_write_protect;
+#ifdef _WIN32
+    device->file_handle = CreateFile(
+        path,
+        map_writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (device->file_handle == INVALID_HANDLE_VALUE) {
+        log_message(LOG_ERROR, "Error opening block device:%s", path);
+        return 1;
+    }
+
+    LARGE_INTEGER file_length;
+    if (!GetFileSizeEx(device->file_handle, &file_length) || !file_length.QuadPart) {
+        log_message(LOG_ERROR, "Error reading the block device size:%s", path);
+        CloseHandle(device->file_handle);
+        device->file_handle = NULL;
+        return 1;
+    }
+
+    device->map_handle = CreateFileMappingA(device->file_handle, NULL, map_writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    device->data = device->map_handle ? MapViewOfFile(device->map_handle, map_writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!device->data) {
+        log_message(LOG_ERROR, "Error mapping block device:%s", path);
+        if (device->map_handle) CloseHandle(device->map_handle);
+        device->map_handle = NULL;
+        CloseHandle(device->file_handle);
+        device->file_handle = NULL;
+        return 1;
+    }
+    device->length = file_length.QuadPart;
+#else
+    int fd = open(path, map_writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        log_message(LOG_ERROR, "Can't open %s: %s", path, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !st.st_size) {
+        log_message(LOG_ERROR, "Can't read the size of %s", path);
+        close(fd);
+        return 1;
+    }
+
+    device->data = mmap(NULL, st.st_size, map_writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (device->data == MAP_FAILED) {
+        log_message(LOG_ERROR, "Can't map %s: %s", path, strerror(errno));
+        device->data = NULL;
+        return 1;
+    }
+    device->length = st.st_size;
+#endif
+    return 0;
+}
+
+int block_device_open(struct block_device *device, const char *path) {
+    block_device_close(device);
+    if (!path || !*path) return 0;
+
+    device->is_write_protect = !is_file_writable(path);
+    if (_block_device_map_file(device, path)) return 1;
+
+    device->path = strdup(path);
+    block_device_reset(device);
+    log_message(LOG_INFO, "Block device %s: %u sectors%s", path, (unsigned)(device->length / BLOCK_SIZE),
+        device->is_write_protect ? ", read only" : "");
+    return 0;
+}
+
+void block_device_close(struct block_device *device) {
+    if (device->data) {
+#ifdef _WIN32
+        FlushViewOfFile(device->data, 0);
+        UnmapViewOfFile(device->data);
+        CloseHandle(device->map_handle);
+        device->map_handle = NULL;
+        CloseHandle(device->file_handle);
+        device->file_handle = NULL;
+#else
+        if (!device->is_write_protect) msync(device->data, device->length, MS_SYNC);
+        munmap(device->data, device->length);
+#endif
+        device->data = NULL;
+    }
+    if (device->path) free(device->path);
+    device->path = NULL;
+    device->length = 0;
+    block_device_reset(device);
+}
+
+uint32_t _block_device_sectors(struct block_device *device) {
+    size_t sectors = device->length / BLOCK_SIZE;
+    return sectors > BLOCK_MAX_LBA ? BLOCK_MAX_LBA : (uint32_t)sectors;
+}
+
+// the LBA registers follow the sector being transferred
+void _block_device_set_lba(struct block_device *device, uint32_t lba) {
+    device->lba = lba;
+    device->registers[BLOCK_REG_LBA_0 - BLOCK_REG_DATA] = lba & 0xff;
+    device->registers[BLOCK_REG_LBA_1 - BLOCK_REG_DATA] = (lba >> 8) & 0xff;
+    device->registers[BLOCK_REG_LBA_2 - BLOCK_REG_DATA] = (lba >> 16) & 0xff;
+    device->registers[BLOCK_REG_LBA_3 - BLOCK_REG_DATA] = (device->registers[BLOCK_REG_LBA_3 - BLOCK_REG_DATA] & 0xf0) | ((lba >> 24) & 0x0f);
+}
+
+void _block_device_error(struct block_device *device, uint8_t error) {
+    device->registers[BLOCK_REG_ERROR - BLOCK_REG_DATA] = error;
+    device->status = BLOCK_STATUS_READY | BLOCK_STATUS_ERROR;
+    device->remaining = 0;
+    device->transfer = NULL;
+}
+
+// the next sector of a read command, straight from the mapping
+void _block_device_next_read(struct block_device *device) {
+    device->transfer = device->data + (size_t)device->lba * BLOCK_SIZE;
+    device->transfer_pos = 0;
+    device->status = BLOCK_STATUS_READY | BLOCK_STATUS_DATA_REQUEST;
+}
+
+// the buffer is written to the mapping at once when it's full
+void _block_device_end_write(struct block_device *device) {
+    memcpy(device->data + (size_t)device->lba * BLOCK_SIZE, device->buffer, BLOCK_SIZE);
+    device->transfer_pos = 0;
+    device->remaining--;
+    if (device->remaining) {
+        _block_device_set_lba(device, device->lba + 1);
+    } else {
+        device->status = BLOCK_STATUS_READY;
+    }
+}
+
+// a few words of the ATA identify data, the strings have their bytes swapped in each word
+void _block_device_identify(struct block_device *device) {
+    uint8_t *buffer = device->buffer;
+    uint32_t sectors = _block_device_sectors(device);
+    const char *model = "CC2Emu block device";
+
+    memset(buffer, 0, BLOCK_SIZE);
+    buffer[0 * 2] = 0x40;                     // fixed disk
+    buffer[49 * 2 + 1] = 0x02;                // LBA supported
+    buffer[60 * 2] = sectors & 0xff;
+    buffer[60 * 2 + 1] = (sectors >> 8) & 0xff;
+    buffer[61 * 2] = (sectors >> 16) & 0xff;
+    buffer[61 * 2 + 1] = (sectors >> 24) & 0xff;
+    memset(buffer + 27 * 2, ' ', 40);
+    for (int i = 0; model[i]; i++) buffer[27 * 2 + (i ^ 1)] = model[i];
+
+    device->transfer = buffer;
+    device->transfer_pos = 0;
+    device->remaining = 1;
+    device->status = BLOCK_STATUS_READY | BLOCK_STATUS_DATA_REQUEST;
+}
+
+void _block_device_command(struct block_device *device, uint8_t command) {
+    uint8_t *registers = device->registers;
+    uint32_t lba = registers[BLOCK_REG_LBA_0 - BLOCK_REG_DATA] | (registers[BLOCK_REG_LBA_1 - BLOCK_REG_DATA] << 8) |
+        (registers[BLOCK_REG_LBA_2 - BLOCK_REG_DATA] << 16) | ((uint32_t)(registers[BLOCK_REG_LBA_3 - BLOCK_REG_DATA] & 0x0f) << 24);
+    int count = registers[BLOCK_REG_COUNT - BLOCK_REG_DATA] ? registers[BLOCK_REG_COUNT - BLOCK_REG_DATA] : 256;
+
+    device->command = command;
+    registers[BLOCK_REG_ERROR - BLOCK_REG_DATA] = 0;
+    if (!device->data) {
+        _block_device_error(device, BLOCK_ERROR_ABORTED);
+        return;
+    }
+
+    switch (command) {
+        case BLOCK_COMMAND_READ:
+        case BLOCK_COMMAND_WRITE:
+            if ((uint64_t)lba + count > _block_device_sectors(device)) {
+                _block_device_error(device, BLOCK_ERROR_NOT_FOUND);
+                return;
+            }
+            if (command == BLOCK_COMMAND_WRITE && device->is_write_protect) {
+                _block_device_error(device, BLOCK_ERROR_ABORTED);
+                return;
+            }
+            _block_device_set_lba(device, lba);
+            device->remaining = count;
+            if (command == BLOCK_COMMAND_READ) {
+                _block_device_next_read(device);
+            } else {
+                device->transfer = NULL;
+                device->transfer_pos = 0;
+                device->status = BLOCK_STATUS_READY | BLOCK_STATUS_DATA_REQUEST;
+            }
+            break;
+        case BLOCK_COMMAND_IDENTIFY:
+            _block_device_identify(device);
+            break;
+        case BLOCK_COMMAND_FLUSH:
+#ifdef _WIN32
+            FlushViewOfFile(device->data, 0);
+#else
+            if (!device->is_write_protect) msync(device->data, device->length, MS_ASYNC);
+#endif
+            device->status = BLOCK_STATUS_READY;
+            break;
+        default:
+            log_message(LOG_ERROR, "Unknown block device command %02X", command);
+            _block_device_error(device, BLOCK_ERROR_ABORTED);
+            break;
+    }
+}
+
+uint8_t _block_device_read_data(struct block_device *device) {
+    if (!(device->status & BLOCK_STATUS_DATA_REQUEST) || !device->transfer) return 0xff;
+
+    uint8_t value = device->transfer[device->transfer_pos++];
+    if (device->transfer_pos < BLOCK_SIZE) return value;
+
+    device->remaining--;
+    if (device->remaining) {
+        _block_device_set_lba(device, device->lba + 1);
+        _block_device_next_read(device);
+    } else {
+        device->transfer = NULL;
+        device->status = BLOCK_STATUS_READY;
+    }
+    return value;
+}
+
+uint8_t block_device_read_register(void *data, uint16_t addr) {
+    struct block_device *device = data;
+
+    addr &= 0x1f;
+    if (addr < BLOCK_REG_DATA || addr > BLOCK_REG_COMMAND) return 0xff;
+
+    switch (addr) {
+        case BLOCK_REG_DATA:
+            return _block_device_read_data(device);
+        case BLOCK_REG_COMMAND:
+            return device->status;
+        default:
+            return device->registers[addr - BLOCK_REG_DATA];
+    }
+}
+
+void block_device_write_register(void *data, uint16_t addr, uint8_t value) {
+    struct block_device *device = data;
+
+    addr &= 0x1f;
+    if (addr < BLOCK_REG_DATA || addr > BLOCK_REG_COMMAND) return;
+
+    switch (addr) {
+        case BLOCK_REG_DATA:
+            if (!(device->status & BLOCK_STATUS_DATA_REQUEST) || device->command != BLOCK_COMMAND_WRITE) return;
+            device->buffer[device->transfer_pos++] = value;
+            if (device->transfer_pos >= BLOCK_SIZE) _block_device_end_write(device);
+            break;
+        case BLOCK_REG_COMMAND:
+            _block_device_command(device, value);
+            break;
+        case BLOCK_REG_ERROR:
+            // features, nothing to set
+            break;
+        default:
+            device->registers[addr - BLOCK_REG_DATA] = value;
+            break;
+    }
+}
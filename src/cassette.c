@@ -0,0 +1,872 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <SDL3/SDL_audio.h>
+#include <math.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "cassette.h"
+#include "settings.h"
+#include "utils.h"
+
+/*
+    The cassette signal is FSK, a cycle of 1200Hz is bit 0 and a cycle of 2400Hz is bit 1.
+    With the 9600Hz samples a bit 0 cycle is 8 samples long and a bit 1 cycle is 4 samples long.
+*/
+#define CASSETTE_BIT_0_SAMPLES 8
+#define CASSETTE_BIT_1_SAMPLES 4
+#define CASSETTE_BIT_THRESHOLD_SAMPLES 6
+#define CASSETTE_MAX_CYCLE_SAMPLES 16
+#define CASSETTE_SYNC_SEARCH_SAMPLES (CASSETTE_SAMPLE_RATE * 30)  // don't search for a block more than 30 seconds ahead
+#define CASSETTE_MAX_BLOCK_SAMPLES (258 * 8 * CASSETTE_MAX_CYCLE_SAMPLES)  // type, length, data and checksum
+#define CASSETTE_LEADER_BYTE 0x55
+#define CASSETTE_SYNC_BYTE 0x3c
+
+#define CASSETTE_WAV_CHUNK_SIZE 0x4000  // bytes read from the wav file at once
+#define CASSETTE_DEMODULATE_SILENCE 0.002f  // envelope of the silence, about -54 dB of the full scale
+
+#define CASSETTE_RECORD_BUFFER_SIZE 0x100000
+#define CASSETTE_RECORD_FLUSH_MS 50
+#define CASSETTE_RECORD_LEVEL_HIGH 2.6  // DAC level hysteresis around the middle of the sine wave
+#define CASSETTE_RECORD_LEVEL_LOW 1.8
+#define CASSETTE_RECORD_BIT_THRESHOLD_NS (1000000000 / 1800)
+#define CASSETTE_RECORD_MAX_CYCLE_NS (1000000000 / 600)
+
+// one sine cycle for each bit value, it starts just after the rising edge
+static const uint8_t _cas_wave_0[CASSETTE_BIT_0_SAMPLES] = {166, 220, 220, 166, 90, 36, 36, 90};
+static const uint8_t _cas_wave_1[CASSETTE_BIT_1_SAMPLES] = {199, 199, 57, 57};
+
+
+struct cassette_status *cassette_create(void) {
+    struct cassette_status *cassette = malloc(sizeof(struct cassette_status));
+    memset(cassette, 0, sizeof(struct cassette_status));
+
+    return cassette;
+}
+
+void _wav_stream_close(struct cassette_status *cassette) {
+    if (cassette->_wav_converter) {
+        SDL_DestroyAudioStream(cassette->_wav_converter);
+        cassette->_wav_converter = NULL;
+    }
+    if (cassette->_wav_file) {
+        SDL_CloseIO(cassette->_wav_file);
+        cassette->_wav_file = NULL;
+    }
+    if (cassette->_wav_window) {
+        free(cassette->_wav_window);
+        cassette->_wav_window = NULL;
+    }
+    cassette->_wav_window_start = 0;
+    cassette->_wav_window_end = 0;
+}
+
+void cassette_unload(struct cassette_status *cassette) {
+    _wav_stream_close(cassette);
+    if (cassette->audio_buf) {
+        SDL_free(cassette->audio_buf);
+        cassette->audio_buf = NULL;
+    }
+    if (cassette->cas_data) {
+        free(cassette->cas_data);
+        cassette->cas_data = NULL;
+    }
+    cassette->format = CASSETTE_FORMAT_NONE;
+    cassette->audio_len = 0;
+    cassette->audio_location = 0;
+    cassette->cas_length = 0;
+    cassette->_cas_location = 0;
+    cassette->_cas_byte = 0;
+    cassette->_cas_bit = 0;
+    cassette->_cas_phase = 0;
+    cassette->_sync_search_start = 0;
+    cassette->_sync_search_end = 0;
+}
+
+int _cas_byte_samples(uint8_t value) {
+    int samples = 0;
+    for (int i = 0; i < 8; i++) {
+        samples += (value >> i) & 1 ? CASSETTE_BIT_1_SAMPLES : CASSETTE_BIT_0_SAMPLES;
+    }
+    return samples;
+}
+
+#define _cas_current_bit(cassette) (((cassette)->cas_data[(cassette)->_cas_byte] >> (cassette)->_cas_bit) & 1)
+
+/*
+    Moves the CAS cursor (byte, bit, phase) to the sample location
+    Moving forward is done from the current cursor, whole bytes are skipped when possible
+*/
+void _cas_seek(struct cassette_status *cassette, int location) {
+    if (location < cassette->_cas_location) {
+        cassette->_cas_location = 0;
+        cassette->_cas_byte = 0;
+        cassette->_cas_bit = 0;
+        cassette->_cas_phase = 0;
+    }
+
+    while (cassette->_cas_location < location && cassette->_cas_byte < cassette->cas_length) {
+        if (cassette->_cas_bit == 0 && cassette->_cas_phase == 0) {
+            int byte_samples = _cas_byte_samples(cassette->cas_data[cassette->_cas_byte]);
+            if (cassette->_cas_location + byte_samples <= location) {
+                cassette->_cas_location += byte_samples;
+                cassette->_cas_byte++;
+                continue;
+            }
+        }
+
+        int remaining = (_cas_current_bit(cassette) ? CASSETTE_BIT_1_SAMPLES : CASSETTE_BIT_0_SAMPLES) - cassette->_cas_phase;
+        if (cassette->_cas_location + remaining > location) {
+            cassette->_cas_phase += location - cassette->_cas_location;
+            cassette->_cas_location = location;
+            break;
+        }
+
+        cassette->_cas_location += remaining;
+        cassette->_cas_phase = 0;
+        cassette->_cas_bit++;
+        if (cassette->_cas_bit == 8) {
+            cassette->_cas_bit = 0;
+            cassette->_cas_byte++;
+        }
+    }
+}
+
+// restarts the conversion from the location, the window is emptied
+void _wav_stream_seek(struct cassette_status *cassette, int location) {
+    cassette->_wav_data_read = (int64_t)location * cassette->_wav_freq / cassette->_wav_out_freq * cassette->_wav_frame_size;
+    if (cassette->_wav_data_read > cassette->_wav_data_length) cassette->_wav_data_read = cassette->_wav_data_length;
+
+    SDL_ClearAudioStream(cassette->_wav_converter);
+    SDL_SeekIO(cassette->_wav_file, cassette->_wav_data_offset + cassette->_wav_data_read, SDL_IO_SEEK_SET);
+    cassette->_wav_window_start = location;
+    cassette->_wav_window_end = location;
+}
+
+// converts chunks of the file until the location is in the window, returns 0 if the end of the data is reached
+int _wav_stream_fill(struct cassette_status *cassette, int location) {
+    uint8_t chunk[CASSETTE_WAV_CHUNK_SIZE];
+    int flushed = 0;
+
+    while (location >= cassette->_wav_window_end) {
+        int available = SDL_GetAudioStreamAvailable(cassette->_wav_converter);
+        if (available > 0) {
+            int window_pos = cassette->_wav_window_end & (CASSETTE_WAV_WINDOW_SIZE - 1);
+            if (available > CASSETTE_WAV_WINDOW_SIZE - window_pos) available = CASSETTE_WAV_WINDOW_SIZE - window_pos;
+            int count = SDL_GetAudioStreamData(cassette->_wav_converter, cassette->_wav_window + window_pos, available);
+            if (count <= 0) return 0;
+            cassette->_wav_window_end += count;
+            if (cassette->_wav_window_end - cassette->_wav_window_start > CASSETTE_WAV_WINDOW_SIZE)
+                cassette->_wav_window_start = cassette->_wav_window_end - CASSETTE_WAV_WINDOW_SIZE;
+            continue;
+        }
+
+        if (cassette->_wav_data_read >= cassette->_wav_data_length) {
+            // get the samples kept by the resampler
+            if (flushed) return 0;
+            SDL_FlushAudioStream(cassette->_wav_converter);
+            flushed = 1;
+            continue;
+        }
+
+        int64_t size = cassette->_wav_data_length - cassette->_wav_data_read;
+        if (size > CASSETTE_WAV_CHUNK_SIZE) size = CASSETTE_WAV_CHUNK_SIZE - CASSETTE_WAV_CHUNK_SIZE % cassette->_wav_frame_size;
+        size_t count = SDL_ReadIO(cassette->_wav_file, chunk, (size_t)size);
+        if (!count) {
+            // truncated file
+            cassette->_wav_data_length = cassette->_wav_data_read;
+            continue;
+        }
+        SDL_PutAudioStreamData(cassette->_wav_converter, chunk, (int)count);
+        cassette->_wav_data_read += count;
+    }
+    return 1;
+}
+
+uint8_t _wav_get_sample(struct cassette_status *cassette, int location) {
+    if (!cassette->_wav_file) return cassette->audio_buf[location];
+
+    if (location < cassette->_wav_window_start || location >= cassette->_wav_window_end + CASSETTE_WAV_WINDOW_SIZE) {
+        _wav_stream_seek(cassette, location);
+    }
+    if (location >= cassette->_wav_window_end && !_wav_stream_fill(cassette, location)) return 128;
+    return cassette->_wav_window[location & (CASSETTE_WAV_WINDOW_SIZE - 1)];
+}
+
+uint8_t cassette_get_sample(struct cassette_status *cassette, int location) {
+    if (location < 0 || location >= cassette->audio_len) return 128;
+
+    switch (cassette->format) {
+        case CASSETTE_FORMAT_WAV:
+            return _wav_get_sample(cassette, location);
+        case CASSETTE_FORMAT_CAS:
+            _cas_seek(cassette, location);
+            if (cassette->_cas_byte >= cassette->cas_length) return 128;
+            if (_cas_current_bit(cassette)) return _cas_wave_1[cassette->_cas_phase];
+            return _cas_wave_0[cassette->_cas_phase];
+    }
+    return 128;
+}
+
+// decodes the bit from the cycle length between two rising edges
+int _wav_read_bit(struct cassette_status *cassette, int *location) {
+    int pos = *location;
+    int cycle_start = -1;
+    uint8_t previous = 128;
+    uint8_t sample = 128;
+
+    if (pos >= 0 && pos < cassette->audio_len) {
+        sample = _wav_get_sample(cassette, pos);
+        // continue from the edge that ended the previous cycle
+        if (pos > 0 && _wav_get_sample(cassette, pos - 1) <= 127 && sample > 127) cycle_start = pos;
+    }
+
+    while (pos + 1 < cassette->audio_len) {
+        pos++;
+        previous = sample;
+        sample = _wav_get_sample(cassette, pos);
+        if (previous > 127 || sample <= 127) continue;
+
+        // rising edge
+        if (cycle_start < 0 || pos - cycle_start > CASSETTE_MAX_CYCLE_SAMPLES) {
+            // first edge, or the previous edge was noise/silence
+            cycle_start = pos;
+            continue;
+        }
+        *location = pos;
+        return pos - cycle_start < CASSETTE_BIT_THRESHOLD_SAMPLES ? 1 : 0;
+    }
+    *location = pos;
+    return -1;
+}
+
+// the bits are read directly from the byte stream, a partially played bit is skipped
+int _cas_read_bit(struct cassette_status *cassette, int *location) {
+    _cas_seek(cassette, *location);
+    if (cassette->_cas_phase) {
+        _cas_seek(cassette, *location + (_cas_current_bit(cassette) ? CASSETTE_BIT_1_SAMPLES : CASSETTE_BIT_0_SAMPLES) - cassette->_cas_phase);
+    }
+    if (cassette->_cas_byte >= cassette->cas_length) {
+        *location = cassette->audio_len;
+        return -1;
+    }
+
+    int bit = _cas_current_bit(cassette);
+    *location = cassette->_cas_location + (bit ? CASSETTE_BIT_1_SAMPLES : CASSETTE_BIT_0_SAMPLES);
+    return bit;
+}
+
+// returns the next bit starting from *location, or -1 when the end of the cassette is reached
+int _cassette_read_bit(struct cassette_status *cassette, int *location) {
+    switch (cassette->format) {
+        case CASSETTE_FORMAT_WAV: return _wav_read_bit(cassette, location);
+        case CASSETTE_FORMAT_CAS: return _cas_read_bit(cassette, location);
+    }
+    return -1;
+}
+
+int _cassette_read_byte(struct cassette_status *cassette, int *location) {
+    int value = 0;
+    for (int i = 0; i < 8; i++) {
+        int bit = _cassette_read_bit(cassette, location);
+        if (bit < 0) return -1;
+        value |= bit << i;  // LSB first
+    }
+    return value;
+}
+
+/*
+    Reads the next standard block (leader, sync byte, type, length, data, checksum) from the cassette
+    On success the cassette location is moved after the block and 0 is returned
+    On failure the cassette location isn't changed, so the caller can fall back to the normal playback
+    A streamed WAV file is only searched as far as its window holds, the playback position stays in it
+*/
+int cassette_read_block(struct cassette_status *cassette, uint8_t *block_type, uint8_t *block_length, uint8_t *block_data) {
+    if (cassette->format == CASSETTE_FORMAT_NONE || cassette->audio_location >= cassette->audio_len) return 1;
+
+    int location = cassette->audio_location;
+    if (location >= cassette->_sync_search_start && location < cassette->_sync_search_end) return 1;
+
+    int search_end = location + (cassette->_wav_file ? CASSETTE_WAV_WINDOW_SIZE - CASSETTE_MAX_BLOCK_SAMPLES : CASSETTE_SYNC_SEARCH_SAMPLES);
+    uint16_t sync = 0;
+
+    // the leader byte followed by the sync byte
+    while (sync != ((CASSETTE_SYNC_BYTE << 8) | CASSETTE_LEADER_BYTE)) {
+        int bit = _cassette_read_bit(cassette, &location);
+        if (bit < 0 || location > search_end) {
+            cassette->_sync_search_start = cassette->audio_location;
+            cassette->_sync_search_end = location;
+            return 1;
+        }
+        sync = (sync >> 1) | (bit << 15);
+    }
+
+    int type = _cassette_read_byte(cassette, &location);
+    int length = _cassette_read_byte(cassette, &location);
+    if (type < 0 || length < 0) return 1;
+
+    uint8_t checksum = type + length;
+    for (int i = 0; i < length; i++) {
+        int value = _cassette_read_byte(cassette, &location);
+        if (value < 0) return 1;
+        block_data[i] = value;
+        checksum += value;
+    }
+
+    int block_checksum = _cassette_read_byte(cassette, &location);
+    if (block_checksum != checksum) {
+        log_message(LOG_INFO, "Cassette fast load: checksum error at %d", cassette->audio_location);
+        return 1;
+    }
+
+    *block_type = type;
+    *block_length = length;
+    cassette->audio_location = location;
+    return 0;
+}
+
+/*
+    Parses the RIFF header and prepares the streaming conversion to mono out_format at out_freq (0 keeps the file rate)
+    The window holds U8 samples, the other formats are only read in order with _wav_stream_read
+    Only the PCM (8, 16, 32 bits) and float (32 bits) formats are streamed, returns 1 for the others
+*/
+int _wav_stream_open(struct cassette_status *cassette, const char *path, int out_freq, SDL_AudioFormat out_format) {
+    SDL_IOStream *file = SDL_IOFromFile(path, "rb");
+    char chunk_id[4];
+    Uint32 chunk_size;
+    SDL_AudioSpec spec = {0};
+    int frame_size = 0;
+
+    if (!file) {
+        return 1;
+    }
+
+    if (SDL_ReadIO(file, chunk_id, 4) != 4 || memcmp(chunk_id, "RIFF", 4) ||
+            !SDL_ReadU32LE(file, &chunk_size) ||
+            SDL_ReadIO(file, chunk_id, 4) != 4 || memcmp(chunk_id, "WAVE", 4)) {
+        SDL_CloseIO(file);
+        return 1;
+    }
+
+    while (SDL_ReadIO(file, chunk_id, 4) == 4 && SDL_ReadU32LE(file, &chunk_size)) {
+        int64_t chunk_start = SDL_TellIO(file);
+
+        if (!memcmp(chunk_id, "fmt ", 4)) {
+            Uint16 tag, channels, block_align, bits, sub_format;
+            Uint32 freq, byte_rate;
+            if (!SDL_ReadU16LE(file, &tag) || !SDL_ReadU16LE(file, &channels) ||
+                    !SDL_ReadU32LE(file, &freq) || !SDL_ReadU32LE(file, &byte_rate) ||
+                    !SDL_ReadU16LE(file, &block_align) || !SDL_ReadU16LE(file, &bits)) break;
+            if (tag == 0xfffe && chunk_size >= 26) {
+                // extensible format, the format tag is the start of the sub format GUID
+                SDL_SeekIO(file, chunk_start + 24, SDL_IO_SEEK_SET);
+                if (!SDL_ReadU16LE(file, &sub_format)) break;
+                tag = sub_format;
+            }
+
+            spec.channels = channels;
+            spec.freq = freq;
+            if (tag == 1 && bits == 8) spec.format = SDL_AUDIO_U8;
+            else if (tag == 1 && bits == 16) spec.format = SDL_AUDIO_S16LE;
+            else if (tag == 1 && bits == 32) spec.format = SDL_AUDIO_S32LE;
+            else if (tag == 3 && bits == 32) spec.format = SDL_AUDIO_F32LE;
+            else break;
+            if (!channels || !freq || block_align != channels * bits / 8) break;
+            frame_size = block_align;
+        } else if (!memcmp(chunk_id, "data", 4)) {
+            if (!frame_size) break;
+
+            int64_t file_size = SDL_GetIOSize(file);
+            cassette->_wav_data_offset = chunk_start;
+            cassette->_wav_data_length = chunk_size;
+            if (file_size > 0 && chunk_start + cassette->_wav_data_length > file_size) {
+                cassette->_wav_data_length = file_size - chunk_start;
+            }
+            cassette->_wav_frame_size = frame_size;
+            cassette->_wav_freq = spec.freq;
+            cassette->_wav_out_freq = out_freq ? out_freq : spec.freq;
+
+            SDL_AudioSpec dest_spec = {
+                .channels  = 1,
+                .format  = out_format,
+                .freq = cassette->_wav_out_freq
+            };
+            cassette->_wav_converter = SDL_CreateAudioStream(&spec, &dest_spec);
+            cassette->_wav_window = malloc(CASSETTE_WAV_WINDOW_SIZE);
+            if (!cassette->_wav_converter || !cassette->_wav_window) {
+                log_message(LOG_ERROR, "Error cassette loading: %s: %s", path, SDL_GetError());
+                cassette->_wav_file = file;
+                _wav_stream_close(cassette);
+                return 1;
+            }
+            cassette->_wav_file = file;
+            cassette->audio_len = (int)(cassette->_wav_data_length / frame_size * cassette->_wav_out_freq / spec.freq);
+            _wav_stream_seek(cassette, 0);
+
+            log_message(LOG_INFO, "Streaming from format=%04X, channels=%d, freq=%d", spec.format, spec.channels, spec.freq);
+            return 0;
+        }
+
+        if (SDL_SeekIO(file, chunk_start + chunk_size + (chunk_size & 1), SDL_IO_SEEK_SET) < 0) break;
+    }
+
+    SDL_CloseIO(file);
+    return 1;
+}
+
+// the next converted samples in order, without the window. Returns the bytes read, 0 at the end of the data
+int _wav_stream_read(struct cassette_status *cassette, void *buffer, int length) {
+    uint8_t chunk[CASSETTE_WAV_CHUNK_SIZE];
+
+    while (1) {
+        int count = SDL_GetAudioStreamData(cassette->_wav_converter, buffer, length);
+        if (count) return count > 0 ? count : 0;
+
+        if (cassette->_wav_data_read >= cassette->_wav_data_length) {
+            // the samples kept by the resampler, then the end
+            SDL_FlushAudioStream(cassette->_wav_converter);
+            count = SDL_GetAudioStreamData(cassette->_wav_converter, buffer, length);
+            return count > 0 ? count : 0;
+        }
+
+        int64_t size = cassette->_wav_data_length - cassette->_wav_data_read;
+        if (size > CASSETTE_WAV_CHUNK_SIZE) size = CASSETTE_WAV_CHUNK_SIZE - CASSETTE_WAV_CHUNK_SIZE % cassette->_wav_frame_size;
+        size_t read = SDL_ReadIO(cassette->_wav_file, chunk, (size_t)size);
+        if (!read) {
+            // truncated file
+            cassette->_wav_data_length = cassette->_wav_data_read;
+            continue;
+        }
+        SDL_PutAudioStreamData(cassette->_wav_converter, chunk, (int)read);
+        cassette->_wav_data_read += read;
+    }
+}
+
+int _cassette_load_wav(struct cassette_status *cassette, const char *path) {
+    SDL_AudioSpec spec;
+    Uint32 audio_len;
+
+    if (!_wav_stream_open(cassette, path, CASSETTE_SAMPLE_RATE, SDL_AUDIO_U8)) {
+        cassette->format = CASSETTE_FORMAT_WAV;
+        log_message(LOG_INFO, "Loaded wav file %s %d", path, cassette->audio_len);
+        return 0;
+    }
+
+    if (!SDL_LoadWAV(path, &spec, &cassette->audio_buf, &audio_len)) {
+        log_message(LOG_ERROR, "Error cassette loading: %s: %s", path, SDL_GetError());
+        return 1;
+    }
+    cassette->audio_len = audio_len;
+
+    if (spec.format != SDL_AUDIO_U8 || spec.channels != 1 || spec.freq != CASSETTE_SAMPLE_RATE) {
+        log_message(LOG_INFO, "Converting from format=%04X, channels=%d, freq=%d", spec.format, spec.channels, spec.freq);
+
+        SDL_AudioSpec dest_spec = {
+            .channels  = 1,
+            .format  = SDL_AUDIO_U8,
+            .freq = CASSETTE_SAMPLE_RATE
+        };
+        int dest_audio_len;
+        Uint8 *dest_audio_buf;
+
+        if (!SDL_ConvertAudioSamples(&spec, cassette->audio_buf, cassette->audio_len, &dest_spec, &dest_audio_buf, &dest_audio_len)) {
+            log_message(LOG_ERROR, "Format converting failed: %s", SDL_GetError());
+            cassette_unload(cassette);
+            return 1;
+        }
+        SDL_free(cassette->audio_buf);
+        cassette->audio_buf = dest_audio_buf;
+        cassette->audio_len = dest_audio_len;
+    }
+    cassette->format = CASSETTE_FORMAT_WAV;
+    log_message(LOG_INFO, "Loaded wav file %s %d", path, cassette->audio_len);
+    return 0;
+}
+
+int _cassette_load_cas(struct cassette_status *cassette, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        log_message(LOG_ERROR, "Error cassette loading: %s: %s", path, strerror(errno));
+        return 1;
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    if (size <= 0) {
+        log_message(LOG_ERROR, "Error cassette loading: %s: empty file", path);
+        fclose(fp);
+        return 1;
+    }
+
+    cassette->cas_data = malloc(size);
+    if (!cassette->cas_data || fread(cassette->cas_data, 1, size, fp) != (size_t)size) {
+        log_message(LOG_ERROR, "Error cassette loading: %s: read failed", path);
+        fclose(fp);
+        cassette_unload(cassette);
+        return 1;
+    }
+    fclose(fp);
+
+    cassette->cas_length = size;
+    cassette->audio_len = 0;
+    for (size_t i = 0; i < cassette->cas_length; i++) {
+        cassette->audio_len += _cas_byte_samples(cassette->cas_data[i]);
+    }
+    cassette->format = CASSETTE_FORMAT_CAS;
+    log_message(LOG_INFO, "Loaded cas file %s %zu bytes, %d samples", path, cassette->cas_length, cassette->audio_len);
+    return 0;
+}
+
+/*
+    Demodulates the WAV file at its own sample rate into a bit stream saved as a .cas file
+    The bits are decoded from the time between rising zero crossings, a DC filter and a hysteresis
+    relative to the signal envelope make it tolerant to the noise and the level changes of real tapes.
+    The float samples keep the dynamic range of the quiet 16 bits recordings
+    The bits aren't aligned to the original bytes, which doesn't matter for the playback or the fast load
+    The file is written aside and renamed, an interrupted conversion never leaves a truncated cache
+*/
+int _cassette_demodulate_wav(struct cassette_status *cassette, const char *path, const char *cas_path) {
+    struct cassette_status *wav = cassette_create();
+    if (_wav_stream_open(wav, path, 0, SDL_AUDIO_F32)) {
+        free(wav);
+        return 1;
+    }
+
+    char *temp_path = malloc(strlen(cas_path) + 5);
+    sprintf(temp_path, "%s.tmp", cas_path);
+    FILE *fp = fopen(temp_path, "wb");
+    if (!fp) {
+        log_message(LOG_ERROR, "Error writing %s: %s", temp_path, strerror(errno));
+        free(temp_path);
+        cassette_unload(wav);
+        free(wav);
+        return 1;
+    }
+
+    float freq = wav->_wav_out_freq;
+    float bit_threshold = freq / 1800;   // between the 1200Hz and 2400Hz cycles
+    float max_cycle = freq / 600;        // longer cycles are silence or noise
+    float dc_alpha = 1 / (freq * 0.05f);
+    float envelope_decay = 1 - 1 / (freq * 0.02f);
+    float dc = 0, envelope = 0;
+    int high = 0;
+    int last_rise = -1;
+    uint8_t value = 0;
+    int bit_pos = 0;
+    long bit_count = 0;
+    float samples[0x1000];
+    int sample_count = 0;
+    int sample_pos = 0;
+
+    for (int i = 0; ; i++) {
+        if (sample_pos == sample_count) {
+            if (wav->audio_len) SDL_SetAtomicInt(&cassette->load_progress, 1 + (int)((int64_t)i * 98 / wav->audio_len));
+            sample_count = _wav_stream_read(wav, samples, sizeof(samples)) / (int)sizeof(float);
+            sample_pos = 0;
+            if (!sample_count) break;
+        }
+
+        float x = samples[sample_pos++];
+        dc += (x - dc) * dc_alpha;
+        x -= dc;
+
+        float magnitude = fabsf(x);
+        envelope = magnitude > envelope ? magnitude : envelope * envelope_decay;
+        float hysteresis = envelope * 0.15f;
+        if (envelope < CASSETTE_DEMODULATE_SILENCE) {
+            // silence
+            high = 0;
+            last_rise = -1;
+            continue;
+        }
+
+        if (high && x < -hysteresis) {
+            high = 0;
+        } else if (!high && x > hysteresis) {
+            high = 1;
+            if (last_rise >= 0 && i - last_rise <= max_cycle) {
+                value |= (i - last_rise < bit_threshold ? 1 : 0) << bit_pos;
+                bit_count++;
+                if (++bit_pos == 8) {
+                    fputc(value, fp);
+                    value = 0;
+                    bit_pos = 0;
+                }
+            }
+            last_rise = i;
+        }
+    }
+    if (bit_pos) fputc(value, fp);
+
+    int ok = !ferror(fp) && bit_count;
+    if (ok) ok = fflush(fp) == 0;
+#ifdef _WIN32
+    if (ok) ok = _commit(_fileno(fp)) == 0;
+#else
+    if (ok) ok = fsync(fileno(fp)) == 0;
+#endif
+    if (fclose(fp)) ok = 0;
+    cassette_unload(wav);
+    free(wav);
+
+#ifdef _WIN32
+    if (ok) ok = MoveFileExA(temp_path, cas_path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    if (ok) ok = rename(temp_path, cas_path) == 0;
+#endif
+    if (!ok) {
+        log_message(LOG_ERROR, "Error demodulating %s", path);
+        remove(temp_path);
+        free(temp_path);
+        return 1;
+    }
+    free(temp_path);
+    log_message(LOG_INFO, "Demodulated %s to %s, %ld bits", path, cas_path, bit_count);
+    return 0;
+}
+
+// uses the demodulated bit stream cached next to the WAV file, it is created when missing or older than the WAV file
+int _cassette_load_demodulated_wav(struct cassette_status *cassette, const char *path) {
+    SDL_PathInfo wav_info, cas_info;
+    size_t cas_path_length = strlen(path) + strlen(".cas") + 1;
+    char *cas_path = malloc(cas_path_length);
+    snprintf(cas_path, cas_path_length, "%s.cas", path);
+
+    if (!SDL_GetPathInfo(path, &wav_info) || !SDL_GetPathInfo(cas_path, &cas_info) || cas_info.modify_time < wav_info.modify_time) {
+        if (_cassette_demodulate_wav(cassette, path, cas_path)) {
+            free(cas_path);
+            return 1;
+        }
+    }
+
+    int ret = _cassette_load_cas(cassette, cas_path);
+    free(cas_path);
+    return ret;
+}
+
+int cassette_load(struct cassette_status *cassette, const char *path) {
+    cassette_unload(cassette);
+
+    if (!path) {
+        return 0;
+    }
+
+    if (str_ends_with(path, ".cas")) {
+        return _cassette_load_cas(cassette, path);
+    }
+    if (app_settings.cassette_wav_demodulate && !_cassette_load_demodulated_wav(cassette, path)) {
+        return 0;
+    }
+    return _cassette_load_wav(cassette, path);
+}
+
+
+void _wav_write_header(FILE *fp, uint32_t data_length) {
+    uint8_t header[44];
+    uint32_t riff_length = 36 + data_length;
+
+    memcpy(header, "RIFF", 4);
+    for (int i = 0; i < 4; i++) header[4 + i] = (riff_length >> (i * 8)) & 0xff;
+    memcpy(header + 8, "WAVEfmt ", 8);
+    header[16] = 16; header[17] = 0; header[18] = 0; header[19] = 0;  // fmt chunk length
+    header[20] = 1; header[21] = 0;  // PCM
+    header[22] = 1; header[23] = 0;  // mono
+    for (int i = 0; i < 4; i++) header[24 + i] = (CASSETTE_SAMPLE_RATE >> (i * 8)) & 0xff;  // sample rate
+    for (int i = 0; i < 4; i++) header[28 + i] = (CASSETTE_SAMPLE_RATE >> (i * 8)) & 0xff;  // byte rate
+    header[32] = 1; header[33] = 0;  // block align
+    header[34] = 8; header[35] = 0;  // bits per sample
+    memcpy(header + 36, "data", 4);
+    for (int i = 0; i < 4; i++) header[40 + i] = (data_length >> (i * 8)) & 0xff;
+
+    fwrite(header, 1, sizeof(header), fp);
+}
+
+int SDLCALL _cassette_record_writer(void *data) {
+    struct cassette_recorder *recorder = data;
+    uint8_t chunk[0x4000];
+
+    for (;;) {
+        // read the flag before draining, so everything pushed before the stop is written
+        int running = SDL_GetAtomicInt(&recorder->running);
+        uint32_t count;
+        while ((count = ring_buffer_read(&recorder->buffer, chunk, sizeof(chunk))) > 0) {
+            size_t written = fwrite(chunk, 1, count, recorder->fp);
+            SDL_AddAtomicInt(&recorder->data_length, (int)written);
+            if (written != count) {
+                // the emulation stops the recording when it sees the error
+                log_message(LOG_ERROR, "Error writing the cassette recording: %s", strerror(errno));
+                SDL_SetAtomicInt(&recorder->write_error, 1);
+                return 1;
+            }
+        }
+        if (!running) break;
+        SDL_Delay(CASSETTE_RECORD_FLUSH_MS);
+    }
+    return 0;
+}
+
+void _cassette_record_push(struct cassette_recorder *recorder, uint8_t value) {
+    if (!ring_buffer_write(&recorder->buffer, &value, 1)) {
+        recorder->overruns++;
+    }
+}
+
+/*
+    CAS bytes from the recorded bits: the leader bits are counted until the $55 $3C sync is found, then the
+    leader is written as $55 bytes and the bytes of the block are packed from the sync byte, so they are
+    aligned with the bytes written by the program. The alignment is searched again after the checksum
+*/
+void _cassette_record_bit(struct cassette_recorder *recorder, int bit) {
+    if (!recorder->_synced) {
+        recorder->_shift = (recorder->_shift >> 1) | (bit << 15);   // least significant bit first
+        recorder->_leader_bits++;
+        if (recorder->_shift != 0x3c55) return;
+
+        int leader_length = (recorder->_leader_bits - 8) / 8;
+        for (int i = 0; i < (leader_length ? leader_length : 1); i++) _cassette_record_push(recorder, 0x55);
+        _cassette_record_push(recorder, 0x3c);
+        recorder->_synced = 1;
+        recorder->_leader_bits = 0;
+        recorder->_shift = 0;
+        recorder->_block_pos = 0;
+        recorder->_block_length = 3;   // type, length and checksum, the data length is added when it's received
+        recorder->_value = 0;
+        recorder->_bit_pos = 0;
+        return;
+    }
+
+    if (bit) recorder->_value |= 1 << recorder->_bit_pos;
+    if (++recorder->_bit_pos < 8) return;
+
+    _cassette_record_push(recorder, recorder->_value);
+    if (recorder->_block_pos == 1) recorder->_block_length += recorder->_value;
+    recorder->_value = 0;
+    recorder->_bit_pos = 0;
+    if (++recorder->_block_pos == recorder->_block_length) recorder->_synced = 0;
+}
+
+// at a gap or at the end: the partial byte of a block or the trailing leader bytes
+void _cassette_record_flush_bits(struct cassette_recorder *recorder) {
+    if (recorder->_synced) {
+        if (recorder->_bit_pos) _cassette_record_push(recorder, recorder->_value);
+    } else {
+        for (int i = 0; i < recorder->_leader_bits / 8; i++) _cassette_record_push(recorder, 0x55);
+    }
+    recorder->_synced = 0;
+    recorder->_leader_bits = 0;
+    recorder->_shift = 0;
+    recorder->_value = 0;
+    recorder->_bit_pos = 0;
+}
+
+int cassette_record_start(struct cassette_status *cassette, const char *path) {
+    cassette_record_stop(cassette);
+
+    struct cassette_recorder *recorder = malloc(sizeof(struct cassette_recorder));
+    memset(recorder, 0, sizeof(struct cassette_recorder));
+    recorder->format = str_ends_with(path, ".cas") ? CASSETTE_FORMAT_CAS : CASSETTE_FORMAT_WAV;
+
+    recorder->fp = fopen(path, "wb");
+    if (!recorder->fp) {
+        log_message(LOG_ERROR, "Error recording to %s: %s", path, strerror(errno));
+        free(recorder);
+        return 1;
+    }
+    if (recorder->format == CASSETTE_FORMAT_WAV) {
+        // updated with the length when the recording is stopped
+        _wav_write_header(recorder->fp, 0);
+    }
+
+    if (ring_buffer_init(&recorder->buffer, CASSETTE_RECORD_BUFFER_SIZE)) {
+        log_message(LOG_ERROR, "Error recording to %s: buffer allocation error", path);
+        fclose(recorder->fp);
+        free(recorder);
+        return 1;
+    }
+
+    SDL_SetAtomicInt(&recorder->running, 1);
+    recorder->thread = SDL_CreateThread(_cassette_record_writer, "cassette writer", recorder);
+    if (!recorder->thread) {
+        log_message(LOG_ERROR, "Error recording to %s: %s", path, SDL_GetError());
+        ring_buffer_free(&recorder->buffer);
+        fclose(recorder->fp);
+        free(recorder);
+        return 1;
+    }
+
+    cassette->recorder = recorder;
+    log_message(LOG_INFO, "Recording cassette to %s", path);
+    return 0;
+}
+
+void cassette_record_stop(struct cassette_status *cassette) {
+    struct cassette_recorder *recorder = cassette->recorder;
+    if (!recorder) return;
+    cassette->recorder = NULL;
+
+    if (recorder->format == CASSETTE_FORMAT_CAS) _cassette_record_flush_bits(recorder);
+
+    SDL_SetAtomicInt(&recorder->running, 0);
+    SDL_WaitThread(recorder->thread, NULL);
+
+    uint32_t data_length = (uint32_t)SDL_GetAtomicInt(&recorder->data_length);
+    if (recorder->format == CASSETTE_FORMAT_WAV) {
+        fseek(recorder->fp, 0L, SEEK_SET);
+        _wav_write_header(recorder->fp, data_length);
+    }
+    if (fclose(recorder->fp)) {
+        log_message(LOG_ERROR, "Error closing the cassette recording: %s", strerror(errno));
+    }
+    if (recorder->overruns) {
+        log_message(LOG_ERROR, "Cassette recording dropped %u bytes", recorder->overruns);
+    }
+    if (SDL_GetAtomicInt(&recorder->write_error)) {
+        log_message(LOG_ERROR, "Cassette recording stopped by a write error, the file is truncated at %u bytes", data_length);
+    } else {
+        log_message(LOG_INFO, "Cassette recording stopped, %u bytes", data_length);
+    }
+
+    ring_buffer_free(&recorder->buffer);
+    free(recorder);
+}
+
+// WAV recording, called at CASSETTE_SAMPLE_RATE while the motor is on
+void cassette_record_sample(struct cassette_status *cassette, uint8_t sample) {
+    struct cassette_recorder *recorder = cassette->recorder;
+    // after a write error the samples are dropped until the UI stops the recording
+    if (!recorder || recorder->format != CASSETTE_FORMAT_WAV || SDL_GetAtomicInt(&recorder->write_error)) return;
+
+    _cassette_record_push(recorder, sample);
+}
+
+// CAS recording, called on each DAC change while the motor is on
+void cassette_record_level(struct cassette_status *cassette, float level, uint64_t time_ns) {
+    struct cassette_recorder *recorder = cassette->recorder;
+    if (!recorder || recorder->format != CASSETTE_FORMAT_CAS || SDL_GetAtomicInt(&recorder->write_error)) return;
+
+    if (recorder->_level_high) {
+        if (level < CASSETTE_RECORD_LEVEL_LOW) recorder->_level_high = 0;
+        return;
+    }
+    if (level <= CASSETTE_RECORD_LEVEL_HIGH) return;
+
+    // rising edge, the cycle length gives the bit
+    recorder->_level_high = 1;
+    uint64_t cycle_ns = time_ns - recorder->_last_rise_ns;
+    recorder->_last_rise_ns = time_ns;
+    if (cycle_ns > CASSETTE_RECORD_MAX_CYCLE_NS) {
+        // first cycle after a gap, the next block starts with its own leader
+        _cassette_record_flush_bits(recorder);
+        return;
+    }
+
+    _cassette_record_bit(recorder, cycle_ns < CASSETTE_RECORD_BIT_THRESHOLD_NS);
+}
@@ -22,25 +22,41 @@ struct {
     enum nk_collapse_states settings_logs_state;
     enum nk_collapse_states settings_cartridge_state;
     enum nk_collapse_states settings_disks_state;
+    enum nk_collapse_states settings_disk_activity_state;
     enum nk_collapse_states settings_cassette_state;
     enum nk_collapse_states settings_joystick_state;
+    enum nk_collapse_states settings_sound_state;
 
     SDL_Texture *joystick_icon;
     SDL_Texture *joystick_kbd_icon;
 
     char *empty_value_place_holder;  // just a buffer that represents an empty buffer
+
+    // the sector that gets a CRC error, for testing
+    int crc_error_drive;
+    int crc_error_track;
+    int crc_error_sector;
+
+    char disk_activity[0x8000];   // statistics and trace of the disk controller
+
+    struct machine_snapshot snapshot;   // the machine state shown by this pass
+    bool recording_stop_posted;
 } controls;
 
 void error_msg(const char *msg) {
     SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", msg, controls.machine->window);
 }
 
-void error_general_file(const char *path) {
+void _error_file(const char *path, int error) {
     char error_buffer[2000];
-    snprintf(error_buffer, sizeof(error_buffer), "Error opening file '%s': %s", path, strerror(errno));
+    snprintf(error_buffer, sizeof(error_buffer), "Error opening file '%s': %s", path, strerror(error));
     error_msg(error_buffer);
 }
 
+void error_general_file(const char *path) {
+    _error_file(path, errno);
+}
+
 SDL_Texture *init_icon_texture(char **icon) {
     SDL_Surface *surface = IMG_ReadXPMFromArray(icon);
     if (!surface) {
@@ -54,6 +70,8 @@ void controls_init(struct machine_status *machine) {
     controls.ctx = nk_sdl_init(machine->window, machine->renderer);
     controls.machine = machine;
     controls.empty_value_place_holder = strdup("<Empty>");
+    controls.crc_error_drive = 1;
+    controls.crc_error_sector = 1;
 
     controls.joystick_icon = init_icon_texture(joystick_xpm);
     controls.joystick_kbd_icon = init_icon_texture(joystick_kbd_xpm);
@@ -82,6 +100,7 @@ void _settings_open_window(bool open_all)
     controls.settings_disks_state = section_state;
     controls.settings_cassette_state = section_state;
     controls.settings_joystick_state = section_state;
+    controls.settings_sound_state = section_state;
 
     controls.machine->settings_page_is_open = true;
 }
@@ -98,11 +117,139 @@ void _settings_toggle_window(bool open_all)
 void machine_reset_and_save(void) {
     _settings_close_window();
     keyboard_buffer_reset();
-    machine_reset(controls.machine);
-    disk_drive_reset(controls.machine->disk_drive);
+    machine_post_reset(controls.machine, true);
+    settings_save();
+}
+
+/*
+    The results below run on the main thread, they show the errors and save the settings
+    The main thread is the only one changing the settings
+*/
+static void _file_error_ui(struct machine_status *machine, int error, const char *path, void *data) {
+    _error_file(path, error);
+}
+
+static void _rom_loaded_ui(struct machine_status *machine, int rom_no, const char *rom_path, void *data) {
+    switch (rom_no) {
+        case 2:
+            if (app_settings.cartridge_path) free(app_settings.cartridge_path);
+            app_settings.cartridge_path = strdup(rom_path);
+            break;
+        case 1:
+            if (app_settings.rom_basic_path) free(app_settings.rom_basic_path);
+            app_settings.rom_basic_path = strdup(rom_path);
+            break;
+        case 0:
+            if (app_settings.rom_extended_basic_path) free(app_settings.rom_extended_basic_path);
+            app_settings.rom_extended_basic_path = strdup(rom_path);
+            break;
+        case 3:
+            if (app_settings.rom_disc_basic_path) free(app_settings.rom_disc_basic_path);
+            app_settings.rom_disc_basic_path = strdup(rom_path);
+            break;
+    }
     settings_save();
 }
 
+static void _block_device_opened_ui(struct machine_status *machine, int arg, const char *path, void *data) {
+    if (app_settings.block_device_path) free(app_settings.block_device_path);
+    app_settings.block_device_path = strdup(path);
+    settings_save();
+}
+
+static void _disk_trace_save_ui(struct machine_status *machine, int arg, const char *path, void *trace) {
+    if (trace) disk_drive_save_trace(trace, path);
+}
+
+// the emulation reads the Multi-Pak ROM paths when it updates the cartridge port
+static void _multipak_rom_ui(struct machine_status *machine, int slot, const char *path, void *data) {
+    char **rom_path = &app_settings.multipak_slots[slot].rom_path;
+
+    settings_lock();
+    if (*rom_path) free(*rom_path);
+    *rom_path = strdup(path);
+    settings_unlock();
+    machine_reset_and_save();
+}
+
+/*
+    The commands below run on the emulation side, between two fields
+*/
+static void _rom_load_command(struct machine_status *machine, int rom_no, float value, const char *rom_path) {
+    int ret = rom_no == 2 ? rom_pak_load(&machine->cartridge_pak, rom_path) : sam_load_rom(machine->sam, rom_no, rom_path);
+    if (ret) {
+        // a failed Disk ROM is unloaded, the port falls back to what is left
+        machine_update_cartridge_port(machine);
+        return;
+    }
+
+    machine_command_reset(machine, 0, 0, NULL);
+    machine_post_ui(machine, _rom_loaded_ui, rom_no, rom_path, NULL);
+}
+
+static void _rom_unload_command(struct machine_status *machine, int rom_no, float value, const char *text) {
+    if (rom_no == 2) rom_pak_load(&machine->cartridge_pak, NULL);
+    else sam_unload_rom(machine->sam, rom_no);
+    machine_update_cartridge_port(machine);
+}
+
+static void _cartridge_port_command(struct machine_status *machine, int arg, float value, const char *text) {
+    machine_update_cartridge_port(machine);
+}
+
+static void _block_device_open_command(struct machine_status *machine, int arg, float value, const char *path) {
+    if (block_device_open(machine->block_device, path)) {
+        machine_post_ui(machine, _file_error_ui, errno, path, NULL);
+        return;
+    }
+    machine_post_ui(machine, _block_device_opened_ui, 0, path, NULL);
+}
+
+static void _block_device_close_command(struct machine_status *machine, int arg, float value, const char *text) {
+    block_device_close(machine->block_device);
+}
+
+static void _cassette_record_command(struct machine_status *machine, int arg, float value, const char *path) {
+    if (path) cassette_record_start(machine->adc->cassette, path);
+    else cassette_record_stop(machine->adc->cassette);
+}
+
+// value: 1 to start the motor
+static void _cassette_motor_command(struct machine_status *machine, int arg, float value, const char *text) {
+    machine->adc->cassette_motor = value != 0;
+}
+
+static void _cassette_location_command(struct machine_status *machine, int location, float value, const char *text) {
+    struct cassette_status *cassette = machine->adc->cassette;
+    cassette->audio_location = location < cassette->audio_len ? location : cassette->audio_len;
+}
+
+// the trace is taken between two fields, the file is written by the main thread
+static void _disk_trace_save_command(struct machine_status *machine, int arg, float value, const char *path) {
+    machine_post_ui(machine, _disk_trace_save_ui, 0, path, disk_drive_format_trace(machine->disk_drive));
+}
+
+static void _disk_activity_reset_command(struct machine_status *machine, int arg, float value, const char *text) {
+    disk_drive_reset_activity(machine->disk_drive);
+}
+
+static void _disk_discard_command(struct machine_status *machine, int drive_no, float value, const char *text) {
+    disk_image_discard(&machine->disk_drive->images[drive_no]);
+}
+
+// sector: drive << 16 | track << 8 | sector id
+static void _disk_crc_error_command(struct machine_status *machine, int sector, float value, const char *text) {
+    disk_image_inject_crc_error(&machine->disk_drive->images[sector >> 16], (sector >> 8) & 0xff, 0, sector & 0xff);
+}
+
+static void _sound_latency_command(struct machine_status *machine, int latency_ms, float value, const char *text) {
+    adc_set_sound_latency(machine->adc, latency_ms);
+}
+
+static void _open_audio_command(struct machine_status *machine, int arg, float value, const char *text) {
+    adc_open_audio(machine->adc);
+}
+
 static void SDLCALL _disk_selection_cb(void* data, const char* const* filelist, int filter)
 {
     int disk_no = (intptr_t)data;
@@ -113,14 +260,15 @@ static void SDLCALL _disk_selection_cb(void* data, const char* const* filelist,
         return;
     }
 
-    const char *rom_path = *filelist;
-    if(!disk_drive_load_disk(controls.machine->disk_drive, disk_no, rom_path)) {
-        if (app_settings.disks[disk_no].path) free(app_settings.disks[disk_no].path);
-        app_settings.disks[disk_no].path = strdup(rom_path);
-        settings_save();
-    }
+    // opened by the media loader, the settings are updated when the disk is swapped in
+    media_loader_request(controls.machine->loader, MEDIA_DISK, disk_no, *filelist);
 }
 
+static const SDL_DialogFileFilter cassette_file_filters[] = {
+    { "Cassette images", "wav;cas" },
+    { "All files", "*" }
+};
+
 static void SDLCALL _cassette_selection_cb(void* data, const char* const* filelist, int filter)
 {
     if (!filelist) {
@@ -130,12 +278,24 @@ static void SDLCALL _cassette_selection_cb(void* data, const char* const* fileli
         return;
     }
 
-    const char *rom_path = *filelist;
-    if(!adc_load_cassette(controls.machine->adc, rom_path)) {
-        if (app_settings.cassette_path) free(app_settings.cassette_path);
-        app_settings.cassette_path = strdup(rom_path);
-        settings_save();
+    media_loader_request(controls.machine->loader, MEDIA_CASSETTE, 0, *filelist);
+}
+
+static const SDL_DialogFileFilter cassette_record_file_filters[] = {
+    { "WAV file", "wav" },
+    { "CAS file", "cas" }
+};
+
+static void SDLCALL _cassette_record_cb(void* data, const char* const* filelist, int filter)
+{
+    if (!filelist) {
+        log_message(LOG_ERROR, "An error occured: %s", SDL_GetError());
+        return;
+    } else if (!*filelist) {
+        return;
     }
+
+    machine_post(controls.machine, _cassette_record_command, 0, 0, *filelist);
 }
 
 static void SDLCALL _cartridge_selection_cb(void* data, const char* const* filelist, int filter)
@@ -149,30 +309,47 @@ static void SDLCALL _cartridge_selection_cb(void* data, const char* const* filel
 
     int rom_no = (intptr_t)data;
 
-    const char *rom_path = *filelist;
+    // loaded by the emulation, the settings are updated and the machine reset when it succeeds
+    _settings_close_window();
+    keyboard_buffer_reset();
+    machine_post(controls.machine, _rom_load_command, rom_no, 0, *filelist);
+}
 
-    if(!sam_load_rom(controls.machine->sam, rom_no, rom_path)) {
-        switch (rom_no) {
-            case 2:
-                controls.machine->cart_sense = 1;
-                if (app_settings.cartridge_path) free(app_settings.cartridge_path);
-                app_settings.cartridge_path = strdup(rom_path);
-                break;
-            case 1:
-                if (app_settings.rom_basic_path) free(app_settings.rom_basic_path);
-                app_settings.rom_basic_path = strdup(rom_path);
-                break;
-            case 0:
-                if (app_settings.rom_extended_basic_path) free(app_settings.rom_extended_basic_path);
-                app_settings.rom_extended_basic_path = strdup(rom_path);
-                break;
-            case 3:
-                if (app_settings.rom_disc_basic_path) free(app_settings.rom_disc_basic_path);
-                app_settings.rom_disc_basic_path = strdup(rom_path);
-                break;
-        }
-        machine_reset_and_save();
+static void SDLCALL _multipak_rom_selection_cb(void* data, const char* const* filelist, int filter)
+{
+    if (!filelist) {
+        log_message(LOG_ERROR, "An error occured: %s", SDL_GetError());
+        return;
+    } else if (!*filelist) {
+        return;
     }
+
+    // the dialog can call back from another thread, the settings change with the UI
+    machine_post_ui(controls.machine, _multipak_rom_ui, (intptr_t)data, *filelist, NULL);
+}
+
+static void SDLCALL _block_device_selection_cb(void* data, const char* const* filelist, int filter)
+{
+    if (!filelist) {
+        log_message(LOG_ERROR, "An error occured: %s", SDL_GetError());
+        return;
+    } else if (!*filelist) {
+        return;
+    }
+
+    machine_post(controls.machine, _block_device_open_command, 0, 0, *filelist);
+}
+
+static void SDLCALL _disk_trace_save_cb(void* data, const char* const* filelist, int filter)
+{
+    if (!filelist) {
+        log_message(LOG_ERROR, "An error occured: %s", SDL_GetError());
+        return;
+    } else if (!*filelist) {
+        return;
+    }
+
+    machine_post(controls.machine, _disk_trace_save_command, 0, 0, *filelist);
 }
 
 static void SDLCALL _disk_new_cb(void* data, const char* const* filelist, int filter)
@@ -191,11 +368,16 @@ static void SDLCALL _disk_new_cb(void* data, const char* const* filelist, int fi
         return;
     }
 
-    if(disk_drive_load_disk(controls.machine->disk_drive, disk_no, rom_path)) {
-        if (app_settings.disks[disk_no].path) free(app_settings.disks[disk_no].path);
-        app_settings.disks[disk_no].path = strdup(rom_path);
-        settings_save();
-    }
+    media_loader_request(controls.machine->loader, MEDIA_DISK, disk_no, rom_path);
+}
+
+// a line with the media being loaded, if any
+void _media_loader_status_row() {
+    char status[256];
+    if (!media_loader_status(controls.machine->loader, status, sizeof(status))) return;
+
+    nk_layout_row_dynamic(controls.ctx, 20, 1);
+    nk_label(controls.ctx, status, NK_TEXT_LEFT);
 }
 
 int _input_with_actions(const char *label, char *value, ... /*actions*/) {
@@ -244,6 +426,45 @@ void _settings_window_display() {
                 app_settings.artifact_colors = cfg_true ? artifact_colors : cfg_false;
                 settings_save();
             }
+
+            nk_layout_row_template_begin(controls.ctx, 30);
+            nk_layout_row_template_push_static(controls.ctx, 100);
+            nk_layout_row_template_push_dynamic(controls.ctx);
+            nk_layout_row_template_end(controls.ctx);
+            struct nk_vec2 size = {200, 100};
+            const char *pacing_mode_options[] = {"Host clock (VSync)", "Audio clock"};
+            nk_label(controls.ctx, "Frame pacing", NK_TEXT_LEFT);
+            int current_pacing_mode = app_settings.pacing_mode;
+            nk_combobox(controls.ctx, pacing_mode_options, 2, &current_pacing_mode, 20, size);
+            if (current_pacing_mode != app_settings.pacing_mode) {
+                app_settings.pacing_mode = current_pacing_mode;
+                if (current_pacing_mode == Pacing_Mode_Audio) machine_post(controls.machine, _open_audio_command, 0, 0, NULL);
+                settings_save();
+            }
+
+            nk_layout_row_dynamic(controls.ctx, 30, 1);
+            int emulation_thread = app_settings.emulation_thread == cfg_true ? 1 : 0;
+            nk_checkbox_label(controls.ctx, "Run the emulation on its own thread (applies on next start)", &emulation_thread);
+            if (emulation_thread != (app_settings.emulation_thread == cfg_true ? 1 : 0)) {
+                app_settings.emulation_thread = emulation_thread ? cfg_true : cfg_false;
+                settings_save();
+            }
+            nk_tree_state_pop(controls.ctx);
+        }
+
+        if (nk_tree_state_push(controls.ctx, NK_TREE_NODE, "Sound", &controls.settings_sound_state)) {
+            nk_layout_row_dynamic(controls.ctx, 30, 1);
+            int latency_ms = (int)app_settings.sound_latency_ms;
+            nk_property_int(controls.ctx, "Target latency (ms)", 10, &latency_ms, 500, 5, 1);
+            if (latency_ms != app_settings.sound_latency_ms) {
+                app_settings.sound_latency_ms = latency_ms;
+                machine_post(controls.machine, _sound_latency_command, latency_ms, 0, NULL);
+                settings_save();
+            }
+            nk_labelf(controls.ctx, NK_TEXT_LEFT, "Buffered: %.1f ms, rate adjust %+.2f%%, %u underruns, %u overruns",
+                controls.snapshot.sound_latency_ms, -controls.snapshot.sound_rate_adjust * 100,
+                (uint32_t)SDL_GetAtomicInt(&controls.machine->adc->sound_underruns),
+                (uint32_t)SDL_GetAtomicInt(&controls.machine->adc->sound_overruns));
             nk_tree_state_pop(controls.ctx);
         }
 
@@ -255,6 +476,21 @@ void _settings_window_display() {
             nk_layout_row_template_push_static(controls.ctx, 50);
             nk_layout_row_template_end(controls.ctx);
 
+            const long ram_sizes[] = {4, 16, 32, 64};
+            const char *ram_size_options[] = {"4K", "16K", "32K", "64K"};
+            int ram_size = 3;
+            for (int i = 0; i < 4; i++) {
+                if (app_settings.ram_size == ram_sizes[i]) ram_size = i;
+            }
+            nk_label(controls.ctx, "RAM: ", NK_TEXT_LEFT);
+            nk_combobox(controls.ctx, ram_size_options, 4, &ram_size, 20, nk_vec2(100, 150));
+            nk_label(controls.ctx, "", NK_TEXT_LEFT);
+            nk_label(controls.ctx, "", NK_TEXT_LEFT);
+            if (ram_sizes[ram_size] != app_settings.ram_size) {
+                app_settings.ram_size = ram_sizes[ram_size];
+                machine_reset_and_save();
+            }
+
             switch (_input_with_actions("Basic: ", app_settings.rom_basic_path, "Load", "Unload", NULL)) {
                 case 1:
                     // Load
@@ -264,7 +500,7 @@ void _settings_window_display() {
                     // Unload
                     if (app_settings.rom_basic_path) free(app_settings.rom_basic_path);
                     app_settings.rom_basic_path = NULL;
-                    sam_unload_rom(controls.machine->sam, 1);
+                    machine_post(controls.machine, _rom_unload_command, 1, 0, NULL);
                     machine_reset_and_save();
                     break;
             }
@@ -278,7 +514,7 @@ void _settings_window_display() {
                     // Unload
                     if (app_settings.rom_extended_basic_path) free(app_settings.rom_extended_basic_path);
                     app_settings.rom_extended_basic_path = NULL;
-                    sam_unload_rom(controls.machine->sam, 0);
+                    machine_post(controls.machine, _rom_unload_command, 0, 0, NULL);
                     machine_reset_and_save();
                     break;
             }
@@ -292,7 +528,7 @@ void _settings_window_display() {
                     // Unload
                     if (app_settings.rom_disc_basic_path) free(app_settings.rom_disc_basic_path);
                     app_settings.rom_disc_basic_path = NULL;
-                    sam_unload_rom(controls.machine->sam, 3);
+                    machine_post(controls.machine, _rom_unload_command, 3, 0, NULL);
                     machine_reset_and_save();
                     break;
             }
@@ -301,24 +537,114 @@ void _settings_window_display() {
         }
 
         if (nk_tree_state_push(controls.ctx, NK_TREE_NODE, "Cartridge", &controls.settings_cartridge_state)) {
+            nk_layout_row_dynamic(controls.ctx, 30, 1);
+            int multipak = app_settings.multipak == cfg_true ? 1 : 0;
+            nk_checkbox_label(controls.ctx, "Multi-Pak interface (4 slots, slot select register at $FF7F)", &multipak);
+            if (multipak != (app_settings.multipak == cfg_true ? 1 : 0)) {
+                app_settings.multipak = multipak ? cfg_true : cfg_false;
+                machine_reset_and_save();
+            }
+
+            struct nk_vec2 size = {300, 100};
+            if (app_settings.multipak) {
+                nk_layout_row_dynamic(controls.ctx, 30, 1);
+                int switch_slot = (int)app_settings.multipak_switch;
+                nk_property_int(controls.ctx, "Slot switch (applies on reset)", 1, &switch_slot, MULTIPAK_SLOTS, 1, 1);
+                if (switch_slot != app_settings.multipak_switch) {
+                    app_settings.multipak_switch = switch_slot;
+                    settings_save();
+                }
+
+                // the devices are in the CARTRIDGE_* order, after None
+                const char *slot_device_options[] = {"None", "Disk controller", "Block device"};
+                for (int slot = 0; slot < MULTIPAK_SLOTS; slot++) {
+                    char slot_label[10];
+                    snprintf(slot_label, sizeof(slot_label), "Slot %d", slot + 1);
+
+                    nk_layout_row_template_begin(controls.ctx, 30);
+                    nk_layout_row_template_push_static(controls.ctx, 50);
+                    nk_layout_row_template_push_static(controls.ctx, 150);
+                    nk_layout_row_template_push_dynamic(controls.ctx);
+                    nk_layout_row_template_push_static(controls.ctx, 50);
+                    nk_layout_row_template_push_static(controls.ctx, 50);
+                    nk_layout_row_template_end(controls.ctx);
+                    nk_label(controls.ctx, slot_label, NK_TEXT_LEFT);
+                    int slot_device = (int)app_settings.multipak_slots[slot].device - CARTRIDGE_NONE;
+                    nk_combobox(controls.ctx, slot_device_options, CARTRIDGE_DEVICE_COUNT + 1, &slot_device, 20, size);
+                    if (slot_device + CARTRIDGE_NONE != app_settings.multipak_slots[slot].device) {
+                        app_settings.multipak_slots[slot].device = slot_device + CARTRIDGE_NONE;
+                        machine_post(controls.machine, _cartridge_port_command, 0, 0, NULL);
+                        settings_save();
+                    }
+
+                    switch (_input_with_actions(NULL, app_settings.multipak_slots[slot].rom_path, "Load", "Unload", NULL)) {
+                        case 1:
+                            // Load
+                            SDL_ShowOpenFileDialog(_multipak_rom_selection_cb, (void*)((intptr_t)slot), controls.machine->window, NULL, 0, NULL, false);
+                            break;
+                        case 2:
+                            // Unload
+                            settings_lock();
+                            if (app_settings.multipak_slots[slot].rom_path) free(app_settings.multipak_slots[slot].rom_path);
+                            app_settings.multipak_slots[slot].rom_path = NULL;
+                            settings_unlock();
+                            machine_reset_and_save();
+                            break;
+                    }
+                }
+            } else {
+                nk_layout_row_template_begin(controls.ctx, 30);
+                nk_layout_row_template_push_dynamic(controls.ctx);
+                nk_layout_row_template_push_static(controls.ctx, 50);
+                nk_layout_row_template_push_static(controls.ctx, 50);
+                nk_layout_row_template_end(controls.ctx);
+
+                switch (_input_with_actions(NULL, app_settings.cartridge_path, "Load", "Unload", NULL)) {
+                    case 1:
+                        // Load
+                        SDL_ShowOpenFileDialog(_cartridge_selection_cb, (void*)((intptr_t)2), controls.machine->window, NULL, 0, NULL, false);
+                        break;
+                    case 2:
+                        // Unload
+                        if (app_settings.cartridge_path) free(app_settings.cartridge_path);
+                        app_settings.cartridge_path = NULL;
+                        machine_post(controls.machine, _rom_unload_command, 2, 0, NULL);
+                        machine_reset_and_save();
+                        break;
+                }
+
+                nk_layout_row_template_begin(controls.ctx, 30);
+                nk_layout_row_template_push_static(controls.ctx, 100);
+                nk_layout_row_template_push_dynamic(controls.ctx);
+                nk_layout_row_template_end(controls.ctx);
+                const char *port_device_options[] = {"Disk controller", "Block device (IDE like, $FF50-$FF57)"};
+                nk_label(controls.ctx, "Port device", NK_TEXT_LEFT);
+                int port_device = (int)app_settings.cartridge_device;
+                nk_combobox(controls.ctx, port_device_options, CARTRIDGE_DEVICE_COUNT, &port_device, 20, size);
+                if (port_device != app_settings.cartridge_device) {
+                    app_settings.cartridge_device = port_device;
+                    machine_post(controls.machine, _cartridge_port_command, 0, 0, NULL);
+                    settings_save();
+                }
+            }
+
             nk_layout_row_template_begin(controls.ctx, 30);
+            nk_layout_row_template_push_static(controls.ctx, 100);
             nk_layout_row_template_push_dynamic(controls.ctx);
             nk_layout_row_template_push_static(controls.ctx, 50);
             nk_layout_row_template_push_static(controls.ctx, 50);
             nk_layout_row_template_end(controls.ctx);
-
-            switch (_input_with_actions(NULL, app_settings.cartridge_path, "Load", "Unload", NULL)) {
+            switch (_input_with_actions("Block device", app_settings.block_device_path, "Load", "Unload", NULL)) {
                 case 1:
                     // Load
-                    SDL_ShowOpenFileDialog(_cartridge_selection_cb, (void*)((intptr_t)2), controls.machine->window, NULL, 0, NULL, false);
+                    SDL_ShowOpenFileDialog(_block_device_selection_cb, NULL, controls.machine->window, NULL, 0, NULL, false);
                     break;
                 case 2:
                     // Unload
-                    if (app_settings.cartridge_path) free(app_settings.cartridge_path);
-                    app_settings.cartridge_path = NULL;
-                    controls.machine->cart_sense = 0;
-                    sam_unload_rom(controls.machine->sam, 2);
-                    machine_reset_and_save();
+                    machine_post(controls.machine, _block_device_close_command, 0, 0, NULL);
+                    if (app_settings.block_device_path) free(app_settings.block_device_path);
+                    app_settings.block_device_path = NULL;
+                    settings_save();
                     break;
             }
 
@@ -332,12 +658,15 @@ void _settings_window_display() {
             nk_layout_row_template_push_static(controls.ctx, 50);
             nk_layout_row_template_push_static(controls.ctx, 50);
             nk_layout_row_template_push_static(controls.ctx, 50);
+            nk_layout_row_template_push_static(controls.ctx, 50);
+            nk_layout_row_template_push_static(controls.ctx, 50);
+            nk_layout_row_template_push_static(controls.ctx, 80);
             nk_layout_row_template_end(controls.ctx);
 
             for (int disk_no=0; disk_no < 4; disk_no++) {
                 char disk_label[3] = {'1' + disk_no, '.', 0};
 
-                switch (_input_with_actions(disk_label, app_settings.disks[disk_no].path, "New", "Load", "Unload", NULL)) {
+                switch (_input_with_actions(disk_label, app_settings.disks[disk_no].path, "New", "Load", "Folder", "Unload", "Revert", NULL)) {
                     case 1:
                         // New
                         SDL_ShowSaveFileDialog(_disk_new_cb, (void*)((intptr_t)disk_no), controls.machine->window, NULL, 0, NULL);
@@ -347,14 +676,103 @@ void _settings_window_display() {
                         SDL_ShowOpenFileDialog(_disk_selection_cb, (void*)((intptr_t)disk_no), controls.machine->window, NULL, 0, NULL, false);
                         break;
                     case 3:
-                        // Unload
-                        if (app_settings.disks[disk_no].path) free(app_settings.disks[disk_no].path);
-                        app_settings.disks[disk_no].path = NULL;
-                        disk_drive_load_disk(controls.machine->disk_drive, disk_no, NULL);
-                        settings_save();
+                        // Folder: a host directory seen as an RS-DOS disk
+                        SDL_ShowOpenFolderDialog(_disk_selection_cb, (void*)((intptr_t)disk_no), controls.machine->window, NULL, false);
                         break;
+                    case 4:
+                        // Unload, closing the image can flush it
+                        media_loader_request(controls.machine->loader, MEDIA_DISK, disk_no, NULL);
+                        break;
+                    case 5:
+                        // Revert: drop the changes not written to the file (volatile and overlay)
+                        machine_post(controls.machine, _disk_discard_command, disk_no, 0, NULL);
+                        break;
+                }
+
+                int overlay = app_settings.disks[disk_no].overlay == cfg_true ? 1 : 0;
+                nk_checkbox_label(controls.ctx, "Overlay", &overlay);
+                if (overlay != (app_settings.disks[disk_no].overlay == cfg_true ? 1 : 0)) {
+                    app_settings.disks[disk_no].overlay = overlay ? cfg_true : cfg_false;
+                    if (app_settings.disks[disk_no].path && app_settings.disks[disk_no].path[0]) {
+                        media_loader_request(controls.machine->loader, MEDIA_DISK, disk_no, app_settings.disks[disk_no].path);
+                    }
+                    settings_save();
+                }
+
+            }
+            _media_loader_status_row();
+
+            nk_layout_row_template_begin(controls.ctx, 30);
+            nk_layout_row_template_push_static(controls.ctx, 100);
+            nk_layout_row_template_push_dynamic(controls.ctx);
+            nk_layout_row_template_end(controls.ctx);
+            struct nk_vec2 size = {300, 100};
+            const char *write_mode_options[] = {"Write through", "Write back (after 2s idle, on unload and exit)", "Volatile (never written)"};
+            nk_label(controls.ctx, "Disk writes", NK_TEXT_LEFT);
+            int current_write_mode = app_settings.disk_write_mode;
+            nk_combobox(controls.ctx, write_mode_options, 3, &current_write_mode, 20, size);
+            if (current_write_mode != app_settings.disk_write_mode) {
+                app_settings.disk_write_mode = current_write_mode;
+                // reload the disks with the new mode
+                for (int disk_no=0; disk_no < 4; disk_no++) {
+                    if (!app_settings.disks[disk_no].path || !app_settings.disks[disk_no].path[0]) continue;
+                    media_loader_request(controls.machine->loader, MEDIA_DISK, disk_no, app_settings.disks[disk_no].path);
+                }
+                settings_save();
+            }
+
+            nk_layout_row_dynamic(controls.ctx, 30, 1);
+            int fast_transfer = app_settings.disk_fast_transfer == cfg_true ? 1 : 0;
+            nk_checkbox_label(controls.ctx, "Fast sector transfer (Disk Basic)", &fast_transfer);
+            if (fast_transfer != (app_settings.disk_fast_transfer == cfg_true ? 1 : 0)) {
+                app_settings.disk_fast_transfer = fast_transfer ? cfg_true : cfg_false;
+                settings_save();
+            }
+
+            int rotation_timing = app_settings.disk_rotation_timing == cfg_true ? 1 : 0;
+            nk_checkbox_label(controls.ctx, "Rotation timing (300 RPM, the sectors are found when they pass under the head)", &rotation_timing);
+            if (rotation_timing != (app_settings.disk_rotation_timing == cfg_true ? 1 : 0)) {
+                app_settings.disk_rotation_timing = rotation_timing ? cfg_true : cfg_false;
+                settings_save();
+            }
+
+            int interleave = (int)app_settings.disk_interleave;
+            nk_property_int(controls.ctx, "Interleave (JVC, VDK, directory)", 1, &interleave, 17, 1, 1);
+            if (interleave != app_settings.disk_interleave) {
+                app_settings.disk_interleave = interleave;
+                settings_save();
+            }
+
+            // the sector reads with a CRC error until it's written again
+            nk_layout_row_dynamic(controls.ctx, 30, 4);
+            nk_property_int(controls.ctx, "Drive", 1, &controls.crc_error_drive, 4, 1, 1);
+            nk_property_int(controls.ctx, "Track", 0, &controls.crc_error_track, DISK_MAX_TRACKS - 1, 1, 1);
+            nk_property_int(controls.ctx, "Sector", 1, &controls.crc_error_sector, DISK_MAX_SECTOR_ID - 1, 1, 1);
+            if (nk_button_label(controls.ctx, "Inject CRC error")) {
+                machine_post(controls.machine, _disk_crc_error_command,
+                    (controls.crc_error_drive - 1) << 16 | controls.crc_error_track << 8 | controls.crc_error_sector, 0, NULL);
+            }
+
+            if (nk_tree_state_push(controls.ctx, NK_TREE_NODE, "Activity", &controls.settings_disk_activity_state)) {
+                nk_layout_row_dynamic(controls.ctx, 30, 3);
+                int trace = app_settings.disk_trace == cfg_true ? 1 : 0;
+                nk_checkbox_label(controls.ctx, "Trace the commands", &trace);
+                if (trace != (app_settings.disk_trace == cfg_true ? 1 : 0)) {
+                    app_settings.disk_trace = trace ? cfg_true : cfg_false;
+                    settings_save();
+                }
+                if (nk_button_label(controls.ctx, "Reset")) {
+                    machine_post(controls.machine, _disk_activity_reset_command, 0, 0, NULL);
+                }
+                if (nk_button_label(controls.ctx, "Save trace")) {
+                    SDL_ShowSaveFileDialog(_disk_trace_save_cb, NULL, controls.machine->window, NULL, 0, NULL);
                 }
 
+                nk_layout_row_dynamic(controls.ctx, 300, 1);
+                machine_get_disk_activity(controls.machine, controls.disk_activity, sizeof(controls.disk_activity));
+                nk_edit_string_zero_terminated(controls.ctx, NK_EDIT_SELECTABLE | NK_EDIT_MULTILINE | NK_EDIT_CLIPBOARD | NK_EDIT_READ_ONLY,
+                    controls.disk_activity, sizeof(controls.disk_activity), nk_filter_ascii);
+                nk_tree_state_pop(controls.ctx);
             }
             nk_tree_state_pop(controls.ctx);
         }
@@ -369,28 +787,62 @@ void _settings_window_display() {
             switch (_input_with_actions(NULL, app_settings.cassette_path, "Load", "Unload", NULL)) {
                 case 1:
                     // Load
-                    SDL_ShowOpenFileDialog(_cassette_selection_cb, (void*)NULL, controls.machine->window, NULL, 0, NULL, false);
+                    SDL_ShowOpenFileDialog(_cassette_selection_cb, (void*)NULL, controls.machine->window, cassette_file_filters, SDL_arraysize(cassette_file_filters), NULL, false);
                     break;
                 case 2:
                     // Unload
-                    if (app_settings.cassette_path) free(app_settings.cassette_path);
-                    app_settings.cassette_path = NULL;
-                    adc_load_cassette(controls.machine->adc, NULL);
-                    settings_save();
+                    media_loader_request(controls.machine->loader, MEDIA_CASSETTE, 0, NULL);
                     break;
             }
 
-            nk_slider_int(controls.ctx, 0, &controls.machine->adc->cassette_audio_location, controls.machine->adc->cassette_audio_len, 1);
-            if (controls.machine->adc->cassette_motor) {
+            int location = controls.snapshot.cassette_location;
+            nk_slider_int(controls.ctx, 0, &location, controls.snapshot.cassette_length, 1);
+            if (location != controls.snapshot.cassette_location) {
+                machine_post(controls.machine, _cassette_location_command, location, 0, NULL);
+            }
+            if (controls.snapshot.cassette_motor) {
                 controls.ctx->style.button.normal = controls.ctx->style.button.active;
                 controls.ctx->style.button.hover = controls.ctx->style.button.active;
             }
             if (nk_button_label(controls.ctx, "Play/Stop")) {
-                controls.machine->adc->cassette_motor = !controls.machine->adc->cassette_motor;
+                machine_post(controls.machine, _cassette_motor_command, 0, !controls.snapshot.cassette_motor, NULL);
             }
             controls.ctx->style.button = button_style_original;
             if (nk_button_label(controls.ctx, "Rewind")) {
-                controls.machine->adc->cassette_audio_location = 0;
+                machine_post(controls.machine, _cassette_location_command, 0, 0, NULL);
+            }
+            _media_loader_status_row();
+
+            nk_layout_row_dynamic(controls.ctx, 30, 1);
+            int fast_load = app_settings.cassette_fast_load == cfg_true ? 1 : 0;
+            nk_checkbox_label(controls.ctx, "Fast Load (standard Basic blocks)", &fast_load);
+            if (fast_load != (app_settings.cassette_fast_load == cfg_true ? 1 : 0)) {
+                app_settings.cassette_fast_load = fast_load ? cfg_true : cfg_false;
+                settings_save();
+            }
+            int wav_demodulate = app_settings.cassette_wav_demodulate == cfg_true ? 1 : 0;
+            nk_checkbox_label(controls.ctx, "Demodulate WAV files (cached in <file>.wav.cas, applies on next load)", &wav_demodulate);
+            if (wav_demodulate != (app_settings.cassette_wav_demodulate == cfg_true ? 1 : 0)) {
+                app_settings.cassette_wav_demodulate = wav_demodulate ? cfg_true : cfg_false;
+                settings_save();
+            }
+
+            nk_layout_row_template_begin(controls.ctx, 30);
+            nk_layout_row_template_push_dynamic(controls.ctx);
+            nk_layout_row_template_push_static(controls.ctx, 80);
+            nk_layout_row_template_end(controls.ctx);
+            bool recording = controls.snapshot.recording;
+            if (recording) {
+                nk_labelf(controls.ctx, NK_TEXT_LEFT, "Recording: %u bytes", controls.snapshot.recorded_length);
+            } else {
+                nk_label(controls.ctx, "Record (CSAVE) to a .wav or .cas file", NK_TEXT_LEFT);
+            }
+            if (nk_button_label(controls.ctx, recording ? "Stop" : "Record")) {
+                if (recording) {
+                    machine_post(controls.machine, _cassette_record_command, 0, 0, NULL);
+                } else {
+                    SDL_ShowSaveFileDialog(_cassette_record_cb, NULL, controls.machine->window, cassette_record_file_filters, SDL_arraysize(cassette_record_file_filters), NULL);
+                }
             }
             nk_tree_state_pop(controls.ctx);
         }
@@ -423,6 +875,15 @@ void _settings_window_display() {
 }
 
 void controls_display() {
+    machine_get_snapshot(controls.machine, &controls.snapshot);
+
+    // the file of the recording can't be written, it's closed between two fields
+    if (controls.snapshot.recording_error && !controls.recording_stop_posted) {
+        controls.recording_stop_posted = !machine_post(controls.machine, _cassette_record_command, 0, 0, NULL);
+    } else if (!controls.snapshot.recording) {
+        controls.recording_stop_posted = false;
+    }
+
     int window_w, window_h;
     SDL_GetWindowSizeInPixels(controls.machine->window, &window_w, &window_h);
     if (nk_begin(controls.ctx, "tool bar", nk_rect(0, window_h - 40, window_w, 40), NK_WINDOW_NO_SCROLLBAR))
@@ -440,15 +901,14 @@ void controls_display() {
 
         if (nk_button_label(controls.ctx, "Reset")) {
             keyboard_buffer_reset();
-            machine_reset(controls.machine);
-            disk_drive_reset(controls.machine->disk_drive);
+            machine_post_reset(controls.machine, true);
             _settings_close_window();
         }
 
         struct nk_color button_border_color = nk_rgba(0,0,0,255);
-        if (controls.machine->disk_drive->status_1.BUSY) button_border_color = nk_rgba(255,0,0,255);
-        else if (controls.machine->disk_drive->MOTOR_ON) button_border_color = nk_rgba(0,255,0,255);
-        else if (controls.machine->disk_drive->_drive_data[0]) button_border_color = nk_rgba(255,255,255,255);
+        if (controls.snapshot.disk_busy) button_border_color = nk_rgba(255,0,0,255);
+        else if (controls.snapshot.disk_motor_on) button_border_color = nk_rgba(0,255,0,255);
+        else if (controls.snapshot.disk_loaded) button_border_color = nk_rgba(255,255,255,255);
         nk_style_push_color(controls.ctx, &controls.ctx->style.button.border_color, button_border_color);
         if (nk_button_label(controls.ctx, "Diskette")) {
             _settings_toggle_window(false);
@@ -457,7 +917,7 @@ void controls_display() {
         nk_style_pop_color(controls.ctx);
 
         button_border_color = nk_rgba(0,0,0,255);
-        if (controls.machine->adc->cassette_motor) button_border_color = nk_rgba(255,0,0,255);
+        if (controls.snapshot.cassette_motor) button_border_color = nk_rgba(255,0,0,255);
         else if (app_settings.cassette_path) button_border_color = nk_rgba(255,255,255,255);
         nk_style_push_color(controls.ctx, &controls.ctx->style.button.border_color, button_border_color);
         if (nk_button_label(controls.ctx, "Cassette")) {
@@ -468,7 +928,7 @@ void controls_display() {
 
         button_border_color = nk_rgba(0,0,0,255);
         // visual indication that the left joystick is being pulled
-        if (!controls.machine->adc->sound_enabled && controls.joystick_selection != controls.machine->adc->adc_level && controls.machine->adc->switch_selection < 2) button_border_color = nk_rgba(255,255,255,255);
+        if (!controls.snapshot.sound_enabled && controls.joystick_selection != controls.snapshot.adc_level && controls.snapshot.switch_selection < 2) button_border_color = nk_rgba(255,255,255,255);
         nk_style_push_color(controls.ctx, &controls.ctx->style.button.border_color, button_border_color);
         int emulation = controls.machine->_joy_emulation[0] || controls.machine->_joy_emulation[1];
         int is_left_joy_emulated = app_settings.joy_emulation_mode[0] == Joy_Emulation_Keyboard || app_settings.joy_emulation_mode[0] == Joy_Emulation_Mouse;
@@ -484,7 +944,7 @@ void controls_display() {
         nk_style_pop_color(controls.ctx);
         button_border_color = nk_rgba(0,0,0,255);
         // visual indication that the right joystick is being pulled
-        if (controls.joystick_selection != controls.machine->adc->adc_level && controls.machine->adc->switch_selection > 1) button_border_color = nk_rgba(255,255,255,255);
+        if (controls.joystick_selection != controls.snapshot.adc_level && controls.snapshot.switch_selection > 1) button_border_color = nk_rgba(255,255,255,255);
         nk_style_push_color(controls.ctx, &controls.ctx->style.button.border_color, button_border_color);
         int is_right_joy_emulated = app_settings.joy_emulation_mode[1] == Joy_Emulation_Keyboard || app_settings.joy_emulation_mode[1] == Joy_Emulation_Mouse;
         if (nk_button_image(controls.ctx, nk_image_ptr(controls.machine->_joy_emulation[1] && is_right_joy_emulated ? controls.joystick_kbd_icon : controls.joystick_icon))) {
@@ -496,7 +956,7 @@ void controls_display() {
             }
         }
         nk_style_pop_color(controls.ctx);
-        controls.joystick_selection = controls.machine->adc->adc_level;
+        controls.joystick_selection = controls.snapshot.adc_level;
 
         if (nk_button_label(controls.ctx, "Settings")) {
             _settings_toggle_window(true);
@@ -514,6 +974,5 @@ void controls_display() {
     if (controls.machine->settings_page_is_open){
         _settings_window_display();
     }
-
     nk_sdl_render(NK_ANTI_ALIASING_ON);
 }
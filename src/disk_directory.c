@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include <SDL3/SDL_filesystem.h>
+#include "disk_directory.h"
+#include "utils.h"
+
+#define DISK_DIRECTORY_LENGTH (RSDOS_TRACKS * RSDOS_SECTORS * RSDOS_SECTOR_LENGTH)
+
+// RS-DOS file types
+#define RSDOS_TYPE_BASIC 0
+#define RSDOS_TYPE_DATA 1
+#define RSDOS_TYPE_ML 2
+
+struct _name_list {
+    char **names;
+    int count;
+};
+
+
+// first sector (0 based, from the start of the disk) of a granule, the directory track is skipped
+int _granule_lba(int granule) {
+    int track = granule / 2;
+    if (track >= RSDOS_DIRECTORY_TRACK) track++;
+    return track * RSDOS_SECTORS + (granule % 2) * RSDOS_GRANULE_SECTORS;
+}
+
+// granule of a sector, -1 for the directory track
+int _lba_granule(int lba) {
+    int track = lba / RSDOS_SECTORS;
+    if (track == RSDOS_DIRECTORY_TRACK) return -1;
+    if (track > RSDOS_DIRECTORY_TRACK) track--;
+    return track * 2 + (lba % RSDOS_SECTORS) / RSDOS_GRANULE_SECTORS;
+}
+
+uint8_t *_directory_sector(uint8_t *data, int sector) {
+    return data + (RSDOS_DIRECTORY_TRACK * RSDOS_SECTORS + sector - 1) * RSDOS_SECTOR_LENGTH;
+}
+
+char *_host_path(const char *dir, const char *name) {
+    size_t length = strlen(dir);
+    int separator = length && dir[length - 1] != '/' && dir[length - 1] != '\\';
+    char *path = malloc(length + strlen(name) + 2);
+    sprintf(path, separator ? "%s/%s" : "%s%s", dir, name);
+    return path;
+}
+
+/*
+    The 8.3 name of the directory entry, upper case and padded with spaces
+    Returns 1 when the host name doesn't fit
+*/
+int _rsdos_name(const char *name, uint8_t *entry) {
+    const char *dot = strrchr(name, '.');
+    size_t base_length = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext_length = dot ? strlen(dot + 1) : 0;
+    if (base_length < 1 || base_length > 8 || ext_length > 3) return 1;
+
+    memset(entry, ' ', 11);
+    for (size_t i = 0; i < base_length; i++) {
+        if (name[i] <= ' ' || name[i] > '~') return 1;
+        entry[i] = toupper(name[i]);
+    }
+    for (size_t i = 0; i < ext_length; i++) {
+        if (dot[1 + i] <= ' ' || dot[1 + i] > '~') return 1;
+        entry[8 + i] = toupper(dot[1 + i]);
+    }
+    return 0;
+}
+
+// host name of a directory entry, NAME.EXT without the padding
+void _host_name(const uint8_t *entry, char *name) {
+    int length = 0;
+    for (int i = 0; i < 8 && entry[i] != ' '; i++) name[length++] = entry[i];
+    if (entry[8] != ' ') {
+        name[length++] = '.';
+        for (int i = 8; i < 11 && entry[i] != ' '; i++) name[length++] = entry[i];
+    }
+    name[length] = 0;
+}
+
+/*
+    The host name of an entry written by the guest, it must be a name the directory could list:
+    printable characters other than space, and nothing that leaves the directory
+*/
+int _host_name_is_safe(const char *name) {
+    uint8_t entry[11];
+    if (_rsdos_name(name, entry)) return 0;
+    if (strpbrk(name, "/\\:") || strstr(name, "..")) return 0;
+    return 1;
+}
+
+// type and ASCII flag from the extension, a tokenized BASIC program starts with FF
+void _rsdos_type(const uint8_t *entry, const char *path, uint8_t *type, uint8_t *ascii) {
+    if (!memcmp(entry + 8, "BAS", 3)) {
+        int first = EOF;
+        FILE *fp = fopen(path, "rb");
+        if (fp) {
+            first = fgetc(fp);
+            fclose(fp);
+        }
+        *type = RSDOS_TYPE_BASIC;
+        *ascii = first == 0xff ? 0 : 0xff;
+    } else if (!memcmp(entry + 8, "BIN", 3)) {
+        *type = RSDOS_TYPE_ML;
+        *ascii = 0;
+    } else {
+        *type = RSDOS_TYPE_DATA;
+        *ascii = 0xff;
+    }
+}
+
+static SDL_EnumerationResult SDLCALL _list_cb(void *userdata, const char *dirname, const char *fname) {
+    struct _name_list *list = userdata;
+    list->names = realloc(list->names, (list->count + 1) * sizeof(char *));
+    list->names[list->count++] = strdup(fname);
+    return SDL_ENUM_CONTINUE;
+}
+
+static int _compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+bool disk_directory_is_directory(const char *path) {
+    SDL_PathInfo info;
+    return SDL_GetPathInfo(path, &info) && info.type == SDL_PATHTYPE_DIRECTORY;
+}
+
+// reads the sector of a file from the host when it's first used
+void _load_sector(struct disk_image *image, int lba) {
+    struct disk_directory *directory = image->directory;
+    directory->sector_state[lba] = DISK_DIRECTORY_SECTOR_LOADED;
+
+    int granule = _lba_granule(lba);
+    int entry = granule < 0 ? -1 : directory->granule_entry[granule];
+    if (entry < 0) return;
+
+    long offset = directory->granule_offset[granule] + (lba % RSDOS_SECTORS % RSDOS_GRANULE_SECTORS) * RSDOS_SECTOR_LENGTH;
+    FILE *fp = fopen(directory->host_names[entry], "rb");
+    if (!fp || fseek(fp, offset, SEEK_SET)) {
+        log_message(LOG_ERROR, "Can't read %s: %s", directory->host_names[entry], strerror(errno));
+        if (fp) fclose(fp);
+        return;
+    }
+    fread(image->data + lba * RSDOS_SECTOR_LENGTH, 1, RSDOS_SECTOR_LENGTH, fp);
+    fclose(fp);
+}
+
+// reads all the sectors still in the host file of an entry, before the file is replaced
+void _load_entry_sectors(struct disk_image *image, int entry) {
+    struct disk_directory *directory = image->directory;
+    for (int lba = 0; lba < RSDOS_TRACKS * RSDOS_SECTORS; lba++) {
+        int granule = _lba_granule(lba);
+        if (granule < 0 || directory->granule_entry[granule] != entry) continue;
+        if (directory->sector_state[lba] == DISK_DIRECTORY_SECTOR_EMPTY) _load_sector(image, lba);
+    }
+}
+
+/*
+    Builds the FAT and the directory, the files are allocated in name order
+    The files that don't fit on the disk or whose name isn't a valid 8.3 name are skipped
+*/
+int disk_directory_open(struct disk_image *image, const char *path) {
+    struct _name_list list = {NULL, 0};
+    if (!SDL_EnumerateDirectory(path, _list_cb, &list)) {
+        log_message(LOG_ERROR, "Can't read the directory %s: %s", path, SDL_GetError());
+        for (int i = 0; i < list.count; i++) free(list.names[i]);
+        free(list.names);
+        return 1;
+    }
+    if (list.count) qsort(list.names, list.count, sizeof(char *), _compare_names);
+
+    struct disk_directory *directory = calloc(1, sizeof(struct disk_directory));
+    uint8_t *data = malloc(DISK_DIRECTORY_LENGTH);
+    if (!directory || !data) {
+        log_message(LOG_ERROR, "Can't allocate the disk for %s", path);
+        free(directory);
+        free(data);
+        return 1;
+    }
+
+    // a formatted disk is filled with FF, the FAT has FF for the free granules and 0 after
+    memset(data, 0xff, DISK_DIRECTORY_LENGTH);
+    uint8_t *fat = _directory_sector(data, RSDOS_FAT_SECTOR);
+    uint8_t *entries = _directory_sector(data, RSDOS_FIRST_DIRECTORY_SECTOR);
+    memset(fat + RSDOS_GRANULES, 0, RSDOS_SECTOR_LENGTH - RSDOS_GRANULES);
+    for (int i = 0; i < RSDOS_GRANULES; i++) directory->granule_entry[i] = -1;
+
+    int entry_count = 0;
+    int next_granule = 0;
+    for (int i = 0; i < list.count; i++) {
+        char *host_path = _host_path(path, list.names[i]);
+        uint8_t *entry = entries + entry_count * RSDOS_ENTRY_LENGTH;
+        SDL_PathInfo info;
+
+        if (!SDL_GetPathInfo(host_path, &info) || info.type != SDL_PATHTYPE_FILE) {
+            free(host_path);
+            continue;
+        }
+        if (entry_count == RSDOS_ENTRIES) {
+            log_message(LOG_INFO, "Directory disk: %s skipped (directory full)", list.names[i]);
+            free(host_path);
+            continue;
+        }
+        if (_rsdos_name(list.names[i], entry)) {
+            log_message(LOG_INFO, "Directory disk: %s skipped (not an 8.3 name)", list.names[i]);
+            memset(entry, 0xff, RSDOS_ENTRY_LENGTH);
+            free(host_path);
+            continue;
+        }
+        int duplicate = 0;
+        for (int j = 0; j < entry_count; j++) {
+            if (!memcmp(entries + j * RSDOS_ENTRY_LENGTH, entry, 11)) duplicate = 1;
+        }
+
+        uint32_t size = (uint32_t)info.size;
+        int granules = size ? (size + RSDOS_GRANULE_LENGTH - 1) / RSDOS_GRANULE_LENGTH : 1;
+        if (duplicate || next_granule + granules > RSDOS_GRANULES) {
+            log_message(LOG_INFO, "Directory disk: %s skipped (%s)", list.names[i], duplicate ? "same 8.3 name" : "disk full");
+            memset(entry, 0xff, RSDOS_ENTRY_LENGTH);
+            free(host_path);
+            continue;
+        }
+
+        uint32_t last_granule_length = size - (granules - 1) * RSDOS_GRANULE_LENGTH;
+        int last_sectors = last_granule_length ? (last_granule_length + RSDOS_SECTOR_LENGTH - 1) / RSDOS_SECTOR_LENGTH : 1;
+        uint16_t last_sector_bytes = last_granule_length - (last_sectors - 1) * RSDOS_SECTOR_LENGTH;
+
+        for (int g = 0; g < granules; g++) {
+            int granule = next_granule + g;
+            directory->granule_entry[granule] = entry_count;
+            directory->granule_offset[granule] = g * RSDOS_GRANULE_LENGTH;
+            fat[granule] = g < granules - 1 ? granule + 1 : 0xc0 | last_sectors;
+        }
+
+        memset(entry + 11, 0, RSDOS_ENTRY_LENGTH - 11);
+        _rsdos_type(entry, host_path, &entry[11], &entry[12]);
+        entry[13] = next_granule;
+        entry[14] = last_sector_bytes >> 8;
+        entry[15] = last_sector_bytes & 0xff;
+
+        directory->host_names[entry_count] = host_path;
+        entry_count++;
+        next_granule += granules;
+    }
+
+    for (int i = 0; i < list.count; i++) free(list.names[i]);
+    free(list.names);
+
+    // the sectors of the files are read later
+    for (int lba = 0; lba < RSDOS_TRACKS * RSDOS_SECTORS; lba++) {
+        int granule = _lba_granule(lba);
+        int in_file = granule >= 0 && directory->granule_entry[granule] >= 0;
+        directory->sector_state[lba] = in_file ? DISK_DIRECTORY_SECTOR_EMPTY : DISK_DIRECTORY_SECTOR_LOADED;
+    }
+    memcpy(directory->directory, entries, sizeof(directory->directory));
+
+    directory->path = strdup(path);
+    image->directory = directory;
+    image->data = data;
+    image->length = DISK_DIRECTORY_LENGTH;
+
+    log_message(LOG_INFO, "Directory disk %s: %d files, %d free granules", path, entry_count, RSDOS_GRANULES - next_granule);
+    return 0;
+}
+
+void disk_directory_close(struct disk_image *image) {
+    struct disk_directory *directory = image->directory;
+    if (!directory) return;
+
+    for (int i = 0; i < RSDOS_ENTRIES; i++) {
+        if (directory->host_names[i]) free(directory->host_names[i]);
+    }
+    free(directory->path);
+    free(directory);
+    free(image->data);
+    image->directory = NULL;
+    image->data = NULL;
+}
+
+uint8_t *disk_directory_sector_data(struct disk_image *image, struct disk_sector *sector, int for_write) {
+    struct disk_directory *directory = image->directory;
+    int lba = sector->offset / RSDOS_SECTOR_LENGTH;
+
+    if (directory->sector_state[lba] == DISK_DIRECTORY_SECTOR_EMPTY) _load_sector(image, lba);
+    if (for_write) {
+        if (directory->sector_state[lba] != DISK_DIRECTORY_SECTOR_MODIFIED) {
+            directory->sector_state[lba] = DISK_DIRECTORY_SECTOR_MODIFIED;
+            image->dirty_count++;
+        }
+        image->last_write_ns = nanos();
+    }
+    return image->data + sector->offset;
+}
+
+/*
+    The granules of a file, from the FAT chain
+    Returns the file length or -1 when the chain is broken
+*/
+int _file_granules(const uint8_t *fat, const uint8_t *entry, int *granules, int *granule_count) {
+    int granule = entry[13];
+    int count = 0;
+
+    while (granule < RSDOS_GRANULES && count < RSDOS_GRANULES) {
+        granules[count++] = granule;
+        if (fat[granule] >= 0xc0) {
+            int last_sectors = fat[granule] & 0x3f;
+            int last_sector_bytes = (entry[14] << 8) | entry[15];
+            if (last_sectors > RSDOS_GRANULE_SECTORS || last_sector_bytes > RSDOS_SECTOR_LENGTH) return -1;
+
+            *granule_count = count;
+            int length = (count - 1) * RSDOS_GRANULE_LENGTH;
+            if (last_sectors) length += (last_sectors - 1) * RSDOS_SECTOR_LENGTH + last_sector_bytes;
+            return length;
+        }
+        granule = fat[granule];
+    }
+    return -1;
+}
+
+int _write_host_file(struct disk_image *image, const char *path, const int *granules, int length) {
+    char *temp_path = malloc(strlen(path) + 5);
+    sprintf(temp_path, "%s.tmp", path);
+
+    FILE *fp = fopen(temp_path, "wb");
+    int ok = fp != NULL;
+    for (int g = 0; ok && g * RSDOS_GRANULE_LENGTH < length; g++) {
+        int chunk = length - g * RSDOS_GRANULE_LENGTH;
+        if (chunk > RSDOS_GRANULE_LENGTH) chunk = RSDOS_GRANULE_LENGTH;
+        ok = fwrite(image->data + _granule_lba(granules[g]) * RSDOS_SECTOR_LENGTH, 1, chunk, fp) == (size_t)chunk;
+    }
+    if (ok) ok = fflush(fp) == 0;
+#ifdef _WIN32
+    if (ok) ok = _commit(_fileno(fp)) == 0;
+#else
+    if (ok) ok = fsync(fileno(fp)) == 0;
+#endif
+    if (fp && fclose(fp)) ok = 0;
+
+#ifdef _WIN32
+    if (ok) ok = MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    if (ok) ok = rename(temp_path, path) == 0;
+#endif
+    if (!ok) {
+        log_message(LOG_ERROR, "Can't write %s: %s", path, strerror(errno));
+        remove(temp_path);
+    }
+    free(temp_path);
+    return ok ? 0 : 1;
+}
+
+/*
+    Writes the new and modified files to the host directory
+    A file is modified when its directory entry changed or one of its sectors was written.
+    The files deleted on the disk are kept in the host directory
+*/
+int disk_directory_flush(struct disk_image *image) {
+    struct disk_directory *directory = image->directory;
+    uint8_t *fat = _directory_sector(image->data, RSDOS_FAT_SECTOR);
+    uint8_t *entries = _directory_sector(image->data, RSDOS_FIRST_DIRECTORY_SECTOR);
+    char *paths[RSDOS_ENTRIES] = {NULL};
+    int owners[RSDOS_ENTRIES];
+    int failed_entries[RSDOS_ENTRIES] = {0};
+    int written = 0;
+    int failed = 0;
+
+    for (int i = 0; i < RSDOS_ENTRIES; i++) {
+        uint8_t *entry = entries + i * RSDOS_ENTRY_LENGTH;
+        uint8_t *previous = directory->directory + i * RSDOS_ENTRY_LENGTH;
+        if (entry[0] == 0xff) break;
+        if (entry[0] == 0) {
+            if (previous[0] != 0 && previous[0] != 0xff) {
+                char name[13];
+                _host_name(previous, name);
+                log_message(LOG_INFO, "Directory disk: %s was deleted, it's kept in %s", name, directory->path);
+            }
+            continue;
+        }
+
+        int granules[RSDOS_GRANULES];
+        int granule_count;
+        if (_file_granules(fat, entry, granules, &granule_count) < 0) continue;
+
+        int modified = memcmp(entry, previous, RSDOS_ENTRY_LENGTH) != 0;
+        for (int g = 0; g < granule_count && !modified; g++) {
+            int lba = _granule_lba(granules[g]);
+            for (int s = 0; s < RSDOS_GRANULE_SECTORS; s++) {
+                if (directory->sector_state[lba + s] == DISK_DIRECTORY_SECTOR_MODIFIED) modified = 1;
+            }
+        }
+        if (!modified) continue;
+
+        // the host file of the entry with the same name when the disk was built, or a new file
+        owners[i] = -1;
+        for (int j = 0; j < RSDOS_ENTRIES; j++) {
+            uint8_t *original = directory->directory + j * RSDOS_ENTRY_LENGTH;
+            if (directory->host_names[j] && !memcmp(original, entry, 11)) owners[i] = j;
+        }
+        if (owners[i] >= 0) {
+            paths[i] = strdup(directory->host_names[owners[i]]);
+        } else {
+            char name[13];
+            _host_name(entry, name);
+            if (!_host_name_is_safe(name)) {
+                log_message(LOG_INFO, "Directory disk: %s isn't a valid host file name, skipped", name);
+                continue;
+            }
+            paths[i] = _host_path(directory->path, name);
+        }
+    }
+
+    // the sectors still in the host files that are replaced must be read first
+    for (int i = 0; i < RSDOS_ENTRIES; i++) {
+        if (!paths[i]) continue;
+        _load_entry_sectors(image, i);
+        if (owners[i] >= 0) _load_entry_sectors(image, owners[i]);
+    }
+
+    for (int i = 0; i < RSDOS_ENTRIES; i++) {
+        if (!paths[i]) continue;
+
+        int granules[RSDOS_GRANULES];
+        int granule_count;
+        int length = _file_granules(fat, entries + i * RSDOS_ENTRY_LENGTH, granules, &granule_count);
+        if (_write_host_file(image, paths[i], granules, length)) {
+            failed = 1;
+            failed_entries[i] = 1;
+            free(paths[i]);
+            continue;
+        }
+        written++;
+
+        // the entry now owns the host file, its sectors are all in memory
+        if (directory->host_names[i]) free(directory->host_names[i]);
+        directory->host_names[i] = paths[i];
+        for (int g = 0; g < RSDOS_GRANULES; g++) {
+            if (directory->granule_entry[g] == i) directory->granule_entry[g] = -1;
+        }
+    }
+
+    // the files that weren't written keep their modified sectors and old entry, the next flush retries them
+    int keep[RSDOS_TRACKS * RSDOS_SECTORS] = {0};
+    for (int i = 0; i < RSDOS_ENTRIES; i++) {
+        if (!failed_entries[i]) continue;
+        int granules[RSDOS_GRANULES];
+        int granule_count;
+        _file_granules(fat, entries + i * RSDOS_ENTRY_LENGTH, granules, &granule_count);
+        for (int g = 0; g < granule_count; g++) {
+            for (int s = 0; s < RSDOS_GRANULE_SECTORS; s++) keep[_granule_lba(granules[g]) + s] = 1;
+        }
+    }
+
+    image->dirty_count = 0;
+    for (int lba = 0; lba < RSDOS_TRACKS * RSDOS_SECTORS; lba++) {
+        if (directory->sector_state[lba] != DISK_DIRECTORY_SECTOR_MODIFIED) continue;
+        if (keep[lba]) image->dirty_count++;
+        else directory->sector_state[lba] = DISK_DIRECTORY_SECTOR_LOADED;
+    }
+    for (int i = 0; i < RSDOS_ENTRIES; i++) {
+        if (failed_entries[i]) continue;
+        memcpy(directory->directory + i * RSDOS_ENTRY_LENGTH, entries + i * RSDOS_ENTRY_LENGTH, RSDOS_ENTRY_LENGTH);
+    }
+    if (failed && !image->dirty_count) image->dirty_count = 1;
+
+    log_message(LOG_INFO, "Directory disk %s: %d files written", directory->path, written);
+    return failed;
+}
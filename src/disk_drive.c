@@ -18,8 +18,18 @@
 #include "disk_drive.h"
 #include "controls.h"
 #include "utils.h"
+#include "settings.h"
 
 #define BYTE_RW_DELAY_NS 32000
+#define HEAD_LOAD_DELAY_NS 15000000
+#define ID_FIELD_BYTES 7          // FE, track, side, sector, length, CRC
+#define ID_TO_DATA_BYTES 38       // gap 2, sync and data address mark
+
+// write track: where the written bytes go
+#define WRITE_TRACK_GAP 0
+#define WRITE_TRACK_SYNC 1        // after F5, an address mark can follow
+#define WRITE_TRACK_ID 2
+#define WRITE_TRACK_DATA 3
 
 // emulating WD 1793
 
@@ -27,10 +37,15 @@
 struct disk_drive_status *disk_drive_create(void) {
     struct disk_drive_status *drive = malloc(sizeof(struct disk_drive_status));
     memset(drive, 0, sizeof(struct disk_drive_status));
+    drive->sector_length = 256;
+    drive->_trace_current = -1;
 
     return drive;
 }
 
+void _release_halt(struct disk_drive_status *drive);
+void _trace_end(struct disk_drive_status *drive);
+
 void disk_drive_process_next(struct disk_drive_status *drive) {
     drive->next_command_after_nano = 0;
     if (!drive->_next_command) {
@@ -41,10 +56,11 @@ void disk_drive_process_next(struct disk_drive_status *drive) {
 
     next_command(drive);
 
-    if (drive->irq) drive->HALT = 0;
+    if (drive->irq) _release_halt(drive);
 }
 
 void _end_command(struct disk_drive_status *drive) {
+    _trace_end(drive);
     drive->status_1.BUSY = 0;
     drive->next_command_after_nano = 0;
     drive->_next_command = NULL;
@@ -88,10 +104,181 @@ uint64_t _get_stepping(struct disk_drive_status *drive) {
     }
 }
 
+int _get_drive_id(struct disk_drive_status *drive) {
+    if (drive->DRIVE_SELECT_0) return 0;
+    if (drive->DRIVE_SELECT_1) return 1;
+    if (drive->DRIVE_SELECT_2) return 2;
+    if (drive->DRIVE_SELECT_3) return 3;
+    return 0;
+}
+
+// drive select 3 selects the 2nd side when another drive is selected
+int _get_side(struct disk_drive_status *drive) {
+    return drive->DRIVE_SELECT_3 && (drive->DRIVE_SELECT_0 || drive->DRIVE_SELECT_1 || drive->DRIVE_SELECT_2) ? 1 : 0;
+}
+
+// the disk in the selected drive, NULL when there is none
+struct disk_image *_get_image(struct disk_drive_status *drive) {
+    if (!drive->DRIVE_SELECT_0 && !drive->DRIVE_SELECT_1 && !drive->DRIVE_SELECT_2 && !drive->DRIVE_SELECT_3) return NULL;
+    struct disk_image *image = &drive->images[_get_drive_id(drive)];
+    return image->data ? image : NULL;
+}
+
+struct disk_sector *_get_sector(struct disk_drive_status *drive) {
+    struct disk_image *image = _get_image(drive);
+    return image ? disk_image_find_sector(image, drive->track, _get_side(drive), drive->sector) : NULL;
+}
+
+// the data of the current sector or NULL when it isn't in the image, it also sets the sector length
+uint8_t *_get_sector_data(struct disk_drive_status *drive, int for_write) {
+    struct disk_image *image = _get_image(drive);
+    if (!image) return NULL;
+
+    struct disk_sector *sector = disk_image_find_sector(image, drive->track, _get_side(drive), drive->sector);
+    if (!sector) return NULL;
+
+    drive->sector_length = sector->length;
+    return disk_image_sector_data(image, sector, for_write);
+}
+
+// the lowest sector id of the current track, write track fills the sectors from it
+int _get_first_sector_id(struct disk_drive_status *drive) {
+    struct disk_image *image = _get_image(drive);
+    int first = 0;
+    if (!image) return 1;
+
+    int count = disk_image_track_sector_count(image, drive->track, _get_side(drive));
+    for (int i = 0; i < count; i++) {
+        struct disk_sector *sector = disk_image_track_sector(image, drive->track, _get_side(drive), i);
+        if (!first || sector->id < first) first = sector->id;
+    }
+    return first ? first : 1;
+}
+
+uint64_t _get_time(struct disk_drive_status *drive) {
+    return drive->clock_ns ? *drive->clock_ns : 0;
+}
+
+// the time with HALT asserted goes to the drive selected when it was asserted
+void _update_halt_time(struct disk_drive_status *drive, bool was_halted) {
+    if (!was_halted && drive->HALT) {
+        drive->_halt_start_ns = _get_time(drive);
+        drive->_halt_drive_no = _get_drive_id(drive);
+    } else if (was_halted && !drive->HALT) {
+        drive->stats[drive->_halt_drive_no].halt_ns += _get_time(drive) - drive->_halt_start_ns;
+    }
+}
+
+void _release_halt(struct disk_drive_status *drive) {
+    bool was_halted = drive->HALT;
+    drive->HALT = 0;
+    _update_halt_time(drive, was_halted);
+}
+
+// a new command: the previous one gets its final status, the new one is added when the trace is enabled
+void _trace_start(struct disk_drive_status *drive) {
+    if (drive->_trace_current >= 0) {
+        struct disk_trace_entry *previous = &drive->trace[drive->_trace_current];
+        previous->status = drive->status;
+        if (drive->_trace_running) previous->duration_ns = _get_time(drive) - previous->time_ns;
+        drive->_trace_current = -1;
+    }
+    drive->_trace_running = false;
+    if (!app_settings.disk_trace) return;
+
+    struct disk_trace_entry *entry = &drive->trace[drive->trace_next];
+    entry->time_ns = _get_time(drive);
+    entry->duration_ns = 0;
+    entry->drive_no = _get_drive_id(drive);
+    entry->command = drive->command;
+    entry->track = drive->track;
+    entry->sector = drive->sector;
+    entry->status = 0;
+    drive->_trace_current = drive->trace_next;
+    drive->_trace_running = true;
+    drive->trace_next = (drive->trace_next + 1) % DISK_TRACE_SIZE;
+    if (drive->trace_count < DISK_TRACE_SIZE) drive->trace_count++;
+}
+
+void _trace_end(struct disk_drive_status *drive) {
+    if (drive->_trace_current < 0 || !drive->_trace_running) return;
+
+    struct disk_trace_entry *entry = &drive->trace[drive->_trace_current];
+    entry->duration_ns = _get_time(drive) - entry->time_ns;
+    drive->_trace_running = false;
+}
+
+// the time until the ID field of the sector is under the head, counted from after_ns (right away without the rotation timing)
+uint64_t _delay_to_sector(struct disk_drive_status *drive, struct disk_image *image, struct disk_sector *sector, uint64_t after_ns) {
+    if (!app_settings.disk_rotation_timing) return after_ns;
+
+    uint64_t angle_ns = (uint64_t)disk_image_sector_angle(image, sector, app_settings.disk_interleave) * DISK_REVOLUTION_NS / DISK_ANGLE_UNITS;
+    uint64_t head_ns = (_get_time(drive) + after_ns) % DISK_REVOLUTION_NS;
+    return after_ns + (angle_ns + DISK_REVOLUTION_NS - head_ns) % DISK_REVOLUTION_NS;
+}
+
+// the first sector of the track under the head after after_ns, NULL when the track has none
+struct disk_sector *_next_sector_under_head(struct disk_drive_status *drive, uint64_t after_ns, uint64_t *delay_ns) {
+    struct disk_image *image = _get_image(drive);
+    if (!image) return NULL;
+
+    struct disk_sector *next = NULL;
+    int count = disk_image_track_sector_count(image, drive->track, _get_side(drive));
+    for (int i = 0; i < count; i++) {
+        struct disk_sector *sector = disk_image_track_sector(image, drive->track, _get_side(drive), i);
+        uint64_t delay = _delay_to_sector(drive, image, sector, after_ns);
+        if (!next || delay < *delay_ns) {
+            next = sector;
+            *delay_ns = delay;
+        }
+    }
+    return next;
+}
+
+void _command_record_not_found(struct disk_drive_status *drive) {
+    _end_command(drive);
+    drive->status_2_3.RNF = 1;
+}
+
+// the ID field was found but its CRC never matched
+void _command_id_crc_error(struct disk_drive_status *drive) {
+    _command_record_not_found(drive);
+    drive->status_2_3.CRC = 1;
+}
+
+/*
+    Waits for the ID field of the current sector to pass under the head, then continues with
+    next_command after_id_bytes later. The controller gives up after DISK_RNF_REVOLUTIONS
+*/
+void _search_sector(struct disk_drive_status *drive, uint64_t delay_ns, int after_id_bytes, void (*next_command)(struct disk_drive_status *drive)) {
+    struct disk_image *image = _get_image(drive);
+    struct disk_sector *sector = image ? disk_image_find_sector(image, drive->track, _get_side(drive), drive->sector) : NULL;
+    if (!sector) {
+        _schedule_next(drive, delay_ns + (uint64_t)DISK_RNF_REVOLUTIONS * DISK_REVOLUTION_NS, _command_record_not_found);
+        return;
+    }
+    if (sector->flags & DISK_SECTOR_ID_CRC_ERROR) {
+        _schedule_next(drive, delay_ns + (uint64_t)DISK_RNF_REVOLUTIONS * DISK_REVOLUTION_NS, _command_id_crc_error);
+        return;
+    }
+
+    drive->sector_length = sector->length;
+    uint64_t sector_delay_ns = _delay_to_sector(drive, image, sector, delay_ns);
+    drive->stats[_get_drive_id(drive)].rotation_ns += sector_delay_ns - delay_ns;
+    _schedule_next(drive, sector_delay_ns + BYTE_RW_DELAY_NS * after_id_bytes, next_command);
+}
+
+// the index pulse is seen in the type I status, while the disk turns
+bool _get_index_pulse(struct disk_drive_status *drive) {
+    if (!_get_image(drive) || !drive->MOTOR_ON) return false;
+    return _get_time(drive) % DISK_REVOLUTION_NS < DISK_INDEX_PULSE_NS;
+}
+
 void _command_seek(struct disk_drive_status *drive) {
     // log_message(LOG_INFO, "Drive command seek, target=%d, current=%d, stepping=%ld", drive->_seek_track_target, drive->track, _get_stepping(drive));
-    if (drive->track >= drive->tracks) {
-        drive->track = drive->tracks;
+    int tracks = _get_image(drive) ? _get_image(drive)->tracks : DISK_MAX_TRACKS;
+    if (drive->track >= tracks) {
+        drive->track = tracks;
     }
 
     if (drive->track == drive->_seek_track_target) {
@@ -111,12 +298,14 @@ void _command_seek(struct disk_drive_status *drive) {
     }
 
     drive->track += drive->step_direction;
+    drive->stats[_get_drive_id(drive)].seek_distance++;
 
     _schedule_next(drive, _get_stepping(drive), _command_seek);
 }
 
 void _command_step(struct disk_drive_status *drive) {
     _end_command(drive);
+    drive->stats[_get_drive_id(drive)].seek_distance++;
 
     if (drive->command & 0x10) {
         // u flag is set
@@ -126,26 +315,18 @@ void _command_step(struct disk_drive_status *drive) {
     return;
 }
 
-uint8_t *_get_drive_data(struct disk_drive_status *drive) {
-    if (drive->DRIVE_SELECT_0) return drive->_drive_data[0];
-    if (drive->DRIVE_SELECT_1) return drive->_drive_data[1];
-    if (drive->DRIVE_SELECT_2) return drive->_drive_data[2];
-    if (drive->DRIVE_SELECT_3) return drive->_drive_data[3];
-    return NULL;
-}
-
-int _get_drive_id(struct disk_drive_status *drive) {
-    if (drive->DRIVE_SELECT_0) return 0;
-    if (drive->DRIVE_SELECT_1) return 1;
-    if (drive->DRIVE_SELECT_2) return 2;
-    if (drive->DRIVE_SELECT_3) return 3;
-    return 0;
-}
-
 void _command_read_sector(struct disk_drive_status *drive) {
-    uint8_t *_drive_data = _get_drive_data(drive);
-
-    if (drive->sector_data_pos >= drive->sector_length) {
+    uint8_t *sector_data = _get_sector_data(drive, 0);
+
+    if (sector_data && drive->sector_data_pos >= drive->sector_length) {
+        drive->stats[_get_drive_id(drive)].sectors_read++;
+        // the CRC after the data, the command stops on an error
+        if (_get_sector(drive)->flags & DISK_SECTOR_DATA_CRC_ERROR) {
+            log_message(LOG_INFO, "CRC error track=%d, sector=%d", drive->track, drive->sector);
+            drive->status_2_3.CRC = 1;
+            _schedule_next(drive, BYTE_RW_DELAY_NS * 2, _end_command);
+            return;
+        }
         if ((drive->command & 0x10) == 0) {
             // single sector
             _schedule_next(drive, BYTE_RW_DELAY_NS * 2, _end_command);
@@ -156,14 +337,12 @@ void _command_read_sector(struct disk_drive_status *drive) {
 
         // log_message(LOG_INFO, "Drive command read next sector track=%d, sector=%d", drive->track, drive->sector);
 
-        _schedule_next(drive, BYTE_RW_DELAY_NS * 82, _command_read_sector);
+        // after the CRC, the next sector comes when it's under the head
+        _search_sector(drive, BYTE_RW_DELAY_NS * 2, ID_FIELD_BYTES + ID_TO_DATA_BYTES, _command_read_sector);
         return;
     }
 
-    if (!_drive_data ||
-            drive->sector > drive->sectors ||
-            !drive->sector ||
-            drive->track >= drive->tracks) {
+    if (!sector_data) {
         _end_command(drive);
         drive->status_2_3.RNF = 1;
         return;
@@ -174,24 +353,75 @@ void _command_read_sector(struct disk_drive_status *drive) {
         drive->status_2_3.LOST_DATA = 1;
         log_message(LOG_ERROR, "Data lost");
     }
+    if (drive->sector_data_pos == 0) {
+        // record type: deleted data mark
+        drive->status_2_3.RECORD_TYPE__FAULT = _get_sector(drive)->flags & DISK_SECTOR_DELETED ? 1 : 0;
+    }
 
-    int data_pos = (((int)drive->track) * drive->sectors + (int)drive->sector - 1) * drive->sector_length + drive->sector_data_pos;
-    if (drive->sector_data_pos < drive->sector_length && data_pos < drive->_drive_data_length[_get_drive_id(drive)])
-        drive->data = _drive_data[data_pos];
-    // log_message(LOG_INFO, "     read sector track=%d, sector=%d pos=%d data_pos=%d data=%02X", drive->track, drive->sector, drive->sector_data_pos, data_pos, drive->data);
+    drive->data = sector_data[drive->sector_data_pos];
+    // log_message(LOG_INFO, "     read sector track=%d, sector=%d pos=%d data=%02X", drive->track, drive->sector, drive->sector_data_pos, drive->data);
     drive->status_2_3.DATA_REQUEST = 1;
     drive->sector_data_pos++;
 
     _schedule_next(drive, BYTE_RW_DELAY_NS, _command_read_sector);
 }
 
+void _command_write_sector(struct disk_drive_status *drive);
+
+/*
+    Fast transfer: the processor is in the Disk Basic transfer loop, so the rest of the sector is
+    moved at once instead of byte by byte, then the command continues normally from the sector end
+    Returns the count of bytes read (0 when the drive isn't waiting in a read sector command)
+*/
+int disk_drive_fast_read(struct disk_drive_status *drive, uint8_t *buffer, int length) {
+    if (drive->_next_command != _command_read_sector || !drive->status_2_3.DATA_REQUEST) return 0;
+    if (drive->sector_data_pos <= 0 || drive->sector_data_pos > drive->sector_length) return 0;
+
+    uint8_t *sector_data = _get_sector_data(drive, 0);
+    if (!sector_data) return 0;
+
+    int count = drive->sector_length - drive->sector_data_pos + 1;
+    if (count > length) return 0;
+
+    // the byte already in the data register, then the rest of the sector
+    buffer[0] = drive->data;
+    memcpy(buffer + 1, sector_data + drive->sector_data_pos, count - 1);
+    drive->data = buffer[count - 1];
+    drive->sector_data_pos = drive->sector_length;
+    drive->status_2_3.DATA_REQUEST = 0;
+
+    _schedule_next(drive, BYTE_RW_DELAY_NS, _command_read_sector);
+    return count;
+}
+
+// the count of bytes the write sector command is waiting for (0 when it isn't)
+int disk_drive_fast_write_length(struct disk_drive_status *drive) {
+    if (drive->_next_command != _command_write_sector || !drive->status_2_3.DATA_REQUEST) return 0;
+    if (drive->sector_data_pos < -1 || drive->sector_data_pos >= drive->sector_length) return 0;
+    if (!_get_sector_data(drive, 0)) return 0;
+
+    return drive->sector_length - (drive->sector_data_pos < 0 ? 0 : drive->sector_data_pos);
+}
+
+// writes the bytes given by disk_drive_fast_write_length, the last one is written by the command as usual
+void disk_drive_fast_write(struct disk_drive_status *drive, const uint8_t *buffer, int length) {
+    uint8_t *sector_data = _get_sector_data(drive, 1);
+    int start = drive->sector_data_pos < 0 ? 0 : drive->sector_data_pos;
+    if (!sector_data || length <= 0 || start + length != drive->sector_length) return;
+
+    memcpy(sector_data + start, buffer, length - 1);
+    drive->data = buffer[length - 1];
+    drive->sector_data_pos = drive->sector_length - 1;
+    drive->status_2_3.DATA_REQUEST = 0;
+    drive->status_2_3.LOST_DATA = 0;
+
+    _schedule_next(drive, BYTE_RW_DELAY_NS, _command_write_sector);
+}
+
 void _command_write_sector(struct disk_drive_status *drive) {
-    uint8_t *_drive_data = _get_drive_data(drive);
+    uint8_t *sector_data = _get_sector_data(drive, 1);
 
-    if (!_drive_data ||
-            drive->sector > drive->sectors ||
-            !drive->sector ||
-            drive->track >= drive->tracks) {
+    if (!sector_data) {
         _end_command(drive);
         drive->status_2_3.RNF = 1;
         return;
@@ -222,14 +452,17 @@ void _command_write_sector(struct disk_drive_status *drive) {
     if (drive->status_2_3.DATA_REQUEST) {
         log_message(LOG_ERROR, "Data lost");
         drive->status_2_3.LOST_DATA = 1;
-        _drive_data[(((int)drive->track) * drive->sectors + (int)drive->sector - 1) * drive->sector_length + drive->sector_data_pos] = 0;
+        sector_data[drive->sector_data_pos] = 0;
     } else {
         drive->status_2_3.LOST_DATA = 0;
-        _drive_data[(((int)drive->track) * drive->sectors + (int)drive->sector - 1) * drive->sector_length + drive->sector_data_pos] = drive->data;
+        sector_data[drive->sector_data_pos] = drive->data;
     }
     drive->sector_data_pos++;
 
     if (drive->sector_data_pos >= drive->sector_length) {
+        // the CRC follows the data, a0 writes a deleted data mark
+        disk_image_sector_written(_get_image(drive), _get_sector(drive), drive->command & 1);
+        drive->stats[_get_drive_id(drive)].sectors_written++;
         if ((drive->command & 0x10) == 0) {
             // single sector
             _end_command(drive);
@@ -237,7 +470,7 @@ void _command_write_sector(struct disk_drive_status *drive) {
         }
         drive->sector_data_pos = -2;
         drive->sector++;
-        _schedule_next(drive, BYTE_RW_DELAY_NS * (3 + 18 + 2), _command_write_sector);
+        _search_sector(drive, BYTE_RW_DELAY_NS * 3, ID_FIELD_BYTES, _command_write_sector);
         return;
     }
 
@@ -247,18 +480,15 @@ void _command_write_sector(struct disk_drive_status *drive) {
 
 
 /*
-It simulates track write command
-all non-data fields are ignored, it just waits for FB writes to mark the start of the data, writes 256 bytes, then waits
-for 4E to mark switching to next sector
-It will not work correctly if expected bytes aren't sent
+    Write track: the bytes are written from an index pulse to the next one. F5 writes an A1 sync byte and presets
+    the CRC, F7 writes the 2 bytes of the CRC and ends the ID or data field. The sector of a data field
+    is given by the ID field before it, the gaps and the ID fields themselves aren't kept by the image
 */
 void _command_write_track(struct disk_drive_status *drive) {
-    uint8_t *_drive_data = _get_drive_data(drive);
+    struct disk_image *image = _get_image(drive);
 
-    if (!_drive_data ||
-            drive->sector > drive->sectors ||
-            !drive->sector ||
-            drive->track >= drive->tracks) {
+    // the track is written from an index pulse to the next one
+    if (!image || _get_time(drive) - drive->_track_write_start_ns >= DISK_REVOLUTION_NS) {
         _end_command(drive);
         return;
     }
@@ -270,58 +500,62 @@ void _command_write_track(struct disk_drive_status *drive) {
         data = 0;
     }
 
-    if (drive->sector_data_pos >= 0 && drive->sector_data_pos < drive->sector_length) {
-        _drive_data[(((int)drive->track) * drive->sectors + (int)drive->sector - 1) * drive->sector_length + drive->sector_data_pos] = data;
-    }
-
-    if (drive->sector_data_pos > drive->sector_length) {
-        // log_message(LOG_INFO, "Data after = %02x", data);
-    }
-    if (drive->sector_data_pos > drive->sector_length && data == 0x4e) {
-        // a sector completed, move to next
-        drive->sector_data_pos = -1;
-        drive->sector++;
-        // log_message(LOG_INFO, "Switching next sector");
-    } else if (drive->sector_data_pos >= 0) {
-        drive->sector_data_pos++;
-    } else if (data == 0xfb) {  // data address mark
-        drive->sector_data_pos = 0;
-        // log_message(LOG_INFO, "_command_write_track, start writing sector %d", drive->sector);
+    switch (drive->_track_field) {
+        case WRITE_TRACK_ID:
+            if (data == 0xf7) {
+                drive->sector = drive->_id_field[2];
+                drive->_track_field = WRITE_TRACK_GAP;
+            } else if (drive->sector_data_pos < 4) {
+                drive->_id_field[drive->sector_data_pos++] = data;
+            }
+            break;
+        case WRITE_TRACK_DATA:
+            if (data == 0xf7) {
+                struct disk_sector *sector = _get_sector(drive);
+                if (sector) {
+                    disk_image_sector_written(image, sector, drive->_data_mark == 0xf8);
+                    drive->stats[_get_drive_id(drive)].sectors_written++;
+                }
+                drive->sector++;
+                drive->_track_field = WRITE_TRACK_GAP;
+            } else {
+                uint8_t *sector_data = _get_sector_data(drive, 1);
+                if (sector_data && drive->sector_data_pos < drive->sector_length) sector_data[drive->sector_data_pos] = data;
+                drive->sector_data_pos++;
+            }
+            break;
+        default:
+            if (data == 0xf5) {
+                drive->_track_field = WRITE_TRACK_SYNC;
+            } else if (drive->_track_field == WRITE_TRACK_SYNC && data == 0xfe) {
+                drive->_track_field = WRITE_TRACK_ID;
+                drive->sector_data_pos = 0;
+            } else if (drive->_track_field == WRITE_TRACK_SYNC && (data == 0xfb || data == 0xf8)) {
+                drive->_track_field = WRITE_TRACK_DATA;
+                drive->_data_mark = data;
+                drive->sector_data_pos = 0;
+            } else {
+                drive->_track_field = WRITE_TRACK_GAP;
+            }
+            break;
     }
 
     drive->status_2_3.DATA_REQUEST = 1;
     _schedule_next(drive, BYTE_RW_DELAY_NS, _command_write_track);
 }
 
+// the 6 bytes of the ID field found by the read address command
 void _command_read_address(struct disk_drive_status *drive) {
     unsigned old_data_request = drive->status_2_3.DATA_REQUEST;
-    uint8_t *_drive_data = _get_drive_data(drive);
 
     if (drive->sector_data_pos >= 6) {
         _end_command(drive);
-        drive->sector = drive->track;
+        // the track address of the ID field goes to the sector register
+        drive->sector = drive->_id_field[0];
         return;
     }
 
-    if (!_drive_data ||
-            drive->sector > drive->sectors ||
-            !drive->sector ||
-            drive->track >= drive->tracks) {
-        _end_command(drive);
-        drive->status_2_3.RNF = 1;
-        return;
-    }
-
-    switch(drive->sector_data_pos) {
-        case 0: drive->data = drive->track; break;
-        case 2: drive->data = drive->sector; break;
-        case 3: drive->data = 0x01; // sector length
-        case 1:  // side
-        case 4:  // crc1
-        case 5:  // crc2
-            drive->data = 0; break;
-    }
-    drive->data = _drive_data[(((int)drive->track) * drive->sectors + (int)drive->sector - 1) * drive->sector_length + drive->sector_data_pos];
+    drive->data = drive->_id_field[drive->sector_data_pos];
     drive->sector_data_pos++;
     drive->status_2_3.DATA_REQUEST = 1;
     if (old_data_request) {
@@ -331,11 +565,33 @@ void _command_read_address(struct disk_drive_status *drive) {
     _schedule_next(drive, BYTE_RW_DELAY_NS, _command_read_address);
 }
 
+/*
+    Read track: the bytes of the track from an index pulse to the next one, with the gaps,
+    the address marks and the CRCs
+*/
+void _command_read_track(struct disk_drive_status *drive) {
+    struct disk_image *image = _get_image(drive);
+    int length = 0;
+    const uint8_t *raw_track = image ? disk_image_raw_track(image, drive->track, _get_side(drive), app_settings.disk_interleave, &length) : NULL;
+
+    if (!raw_track || drive->sector_data_pos >= length) {
+        _end_command(drive);
+        return;
+    }
+
+    if (drive->status_2_3.DATA_REQUEST) {
+        drive->status_2_3.LOST_DATA = 1;
+    }
+    drive->data = raw_track[drive->sector_data_pos];
+    drive->sector_data_pos++;
+    drive->status_2_3.DATA_REQUEST = 1;
+    _schedule_next(drive, BYTE_RW_DELAY_NS, _command_read_track);
+}
+
 void disk_drive_reset(struct disk_drive_status *drive) {
     drive->_next_command = NULL;
     drive->next_command_after_nano = 0;
     drive->irq = 0;
-    drive->HALT = 0;
     drive->status_1.BUSY = 0;
     drive->drive_select_ff = 0;
     drive->command = 3;
@@ -346,9 +602,16 @@ void disk_drive_reset(struct disk_drive_status *drive) {
     _clear_status_1(drive);
     drive->_seek_track_target = 0;
     _command_seek(drive);
+    _release_halt(drive);
 }
 
 void _start_command(struct disk_drive_status *drive) {
+    struct disk_drive_stats *stats = &drive->stats[_get_drive_id(drive)];
+    _trace_start(drive);
+    stats->commands++;
+    if ((drive->command & 0x80) == 0) stats->seeks++;
+    else if ((drive->command & 0xf0) != 0xD0 && (drive->command & 4)) stats->settle_ns += HEAD_LOAD_DELAY_NS;
+
     if ((drive->command & 0xf0) == 0) {
         // restore
         log_message(LOG_INFO, "Drive command restore %02X", drive->command);
@@ -383,37 +646,67 @@ void _start_command(struct disk_drive_status *drive) {
         log_message(LOG_INFO, "Drive command read sector track=%d, sector=%d", drive->track, drive->sector);
         drive->sector_data_pos = 0;
         _clear_status_2(drive);
-        _schedule_next(drive, drive->command & 4 ? 15000000 : BYTE_RW_DELAY_NS * 55, _command_read_sector);
+        _search_sector(drive, drive->command & 4 ? HEAD_LOAD_DELAY_NS : 0, ID_FIELD_BYTES + ID_TO_DATA_BYTES, _command_read_sector);
     } else if ((drive->command & 0xe0) == 0xA0) {
         // write sector
         log_message(LOG_INFO, "Drive command write sector track=%d, sector=%d", drive->track, drive->sector);
         drive->sector_data_pos = -2;
         _clear_status_2(drive);
-        if (drive->is_write_protect[_get_drive_id(drive)]) {
+        if (_get_image(drive) && _get_image(drive)->is_write_protect) {
             log_message(LOG_INFO, "Disk is write protected");
             _end_command(drive);
             drive->status_2_3.PROTECTED = 1;
         } else {
-            _schedule_next(drive, drive->command & 4 ? 15000000 : BYTE_RW_DELAY_NS * (18 + 2), _command_write_sector);
+            _search_sector(drive, drive->command & 4 ? HEAD_LOAD_DELAY_NS : 0, ID_FIELD_BYTES, _command_write_sector);
         }
     } else if ((drive->command & 0xf0) == 0xC0) {
         // read address
         log_message(LOG_INFO, "Drive command read address");
         drive->sector_data_pos = 0;
         _clear_status_2(drive);
-        drive->sector = 1;
-        _schedule_next(drive, drive->command & 4 ? 15000000 : BYTE_RW_DELAY_NS * 55, _command_read_address);
+        // the ID field of the next sector under the head
+        uint64_t delay_ns = drive->command & 4 ? HEAD_LOAD_DELAY_NS : 0;
+        struct disk_sector *sector = _next_sector_under_head(drive, delay_ns, &delay_ns);
+        if (sector) {
+            disk_image_id_field(_get_image(drive), sector, drive->_id_field);
+            drive->status_2_3.CRC = sector->flags & DISK_SECTOR_ID_CRC_ERROR ? 1 : 0;
+            // the data follows the address mark
+            _schedule_next(drive, delay_ns + BYTE_RW_DELAY_NS, _command_read_address);
+        } else {
+            _schedule_next(drive, delay_ns + (uint64_t)DISK_RNF_REVOLUTIONS * DISK_REVOLUTION_NS, _command_record_not_found);
+        }
     } else if ((drive->command & 0xf0) == 0xE0) {
         // read track
-        log_message(LOG_INFO, "Drive command read track");
+        log_message(LOG_INFO, "Drive command read track track=%d", drive->track);
+        _clear_status_2(drive);
+        drive->sector_data_pos = 0;
+        if (!_get_image(drive)) {
+            _end_command(drive);
+        } else {
+            // the reading starts at the next index pulse
+            uint64_t delay_ns = drive->command & 4 ? HEAD_LOAD_DELAY_NS : 0;
+            delay_ns += (DISK_REVOLUTION_NS - (_get_time(drive) + delay_ns) % DISK_REVOLUTION_NS) % DISK_REVOLUTION_NS;
+            _schedule_next(drive, delay_ns, _command_read_track);
+        }
     } else if ((drive->command & 0xf0) == 0xF0) {
         // write track
         log_message(LOG_INFO, "Drive command write track");
         _clear_status_2(drive);
-        drive->sector = 1;
-        drive->sector_data_pos = 0 - (101 + 59);
-        drive->status_2_3.DATA_REQUEST = 1;
-        _schedule_next(drive, drive->command & 4 ? 15000000 : BYTE_RW_DELAY_NS * (18 + 2), _command_write_track);
+        drive->sector = _get_first_sector_id(drive);
+        drive->sector_data_pos = 0;
+        drive->_track_field = WRITE_TRACK_GAP;
+        if (_get_image(drive) && _get_image(drive)->is_write_protect) {
+            log_message(LOG_INFO, "Disk is write protected");
+            _end_command(drive);
+            drive->status_2_3.PROTECTED = 1;
+        } else {
+            // the writing starts at the next index pulse
+            uint64_t delay_ns = drive->command & 4 ? HEAD_LOAD_DELAY_NS : 0;
+            delay_ns += (DISK_REVOLUTION_NS - (_get_time(drive) + delay_ns) % DISK_REVOLUTION_NS) % DISK_REVOLUTION_NS;
+            drive->_track_write_start_ns = _get_time(drive) + delay_ns;
+            drive->status_2_3.DATA_REQUEST = 1;
+            _schedule_next(drive, delay_ns, _command_write_track);
+        }
     } else if ((drive->command & 0xf0) == 0xD0) {
         // force interrupt
         log_message(LOG_INFO, "Drive command force interrupt");
@@ -428,11 +721,17 @@ void _start_command(struct disk_drive_status *drive) {
         if ((drive->command & 0xf) != 0) {
             drive->irq = 1;
         }
+        _trace_end(drive);
     } else {
         log_message(LOG_ERROR, "Unknow drive command %02x", drive->command);
     }
 }
 
+// restore, seek, step and force interrupt show the type I status
+bool _is_type_1_command(struct disk_drive_status *drive) {
+    return (drive->command & 0x80) == 0 || (drive->command & 0xf0) == 0xD0;
+}
+
 uint8_t disk_drive_read_register(void *data, uint16_t address) {
     struct disk_drive_status *drive = data;
     // log_message(LOG_INFO, "disk_drive_read_register: %02x", address);
@@ -446,6 +745,7 @@ uint8_t disk_drive_read_register(void *data, uint16_t address) {
     {
         case 0:
         {
+            if (_is_type_1_command(drive)) drive->status_1.INDEX = _get_index_pulse(drive);
             uint8_t ret = drive->status;
             drive->irq = 0;
             return ret;
@@ -467,8 +767,10 @@ void disk_drive_write_register(void *data, uint16_t address, uint8_t value) {
     // log_message(LOG_INFO, "disk_drive_write_register: %02x %02x", address, value);
 
     if ((address & 0x8) == 0) {
+        bool was_halted = drive->HALT;
         drive->drive_select_ff = value;
         if (drive->irq) drive->HALT = 0;
+        _update_halt_time(drive, was_halted);
         return;
     }
 
@@ -494,7 +796,7 @@ void disk_drive_write_register(void *data, uint16_t address, uint8_t value) {
             drive->status_2_3.LOST_DATA = 0;
             break;
     }
-    if (drive->irq) drive->HALT = 0;
+    if (drive->irq) _release_halt(drive);
 }
 
 
@@ -550,107 +852,125 @@ int disk_drive_create_empty_image(const char * filename) {
 
 
 int disk_drive_load_disk(struct disk_drive_status *drive, int drive_no, const char *path) {
-    if (drive->_drive_data[drive_no]) {
-#ifdef _WIN32
-        UnmapViewOfFile(drive->_drive_data[drive_no]);
-        CloseHandle(drive->_drive_map_handle[drive_no]);
-        drive->_drive_map_handle[drive_no] = NULL;
-        CloseHandle(drive->_drive_file_handle[drive_no]);
-        drive->_drive_file_handle[drive_no] = NULL;
-#else
-        munmap(drive->_drive_data[drive_no], drive->_drive_data_length[drive_no]);
-#endif
-        drive->_drive_data[drive_no] = NULL;
-    }
+    struct disk_image *image = &drive->images[drive_no];
+
+    disk_image_close(image);
     if (!path) {
         log_message(LOG_INFO, "Unloading disk:%d", drive_no);
         return 0;
     }
 
     log_message(LOG_INFO, "Loading disk:%d %s", drive_no, path);
-
-    drive->is_write_protect[drive_no] = is_file_writable(path) ? 0 : 1;
-    if(drive->is_write_protect[drive_no]) {
-        log_message(LOG_INFO, "Disk is readonly %s", path);
-    }
-
-#ifdef _WIN32
-    drive->_drive_file_handle[drive_no] = CreateFile(
-        path, 
-        drive->is_write_protect[drive_no] ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
-        0,
-        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (drive->_drive_file_handle[drive_no] == INVALID_HANDLE_VALUE) {
-        log_message(LOG_ERROR, "Error opening disk:%s", path);
+    if (disk_image_open(image, path, disk_drive_write_mode(drive_no))) {
         return 1;
     }
+    log_message(LOG_INFO, "Disk format: %s", image->format->name);
+    drive->sector_data_pos = 0;
 
-    LARGE_INTEGER ldisk_file_length;
-    if (!GetFileSizeEx(drive->_drive_file_handle[drive_no], &ldisk_file_length)) {
-        log_message(LOG_ERROR, "Error read disk size:%s", path);
-        CloseHandle(drive->_drive_file_handle[drive_no]);
-        drive->_drive_file_handle[drive_no] = NULL;
-        return 1;
-    }
-    size_t disk_file_length = ldisk_file_length.QuadPart;
-
-    drive->_drive_map_handle[drive_no] = CreateFileMappingA(
-        drive->_drive_file_handle[drive_no],
-        NULL,
-        drive->is_write_protect[drive_no] ? PAGE_READONLY : PAGE_READWRITE,
-        0, 0, NULL);
-    if (drive->_drive_map_handle[drive_no] == INVALID_HANDLE_VALUE) {
-        log_message(LOG_ERROR, "Error mapping disk:%s", path);
-        CloseHandle(drive->_drive_file_handle[drive_no]);
-        drive->_drive_file_handle[drive_no] = NULL;
-        return 1;
+    return 0;
+}
+
+int disk_drive_write_mode(int drive_no) {
+    return app_settings.disks[drive_no].overlay ? DISK_WRITE_OVERLAY : app_settings.disk_write_mode;
+}
+
+// exchanges the image of a drive with an image opened elsewhere
+void disk_drive_swap_image(struct disk_drive_status *drive, int drive_no, struct disk_image *image) {
+    struct disk_image previous = drive->images[drive_no];
+    drive->images[drive_no] = *image;
+    *image = previous;
+    drive->sector_data_pos = 0;
+}
+
+// writes back the modified sectors of the disks idle for DISK_FLUSH_DELAY_NS, or all of them with force
+void disk_drive_flush(struct disk_drive_status *drive, int force) {
+    for (int i = 0; i < 4; i++) {
+        struct disk_image *image = &drive->images[i];
+        if (!image->data || !image->dirty_count) continue;
+        if (!force && (drive->status_1.BUSY || nanos() - image->last_write_ns < DISK_FLUSH_DELAY_NS)) continue;
+
+        disk_image_flush(image);
     }
+}
 
-    drive->_drive_data[drive_no] = MapViewOfFile(
-        drive->_drive_map_handle[drive_no],
-        drive->is_write_protect[drive_no] ? FILE_MAP_READ: FILE_MAP_ALL_ACCESS,
-        0, 0, 0);
-    if (drive->_drive_data[drive_no] == NULL) {
-        log_message(LOG_ERROR, "Error reading disk:%s", path);
-        CloseHandle(drive->_drive_map_handle[drive_no]);
-        drive->_drive_map_handle[drive_no] = NULL;
-        CloseHandle(drive->_drive_file_handle[drive_no]);
-        drive->_drive_file_handle[drive_no] = NULL;
-        return 1;
+void disk_drive_reset_activity(struct disk_drive_status *drive) {
+    memset(drive->stats, 0, sizeof(drive->stats));
+    drive->trace_next = 0;
+    drive->trace_count = 0;
+    drive->_trace_current = -1;
+    drive->_trace_running = false;
+    drive->_halt_start_ns = _get_time(drive);
+}
+
+const char *_command_name(uint8_t command) {
+    switch (command & 0xf0) {
+        case 0x00: return "restore";
+        case 0x10: return "seek";
+        case 0x20: case 0x30: return "step";
+        case 0x40: case 0x50: return "step in";
+        case 0x60: case 0x70: return "step out";
+        case 0x80: case 0x90: return "read sector";
+        case 0xA0: case 0xB0: return "write sector";
+        case 0xC0: return "read address";
+        case 0xD0: return "force interrupt";
+        case 0xE0: return "read track";
+        default: return "write track";
     }
-#else
-    int fd = open(path, O_RDWR);
-    if (fd < 0) {
-        error_general_file(path);
-        return 1;
+}
+
+int _format_trace_entry(struct disk_drive_status *drive, int index, char *text, int length) {
+    struct disk_trace_entry *entry = &drive->trace[index];
+    // the running command has the current status
+    uint8_t status = index == drive->_trace_current ? drive->status : entry->status;
+    return snprintf(text, length, "%12.3f ms  drive %d  %02X %-15s track %3d sector %3d  status %02X  %10.3f ms\n",
+        entry->time_ns / 1e6, entry->drive_no + 1, entry->command, _command_name(entry->command),
+        entry->track, entry->sector, status, entry->duration_ns / 1e6);
+}
+
+// the statistics of the drives and the traced commands, oldest first. Returns the text length
+int disk_drive_format_activity(struct disk_drive_status *drive, char *text, int length) {
+    int pos = 0;
+    for (int i = 0; i < 4 && pos < length; i++) {
+        struct disk_drive_stats *stats = &drive->stats[i];
+        pos += snprintf(text + pos, length - pos,
+            "Drive %d: %"PRIu64" commands, %"PRIu64" sectors read, %"PRIu64" written, %"PRIu64" seeks (%"PRIu64" tracks), "
+            "head load %.1f ms, rotation %.1f ms, halted %.1f ms\n",
+            i + 1, stats->commands, stats->sectors_read, stats->sectors_written, stats->seeks, stats->seek_distance,
+            stats->settle_ns / 1e6, stats->rotation_ns / 1e6, stats->halt_ns / 1e6);
+    }
+    int first = (drive->trace_next - drive->trace_count + DISK_TRACE_SIZE) % DISK_TRACE_SIZE;
+    for (int i = 0; i < drive->trace_count && pos < length; i++) {
+        pos += _format_trace_entry(drive, (first + i) % DISK_TRACE_SIZE, text + pos, length - pos);
+    }
+    return pos < length ? pos : length - 1;
+}
+
+// the trace file contents, taken by the emulation and written by the UI. The caller frees it
+char *disk_drive_format_trace(struct disk_drive_status *drive) {
+    int length = 100 + drive->trace_count * 200;
+    char *text = malloc(length);
+    if (!text) return NULL;
+
+    int pos = snprintf(text, length, "# time, drive, command, track and sector registers, status at the end, duration\n");
+    int first = (drive->trace_next - drive->trace_count + DISK_TRACE_SIZE) % DISK_TRACE_SIZE;
+    for (int i = 0; i < drive->trace_count && pos < length; i++) {
+        pos += _format_trace_entry(drive, (first + i) % DISK_TRACE_SIZE, text + pos, length - pos);
     }
+    return text;
+}
 
-    struct stat st;
-    if (fstat(fd, &st) < 0)
-    {
-        error_general_file(path);
-        close(fd);
+int disk_drive_save_trace(const char *trace, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_message(LOG_ERROR, "Can't create %s: %s", path, strerror(errno));
         return 1;
     }
 
-    size_t disk_file_length = st.st_size;
-
-    if ((drive->_drive_data[drive_no] = mmap(NULL, disk_file_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
-    {
-        error_general_file(path);
-        close(fd);
-        drive->_drive_data[drive_no] = 0;
+    fputs(trace, fp);
+    if (fclose(fp)) {
+        log_message(LOG_ERROR, "Can't write %s: %s", path, strerror(errno));
         return 1;
     }
-    close(fd);
-#endif
-
-
-    drive->_drive_data_length[drive_no] = disk_file_length;
-    drive->tracks = 35;
-    drive->sectors = 18;
-    drive->sector_length = 256;
-    drive->sector_data_pos = 0;
-
+    log_message(LOG_INFO, "Disk trace saved to %s", path);
     return 0;
 }
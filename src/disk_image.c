@@ -0,0 +1,991 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <fileapi.h>
+    #include <io.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "disk_image.h"
+#include "disk_directory.h"
+#include "crc16.h"
+#include "utils.h"
+
+
+int _disk_image_init_index(struct disk_image *image) {
+    int slots = image->tracks * image->sides;
+
+    image->sector_list = NULL;
+    image->sector_count = 0;
+    image->track_sector_start = malloc((slots + 1) * sizeof(int));
+    image->sector_index = malloc(slots * DISK_MAX_SECTOR_ID * sizeof(int));
+    if (!image->track_sector_start || !image->sector_index) return 1;
+
+    memset(image->track_sector_start, 0, (slots + 1) * sizeof(int));
+    for (int i = 0; i < slots * DISK_MAX_SECTOR_ID; i++) image->sector_index[i] = -1;
+    return 0;
+}
+
+// the sectors must be added in physical order, track/side after track/side
+void _disk_image_add_sector(struct disk_image *image, int slot, struct disk_sector *sector) {
+    if ((image->sector_count & 0xff) == 0) {
+        image->sector_list = realloc(image->sector_list, (image->sector_count + 0x100) * sizeof(struct disk_sector));
+    }
+    image->sector_list[image->sector_count] = *sector;
+
+    // with duplicated ids (protected disks) the first one is found
+    int *index = &image->sector_index[slot * DISK_MAX_SECTOR_ID + sector->id];
+    if (*index < 0) *index = image->sector_count;
+
+    image->sector_count++;
+    image->track_sector_start[slot + 1] = image->sector_count;
+}
+
+void _disk_image_start_track(struct disk_image *image, int slot) {
+    image->track_sector_start[slot] = image->sector_count;
+    image->track_sector_start[slot + 1] = image->sector_count;
+}
+
+/*
+    JVC and raw images
+    The header is optional (the file length modulo 256), every field is optional (default in brackets):
+    sectors per track [18], sides [1], sector size code (128 << code) [1], first sector id [1], sector attributes flag [0]
+    The track count comes from the remaining length
+*/
+#define JVC_ATTRIBUTE_CRC_ERROR 0x08
+#define JVC_ATTRIBUTE_DELETED 0x20
+
+int _jvc_probe(struct disk_image *image) {
+    return 1;
+}
+
+// a byte of attributes before the data of each sector
+bool _jvc_has_attributes(struct disk_image *image) {
+    return image->format->probe == _jvc_probe && image->header_length > 4 && image->data[4];
+}
+
+int _jvc_build_index(struct disk_image *image) {
+    size_t header_length = image->length % 256;
+    uint8_t *header = image->data;
+
+    int sectors = header_length > 0 ? header[0] : 18;
+    int sides = header_length > 1 ? header[1] : 1;
+    int size_code = header_length > 2 ? header[2] & 3 : 1;
+    int first_sector = header_length > 3 ? header[3] : 1;
+    int sector_attributes = header_length > 4 && header[4] ? 1 : 0;
+    int sector_length = 128 << size_code;
+
+    if (!sectors || sides < 1 || sides > 2 || first_sector + sectors > DISK_MAX_SECTOR_ID) {
+        log_message(LOG_ERROR, "Invalid JVC header: sectors=%d sides=%d first_sector=%d", sectors, sides, first_sector);
+        return 1;
+    }
+
+    size_t track_length = (size_t)sectors * (sector_length + sector_attributes);
+    size_t tracks = (image->length - header_length) / (track_length * sides);
+    if (!tracks) {
+        log_message(LOG_ERROR, "Disk image is too small");
+        return 1;
+    }
+    image->tracks = tracks > 255 ? 255 : (int)tracks;
+    image->sides = sides;
+    image->header_length = header_length;
+    image->track_length = track_length;
+    if (_disk_image_init_index(image)) return 1;
+
+    for (int track = 0; track < image->tracks; track++) {
+        for (int side = 0; side < sides; side++) {
+            int slot = track * sides + side;
+            _disk_image_start_track(image, slot);
+            for (int s = 0; s < sectors; s++) {
+                struct disk_sector sector = {
+                    .track = track,
+                    .side = side,
+                    .id = first_sector + s,
+                    .size_code = size_code,
+                    .id_offset = 0,
+                    .offset = header_length + slot * track_length + s * (sector_length + sector_attributes) + sector_attributes,
+                    .length = sector_length,
+                };
+                _disk_image_add_sector(image, slot, &sector);
+            }
+        }
+    }
+
+    log_message(LOG_INFO, "JVC disk: tracks=%d sides=%d sectors=%d sector_length=%d first_sector=%d header=%d",
+        image->tracks, sides, sectors, sector_length, first_sector, (int)header_length);
+    return 0;
+}
+
+/*
+    VDK: "dk", header length (LE) at 2, track count at 8, side count at 9, flags at 10 (bit 0: write protected)
+    and compression at 11, then 18 sectors of 256 bytes per track
+*/
+#define VDK_SECTORS 18
+#define VDK_SECTOR_LENGTH 256
+
+int _vdk_probe(struct disk_image *image) {
+    return image->length >= 12 && image->data[0] == 'd' && image->data[1] == 'k';
+}
+
+int _vdk_build_index(struct disk_image *image) {
+    uint8_t *header = image->data;
+    size_t header_length = header[2] | (header[3] << 8);
+    int sides = header[9];
+
+    if (header_length < 12 || header_length > image->length || sides < 1 || sides > 2) {
+        log_message(LOG_ERROR, "Invalid VDK header: length=%d sides=%d", (int)header_length, sides);
+        return 1;
+    }
+    if (header[11]) {
+        log_message(LOG_ERROR, "Compressed VDK images aren't supported");
+        return 1;
+    }
+
+    size_t track_length = VDK_SECTORS * VDK_SECTOR_LENGTH;
+    size_t available_tracks = (image->length - header_length) / (track_length * sides);
+    image->tracks = header[8] < available_tracks ? header[8] : (int)available_tracks;
+    image->sides = sides;
+    image->header_length = header_length;
+    image->track_length = track_length;
+    if (header[10] & 1) image->is_write_protect = 1;
+    if (!image->tracks) {
+        log_message(LOG_ERROR, "Disk image is too small");
+        return 1;
+    }
+    if (_disk_image_init_index(image)) return 1;
+
+    for (int track = 0; track < image->tracks; track++) {
+        for (int side = 0; side < sides; side++) {
+            int slot = track * sides + side;
+            _disk_image_start_track(image, slot);
+            for (int s = 0; s < VDK_SECTORS; s++) {
+                struct disk_sector sector = {
+                    .track = track,
+                    .side = side,
+                    .id = s + 1,
+                    .size_code = 1,
+                    .id_offset = 0,
+                    .offset = header_length + slot * track_length + s * VDK_SECTOR_LENGTH,
+                    .length = VDK_SECTOR_LENGTH,
+                };
+                _disk_image_add_sector(image, slot, &sector);
+            }
+        }
+    }
+
+    log_message(LOG_INFO, "VDK disk: tracks=%d sides=%d", image->tracks, sides);
+    return 0;
+}
+
+/*
+    DMK: 16 bytes header: write protect (0xff) at 0, track count at 1, track length (LE) at 2,
+    flags at 4 (bit 4: single sided, bit 6: single density)
+    Each track starts with a table of 64 IDAM pointers (LE, bit 15: double density, 0 ends the table)
+    relative to the track start, followed by the raw track bytes
+*/
+#define RAW_TRACK_GAP_4A 32  // the gaps of a Disk Basic formatted track
+#define RAW_TRACK_GAP_2 22
+#define RAW_TRACK_GAP_3 24
+
+#define DMK_HEADER_LENGTH 16
+#define DMK_IDAM_TABLE_LENGTH 128
+
+int _dmk_probe(struct disk_image *image) {
+    if (image->length < DMK_HEADER_LENGTH) return 0;
+
+    uint8_t *header = image->data;
+    size_t track_length = header[2] | (header[3] << 8);
+    int sides = header[4] & 0x10 ? 1 : 2;
+
+    if (header[0] != 0 && header[0] != 0xff) return 0;
+    if (!header[1] || track_length <= DMK_IDAM_TABLE_LENGTH || track_length > 0x4000) return 0;
+    return DMK_HEADER_LENGTH + header[1] * sides * track_length == image->length;
+}
+
+int _dmk_build_index(struct disk_image *image) {
+    uint8_t *header = image->data;
+    int single_density = header[4] & 0x40 ? 1 : 0;
+    int skipped = 0;
+
+    image->tracks = header[1];
+    image->sides = header[4] & 0x10 ? 1 : 2;
+    image->header_length = DMK_HEADER_LENGTH;
+    image->track_length = header[2] | (header[3] << 8);
+    if (header[0] == 0xff) image->is_write_protect = 1;
+    if (_disk_image_init_index(image)) return 1;
+
+    for (int slot = 0; slot < image->tracks * image->sides; slot++) {
+        size_t track_start = DMK_HEADER_LENGTH + slot * image->track_length;
+        uint8_t *track = image->data + track_start;
+        _disk_image_start_track(image, slot);
+
+        for (int i = 0; i < DMK_IDAM_TABLE_LENGTH / 2; i++) {
+            uint16_t pointer = track[i * 2] | (track[i * 2 + 1] << 8);
+            if (!pointer) break;
+
+            size_t idam = pointer & 0x3fff;
+            int double_density = pointer & 0x8000 ? 1 : 0;
+            if (idam < DMK_IDAM_TABLE_LENGTH || idam + 7 > image->track_length || track[idam] != 0xfe) continue;
+            if (!double_density && !single_density) {
+                // single density bytes are doubled in a double density image
+                skipped++;
+                continue;
+            }
+
+            struct disk_sector sector = {
+                .track = track[idam + 1],
+                .side = track[idam + 2],
+                .id = track[idam + 3],
+                .size_code = track[idam + 4] & 3,
+                .id_offset = track_start + idam,
+                .length = 128 << (track[idam + 4] & 3),
+            };
+
+            // the data address mark follows the ID field and the gap
+            size_t dam = 0;
+            for (size_t pos = idam + 7; pos < idam + 7 + 60 && pos < image->track_length; pos++) {
+                if (track[pos] == 0xfb || track[pos] == 0xf8) {
+                    dam = pos;
+                    break;
+                }
+            }
+            if (!dam || dam + 1 + sector.length > image->track_length) {
+                skipped++;
+                continue;
+            }
+            sector.offset = track_start + dam + 1;
+            _disk_image_add_sector(image, slot, &sector);
+        }
+    }
+
+    if (skipped) log_message(LOG_INFO, "DMK disk: %d sectors without data or in single density were skipped", skipped);
+    log_message(LOG_INFO, "DMK disk: tracks=%d sides=%d track_length=%d sectors=%d",
+        image->tracks, image->sides, (int)image->track_length, image->sector_count);
+    return 0;
+}
+
+// a host directory, the disk built in memory is a raw 35 tracks image
+int _directory_probe(struct disk_image *image) {
+    return image->directory != NULL;
+}
+
+// probed in order, JVC accepts anything so it must be the last
+static const struct disk_format disk_formats[] = {
+    { "Directory", _directory_probe, _jvc_build_index },
+    { "VDK", _vdk_probe, _vdk_build_index },
+    { "DMK", _dmk_probe, _dmk_build_index },
+    { "JVC", _jvc_probe, _jvc_build_index },
+};
+
+struct disk_sector *disk_image_find_sector(struct disk_image *image, int track, int side, int id) {
+    if (track < 0 || track >= image->tracks || side < 0 || side >= image->sides || id < 0 || id >= DISK_MAX_SECTOR_ID) return NULL;
+
+    int index = image->sector_index[(track * image->sides + side) * DISK_MAX_SECTOR_ID + id];
+    return index < 0 ? NULL : &image->sector_list[index];
+}
+
+int disk_image_track_sector_count(struct disk_image *image, int track, int side) {
+    if (track < 0 || track >= image->tracks || side < 0 || side >= image->sides) return 0;
+
+    int slot = track * image->sides + side;
+    return image->track_sector_start[slot + 1] - image->track_sector_start[slot];
+}
+
+// the sectors of a track in physical order
+struct disk_sector *disk_image_track_sector(struct disk_image *image, int track, int side, int position) {
+    if (position < 0 || position >= disk_image_track_sector_count(image, track, side)) return NULL;
+
+    return &image->sector_list[image->track_sector_start[track * image->sides + side] + position];
+}
+
+// the track/side slot of a sector of sector_list
+int _disk_image_sector_slot(struct disk_image *image, int index) {
+    int low = 0, high = image->tracks * image->sides - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (index < image->track_sector_start[middle + 1]) high = middle;
+        else low = middle + 1;
+    }
+    return low;
+}
+
+/*
+    Position of the ID field of a sector on its track, in DISK_ANGLE_UNITS from the index hole
+    DMK images keep the real position of the sectors. With the other formats the sectors of a track
+    are spread evenly: the sector after the n-th one of the list is interleave slots further (or on the next free slot)
+*/
+uint32_t disk_image_sector_angle(struct disk_image *image, struct disk_sector *sector, int interleave) {
+    if (sector->id_offset && image->track_length > DMK_IDAM_TABLE_LENGTH) {
+        size_t position = (sector->id_offset - image->header_length) % image->track_length - DMK_IDAM_TABLE_LENGTH;
+        return (uint32_t)(position * DISK_ANGLE_UNITS / (image->track_length - DMK_IDAM_TABLE_LENGTH));
+    }
+
+    int index = (int)(sector - image->sector_list);
+    int track_slot = _disk_image_sector_slot(image, index);
+    int slot_count = image->track_sector_start[track_slot + 1] - image->track_sector_start[track_slot];
+    int position = index - image->track_sector_start[track_slot];
+    if (interleave < 1) interleave = 1;
+
+    bool taken[DISK_MAX_SECTOR_ID] = {false};
+    int slot = 0;
+    for (int n = 0; ; n++) {
+        while (taken[slot]) slot = (slot + 1) % slot_count;
+        if (n == position) break;
+        taken[slot] = true;
+        slot = (slot + interleave) % slot_count;
+    }
+    return (uint32_t)(slot * DISK_ANGLE_UNITS / slot_count);
+}
+
+// CRC of an ID or data field from its address mark, in double density the 3 A1 sync bytes come first
+uint16_t _field_crc(bool double_density, uint8_t mark, const uint8_t *data, int length) {
+    uint16_t crc = CRC16_INIT;
+    if (double_density) crc = crc16_update(crc, (const uint8_t *)"\xa1\xa1\xa1", 3);
+    crc = crc16_update_byte(crc, mark);
+    return crc16_update(crc, data, length);
+}
+
+bool _dmk_double_density(struct disk_image *image) {
+    return !(image->data[4] & 0x40);
+}
+
+// the CRC after the data of a DMK sector is in the same track
+bool _dmk_has_data_crc(struct disk_image *image, struct disk_sector *sector) {
+    size_t track_end = image->header_length + ((sector->id_offset - image->header_length) / image->track_length + 1) * image->track_length;
+    return sector->offset + sector->length + 2 <= track_end;
+}
+
+// the CRC errors and the deleted data marks recorded in the file
+uint8_t _disk_image_file_flags(struct disk_image *image, struct disk_sector *sector) {
+    const uint8_t *data = image->data;
+    uint8_t flags = 0;
+
+    if (sector->id_offset) {
+        const uint8_t *id = data + sector->id_offset;
+        bool double_density = _dmk_double_density(image);
+        if (_field_crc(double_density, id[0], id + 1, 4) != (id[5] << 8 | id[6])) flags |= DISK_SECTOR_ID_CRC_ERROR;
+
+        uint8_t mark = data[sector->offset - 1];
+        const uint8_t *crc = data + sector->offset + sector->length;
+        if (mark == 0xf8) flags |= DISK_SECTOR_DELETED;
+        if (!_dmk_has_data_crc(image, sector) ||
+            _field_crc(double_density, mark, data + sector->offset, sector->length) != (crc[0] << 8 | crc[1])) {
+            flags |= DISK_SECTOR_DATA_CRC_ERROR;
+        }
+    } else if (_jvc_has_attributes(image)) {
+        uint8_t attributes = data[sector->offset - 1];
+        if (attributes & JVC_ATTRIBUTE_CRC_ERROR) flags |= DISK_SECTOR_DATA_CRC_ERROR;
+        if (attributes & JVC_ATTRIBUTE_DELETED) flags |= DISK_SECTOR_DELETED;
+    }
+    return flags;
+}
+
+// one pass over the sectors of the file, when it's opened and when its changes are discarded
+void _disk_image_check_sectors(struct disk_image *image) {
+    int crc_errors = 0, deleted = 0;
+    for (int i = 0; i < image->sector_count; i++) {
+        struct disk_sector *sector = &image->sector_list[i];
+        sector->flags = _disk_image_file_flags(image, sector);
+        if (sector->flags & (DISK_SECTOR_ID_CRC_ERROR | DISK_SECTOR_DATA_CRC_ERROR)) crc_errors++;
+        if (sector->flags & DISK_SECTOR_DELETED) deleted++;
+    }
+    if (crc_errors || deleted) {
+        log_message(LOG_INFO, "Disk %s: %d sectors with a CRC error, %d with a deleted data mark", image->path, crc_errors, deleted);
+    }
+}
+
+/*
+    The bytes around the data of a sector that follow its flags: the byte before the data (DMK: data address mark,
+    JVC: attributes) and the DMK data CRC. Returns the count of CRC bytes, or -1 when the format has none of them
+*/
+int _disk_image_sector_marks(struct disk_image *image, struct disk_sector *sector, const uint8_t *data, uint8_t *mark, uint8_t *crc) {
+    if (sector->id_offset) {
+        *mark = sector->flags & DISK_SECTOR_DELETED ? 0xf8 : 0xfb;
+        if (!_dmk_has_data_crc(image, sector)) return 0;
+
+        uint16_t value = _field_crc(_dmk_double_density(image), *mark, data, sector->length);
+        if (sector->flags & DISK_SECTOR_DATA_CRC_ERROR) value ^= 0xffff;
+        crc[0] = value >> 8;
+        crc[1] = value & 0xff;
+        return 2;
+    }
+    if (_jvc_has_attributes(image)) {
+        *mark = image->data[sector->offset - 1] & ~(JVC_ATTRIBUTE_CRC_ERROR | JVC_ATTRIBUTE_DELETED);
+        if (sector->flags & DISK_SECTOR_DATA_CRC_ERROR) *mark |= JVC_ATTRIBUTE_CRC_ERROR;
+        if (sector->flags & DISK_SECTOR_DELETED) *mark |= JVC_ATTRIBUTE_DELETED;
+        return 0;
+    }
+    return -1;
+}
+
+void _disk_image_clear_track_cache(struct disk_image *image, int slot) {
+    if (!image->track_cache) return;
+
+    int first = slot < 0 ? 0 : slot;
+    int last = slot < 0 ? image->tracks * image->sides - 1 : slot;
+    for (int i = first; i <= last; i++) {
+        if (image->track_cache[i]) free(image->track_cache[i]);
+        image->track_cache[i] = NULL;
+    }
+}
+
+// the ID field or the data field of a sector with its address mark, the sync bytes and the CRC
+int _raw_track_field(uint8_t *raw, uint8_t mark, const uint8_t *data, int length) {
+    int pos = 0;
+    memset(raw, 0, 12);
+    pos += 12;
+    memset(raw + pos, 0xa1, 3);
+    pos += 3;
+    raw[pos++] = mark;
+    memcpy(raw + pos, data, length);
+    pos += length;
+
+    uint16_t crc = _field_crc(true, mark, data, length);
+    raw[pos++] = crc >> 8;
+    raw[pos++] = crc & 0xff;
+    return pos;
+}
+
+/*
+    A double density track in the IBM format, as the sectors are placed by disk_image_sector_angle:
+    gap 4a, then for each sector the ID field, gap 2, the data field and gap 3, then gap 4b up to the index
+*/
+int _disk_image_build_raw_track(struct disk_image *image, int track, int side, int interleave, uint8_t **raw_track) {
+    int count = disk_image_track_sector_count(image, track, side);
+    size_t size = DISK_RAW_TRACK_LENGTH;
+    struct disk_sector *sectors[DISK_MAX_SECTOR_ID];
+    uint32_t angles[DISK_MAX_SECTOR_ID];
+
+    // the sectors sorted by their position
+    for (int i = 0; i < count; i++) {
+        struct disk_sector *sector = disk_image_track_sector(image, track, side, i);
+        uint32_t angle = disk_image_sector_angle(image, sector, interleave);
+        int j = i;
+        for (; j > 0 && angles[j - 1] > angle; j--) {
+            sectors[j] = sectors[j - 1];
+            angles[j] = angles[j - 1];
+        }
+        sectors[j] = sector;
+        angles[j] = angle;
+        size += sector->length + 150;
+    }
+
+    uint8_t *raw = malloc(size);
+    memset(raw, 0x4e, size);
+    int pos = RAW_TRACK_GAP_4A;
+    for (int i = 0; i < count; i++) {
+        struct disk_sector *sector = sectors[i];
+        int target = RAW_TRACK_GAP_4A + (int)((uint64_t)angles[i] * (DISK_RAW_TRACK_LENGTH - RAW_TRACK_GAP_4A) / DISK_ANGLE_UNITS);
+        if (pos < target) pos = target;
+
+        // the CRC errors are kept with a wrong CRC
+        uint8_t id_field[4] = {sector->track, sector->side, sector->id, sector->size_code};
+        pos += _raw_track_field(raw + pos, 0xfe, id_field, 4);
+        if (sector->flags & DISK_SECTOR_ID_CRC_ERROR) raw[pos - 1] ^= 0xff;
+        pos += RAW_TRACK_GAP_2;
+        uint8_t mark = sector->flags & DISK_SECTOR_DELETED ? 0xf8 : 0xfb;
+        pos += _raw_track_field(raw + pos, mark, disk_image_sector_data(image, sector, 0), sector->length);
+        if (sector->flags & DISK_SECTOR_DATA_CRC_ERROR) raw[pos - 1] ^= 0xff;
+        pos += RAW_TRACK_GAP_3;
+    }
+
+    *raw_track = raw;
+    return pos > DISK_RAW_TRACK_LENGTH ? pos : DISK_RAW_TRACK_LENGTH;
+}
+
+// DMK images have the track bytes, the sectors modified in the cache are copied over them with their marks
+int _disk_image_dmk_raw_track(struct disk_image *image, int track, int side, uint8_t **raw_track) {
+    int slot = track * image->sides + side;
+    size_t track_start = image->header_length + slot * image->track_length + DMK_IDAM_TABLE_LENGTH;
+    int length = (int)(image->track_length - DMK_IDAM_TABLE_LENGTH);
+
+    uint8_t *raw = malloc(length);
+    memcpy(raw, image->data + track_start, length);
+
+    int count = disk_image_track_sector_count(image, track, side);
+    for (int i = 0; i < count; i++) {
+        struct disk_sector *sector = disk_image_track_sector(image, track, side, i);
+        uint8_t *data = disk_image_sector_data(image, sector, 0);
+        // an injected CRC error on a sector that wasn't modified has a good CRC in the file
+        if (data == image->data + sector->offset && (!(sector->flags & DISK_SECTOR_DATA_CRC_ERROR) ||
+            (_disk_image_file_flags(image, sector) & DISK_SECTOR_DATA_CRC_ERROR))) continue;
+
+        int data_pos = (int)(sector->offset - track_start);
+        uint8_t mark, crc[2];
+        int crc_length = _disk_image_sector_marks(image, sector, data, &mark, crc);
+        memcpy(raw + data_pos, data, sector->length);
+        raw[data_pos - 1] = mark;
+        memcpy(raw + data_pos + sector->length, crc, crc_length);
+    }
+
+    *raw_track = raw;
+    return length;
+}
+
+/*
+    The bytes of a track as read by the read track command, built when the track is first read
+    and kept until one of its sectors is written (or the interleave changes)
+*/
+const uint8_t *disk_image_raw_track(struct disk_image *image, int track, int side, int interleave, int *length) {
+    if (track < 0 || track >= image->tracks || side < 0 || side >= image->sides) return NULL;
+
+    int slots = image->tracks * image->sides;
+    if (!image->track_cache) {
+        image->track_cache = calloc(slots, sizeof(uint8_t *));
+        image->track_cache_length = calloc(slots, sizeof(int));
+    }
+    if (image->track_cache_interleave != interleave) {
+        _disk_image_clear_track_cache(image, -1);
+        image->track_cache_interleave = interleave;
+    }
+
+    int slot = track * image->sides + side;
+    if (!image->track_cache[slot]) {
+        image->track_cache_length[slot] = image->format->probe == _dmk_probe ?
+            _disk_image_dmk_raw_track(image, track, side, &image->track_cache[slot]) :
+            _disk_image_build_raw_track(image, track, side, interleave, &image->track_cache[slot]);
+    }
+    *length = image->track_cache_length[slot];
+    return image->track_cache[slot];
+}
+
+/*
+    With the write back/volatile/overlay modes the file is mapped read only and shared
+    through the page cache, a sector is copied to the cache when it's first written and then read from there
+*/
+uint8_t *disk_image_sector_data(struct disk_image *image, struct disk_sector *sector, int for_write) {
+    if (for_write && image->track_cache) {
+        _disk_image_clear_track_cache(image, _disk_image_sector_slot(image, (int)(sector - image->sector_list)));
+    }
+    if (image->directory) return disk_directory_sector_data(image, sector, for_write);
+    if (image->write_mode == DISK_WRITE_THROUGH) return image->data + sector->offset;
+
+    int index = (int)(sector - image->sector_list);
+    if (!image->sector_cache[index]) {
+        if (!for_write) return image->data + sector->offset;
+
+        image->sector_cache[index] = malloc(sector->length);
+        memcpy(image->sector_cache[index], image->data + sector->offset, sector->length);
+        image->dirty_count++;
+    }
+    if (for_write) image->last_write_ns = nanos();
+    return image->sector_cache[index];
+}
+
+/*
+    The controller wrote the data field of a sector, with a good CRC. In the write through mode
+    its address mark and its CRC are updated in the file now, the write back mode writes them with the data
+*/
+void disk_image_sector_written(struct disk_image *image, struct disk_sector *sector, bool deleted) {
+    sector->flags &= ~(DISK_SECTOR_DATA_CRC_ERROR | DISK_SECTOR_DELETED);
+    if (deleted) sector->flags |= DISK_SECTOR_DELETED;
+    if (image->write_mode != DISK_WRITE_THROUGH || image->directory || image->is_write_protect) return;
+
+    uint8_t mark, crc[2];
+    int crc_length = _disk_image_sector_marks(image, sector, image->data + sector->offset, &mark, crc);
+    if (crc_length < 0) return;
+    image->data[sector->offset - 1] = mark;
+    memcpy(image->data + sector->offset + sector->length, crc, crc_length);
+}
+
+// the ID field of a sector as the read address command gets it: track, side, sector, length code and CRC
+void disk_image_id_field(struct disk_image *image, struct disk_sector *sector, uint8_t *id_field) {
+    if (sector->id_offset) {
+        memcpy(id_field, image->data + sector->id_offset + 1, 6);
+        return;
+    }
+
+    id_field[0] = sector->track;
+    id_field[1] = sector->side;
+    id_field[2] = sector->id;
+    id_field[3] = sector->size_code;
+    uint16_t crc = _field_crc(true, 0xfe, id_field, 4);
+    if (sector->flags & DISK_SECTOR_ID_CRC_ERROR) crc ^= 0xffff;
+    id_field[4] = crc >> 8;
+    id_field[5] = crc & 0xff;
+}
+
+// for testing: the data field of the sector has a CRC error until the sector is written again
+int disk_image_inject_crc_error(struct disk_image *image, int track, int side, int id) {
+    struct disk_sector *sector = image->data ? disk_image_find_sector(image, track, side, id) : NULL;
+    if (!sector) {
+        log_message(LOG_ERROR, "No sector %d on track %d side %d", id, track, side);
+        return 1;
+    }
+
+    sector->flags |= DISK_SECTOR_DATA_CRC_ERROR;
+    _disk_image_clear_track_cache(image, track * image->sides + side);
+    log_message(LOG_INFO, "CRC error injected on track %d side %d sector %d", track, side, id);
+    return 0;
+}
+
+int _disk_image_write_file(struct disk_image *image, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        log_message(LOG_ERROR, "Can't create %s: %s", path, strerror(errno));
+        return 1;
+    }
+
+    // the mapped file with the cached sectors over it
+    size_t pos = 0;
+    int ok = 1;
+    for (int i = 0; i < image->sector_count && ok; i++) {
+        struct disk_sector *sector = &image->sector_list[i];
+        if (!image->sector_cache[i]) continue;
+
+        if (sector->offset > pos) ok = fwrite(image->data + pos, 1, sector->offset - pos, fp) == sector->offset - pos;
+        if (ok) ok = fwrite(image->sector_cache[i], 1, sector->length, fp) == sector->length;
+        pos = sector->offset + sector->length;
+    }
+    if (ok && image->length > pos) ok = fwrite(image->data + pos, 1, image->length - pos, fp) == image->length - pos;
+
+    // then the marks and the CRCs of the written sectors
+    for (int i = 0; i < image->sector_count && ok; i++) {
+        struct disk_sector *sector = &image->sector_list[i];
+        uint8_t mark, crc[2];
+        int crc_length = image->sector_cache[i] ? _disk_image_sector_marks(image, sector, image->sector_cache[i], &mark, crc) : -1;
+        if (crc_length < 0) continue;
+
+        ok = fseek(fp, sector->offset - 1, SEEK_SET) == 0 && fputc(mark, fp) != EOF;
+        if (ok && crc_length) ok = fseek(fp, sector->offset + sector->length, SEEK_SET) == 0 && fwrite(crc, 1, crc_length, fp) == (size_t)crc_length;
+    }
+    if (ok) ok = fflush(fp) == 0;
+#ifdef _WIN32
+    if (ok) ok = _commit(_fileno(fp)) == 0;
+#else
+    if (ok) ok = fsync(fileno(fp)) == 0;
+#endif
+    if (fclose(fp)) ok = 0;
+
+    if (!ok) {
+        log_message(LOG_ERROR, "Can't write %s: %s", path, strerror(errno));
+        remove(path);
+        return 1;
+    }
+    return 0;
+}
+
+// the modified sectors of a directory are in memory in the write through mode too
+bool _disk_image_writes_back(struct disk_image *image) {
+    return image->write_mode == DISK_WRITE_BACK || (image->directory && image->write_mode == DISK_WRITE_THROUGH);
+}
+
+/*
+    Writes the image with the modified sectors to a temporary file that replaces the image,
+    so the file is never left half written. The new file is then mapped and the cache is empty again
+*/
+int disk_image_flush(struct disk_image *image) {
+    if (!_disk_image_writes_back(image) || !image->dirty_count || !image->data) return 0;
+    if (image->directory) return disk_directory_flush(image);
+
+    char *path = strdup(image->path);
+    char *temp_path = malloc(strlen(path) + 5);
+    sprintf(temp_path, "%s.tmp", path);
+
+    if (_disk_image_write_file(image, temp_path)) {
+        free(temp_path);
+        free(path);
+        return 1;
+    }
+
+    int modified = image->dirty_count;
+    image->dirty_count = 0;
+    disk_image_close(image);
+
+#ifdef _WIN32
+    int failed = !MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    int failed = rename(temp_path, path) != 0;
+#endif
+    if (failed) {
+        log_message(LOG_ERROR, "Can't replace %s, the changes are in %s", path, temp_path);
+    } else {
+        log_message(LOG_INFO, "Disk %s flushed (%d sectors)", path, modified);
+    }
+
+    int ret = disk_image_open(image, path, DISK_WRITE_BACK) || failed;
+    free(temp_path);
+    free(path);
+    return ret;
+}
+
+/*
+    Copies the modified sectors of a write back image, so disk_image_flush_copy writes them from another thread
+    The image keeps its cache until the flushed image replaces it. Returns 1 when there's nothing to copy
+*/
+int disk_image_copy_writes(struct disk_image *image, struct disk_image *copy) {
+    memset(copy, 0, sizeof(struct disk_image));
+    if (image->write_mode != DISK_WRITE_BACK || image->directory || !image->dirty_count || !image->data) return 1;
+
+    copy->path = strdup(image->path);
+    copy->write_mode = DISK_WRITE_BACK;
+    copy->sector_count = image->sector_count;
+    copy->sector_list = malloc(image->sector_count * sizeof(struct disk_sector));
+    memcpy(copy->sector_list, image->sector_list, image->sector_count * sizeof(struct disk_sector));
+    copy->sector_cache = calloc(image->sector_count, sizeof(uint8_t *));
+    for (int i = 0; i < image->sector_count; i++) {
+        if (!image->sector_cache[i]) continue;
+        copy->sector_cache[i] = malloc(image->sector_list[i].length);
+        memcpy(copy->sector_cache[i], image->sector_cache[i], image->sector_list[i].length);
+        copy->dirty_count++;
+    }
+    return 0;
+}
+
+/*
+    Flushes a copy of disk_image_copy_writes: the file is mapped again, the copied sectors go over it
+    and it's flushed. The copy becomes the image of the new file, to be swapped in with disk_image_take_writes
+*/
+int disk_image_flush_copy(struct disk_image *image) {
+    struct disk_image copy = *image;
+    memset(image, 0, sizeof(struct disk_image));
+
+    int failed = disk_image_open(image, copy.path, DISK_WRITE_BACK);
+    if (!failed && image->sector_count != copy.sector_count) {
+        log_message(LOG_ERROR, "Disk %s changed, it isn't flushed", copy.path);
+        failed = 1;
+    }
+    if (!failed) {
+        for (int i = 0; i < copy.sector_count; i++) {
+            if (!copy.sector_cache[i]) continue;
+            image->sector_cache[i] = copy.sector_cache[i];
+            image->sector_list[i].flags = copy.sector_list[i].flags;
+            image->dirty_count++;
+            copy.sector_cache[i] = NULL;
+        }
+        failed = disk_image_flush(image);
+    }
+    if (failed) {
+        // the image being emulated still has the sectors, it's flushed again later
+        image->dirty_count = 0;
+        disk_image_close(image);
+    }
+    copy.dirty_count = 0;
+    disk_image_close(&copy);
+    return failed;
+}
+
+/*
+    The flushed image replaces the image: the sectors written since the copy was taken move to it
+    Returns 1 when the flushed image doesn't have the same sectors, the image is then unchanged
+*/
+int disk_image_take_writes(struct disk_image *image, struct disk_image *flushed) {
+    if (!flushed->data || flushed->sector_count != image->sector_count) return 1;
+
+    for (int i = 0; i < image->sector_count; i++) {
+        struct disk_sector *sector = &image->sector_list[i];
+        uint8_t *data = image->sector_cache[i];
+        bool same_marks = flushed->sector_list[i].flags == sector->flags;
+        flushed->sector_list[i].flags = sector->flags;
+        if (!data) continue;
+
+        image->sector_cache[i] = NULL;
+        if (same_marks && !memcmp(data, flushed->data + sector->offset, sector->length)) {
+            // already in the file
+            free(data);
+            continue;
+        }
+        flushed->sector_cache[i] = data;
+        flushed->dirty_count++;
+    }
+    image->dirty_count = 0;
+    flushed->last_write_ns = image->last_write_ns;
+    return 0;
+}
+
+// drops the modified sectors, the disk is back to the content of the file
+void disk_image_discard(struct disk_image *image) {
+    if (image->directory && image->dirty_count) {
+        // the disk is built again from the directory
+        char *path = strdup(image->path);
+        log_message(LOG_INFO, "Disk %s: %d modified sectors discarded", path, image->dirty_count);
+        image->dirty_count = 0;
+        disk_image_open(image, path, image->write_mode);
+        free(path);
+        return;
+    }
+    if (!image->sector_cache) return;
+
+    for (int i = 0; i < image->sector_count; i++) {
+        if (image->sector_cache[i]) free(image->sector_cache[i]);
+        image->sector_cache[i] = NULL;
+    }
+    if (image->dirty_count) log_message(LOG_INFO, "Disk %s: %d modified sectors discarded", image->path, image->dirty_count);
+    image->dirty_count = 0;
+    _disk_image_clear_track_cache(image, -1);
+    _disk_image_check_sectors(image);
+}
+
+void disk_image_close(struct disk_image *image) {
+    if (image->dirty_count) {
+        if (_disk_image_writes_back(image)) disk_image_flush(image);
+        else log_message(LOG_INFO, "Disk %s: the changes are discarded", image->path);
+    }
+    image->dirty_count = 0;
+    image->flush_id = 0;
+
+    if (image->sector_cache) {
+        for (int i = 0; i < image->sector_count; i++) {
+            if (image->sector_cache[i]) free(image->sector_cache[i]);
+        }
+        free(image->sector_cache);
+        image->sector_cache = NULL;
+    }
+    if (image->path) {
+        free(image->path);
+        image->path = NULL;
+    }
+
+    if (image->directory) {
+        disk_directory_close(image);
+    } else if (image->data) {
+#ifdef _WIN32
+        UnmapViewOfFile(image->data);
+        CloseHandle(image->map_handle);
+        image->map_handle = NULL;
+        CloseHandle(image->file_handle);
+        image->file_handle = NULL;
+#else
+        munmap(image->data, image->length);
+#endif
+        image->data = NULL;
+    }
+    if (image->track_cache) {
+        _disk_image_clear_track_cache(image, -1);
+        free(image->track_cache);
+        free(image->track_cache_length);
+        image->track_cache = NULL;
+        image->track_cache_length = NULL;
+    }
+    if (image->sector_list) free(image->sector_list);
+    if (image->track_sector_start) free(image->track_sector_start);
+    if (image->sector_index) free(image->sector_index);
+    image->sector_list = NULL;
+    image->track_sector_start = NULL;
+    image->sector_index = NULL;
+    image->sector_count = 0;
+    image->length = 0;
+    image->tracks = 0;
+    image->sides = 0;
+    image->format = NULL;
+}
+
+// maps the image file in memory, read only unless map_writable
+int _disk_image_map_file(struct disk_image *image, const char *path, bool map_writable) {
+#ifdef _WIN32
+    image->file_handle = CreateFile(
+        path,
+        map_writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        map_writable ? 0 : FILE_SHARE_READ | FILE_SHARE_DELETE,  // a flush replaces the file while it's mapped
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (image->file_handle == INVALID_HANDLE_VALUE) {
+        log_message(LOG_ERROR, "Error opening disk:%s", path);
+        return 1;
+    }
+
+    LARGE_INTEGER ldisk_file_length;
+    if (!GetFileSizeEx(image->file_handle, &ldisk_file_length)) {
+        log_message(LOG_ERROR, "Error read disk size:%s", path);
+        CloseHandle(image->file_handle);
+        image->file_handle = NULL;
+        return 1;
+    }
+    size_t disk_file_length = ldisk_file_length.QuadPart;
+
+    image->map_handle = CreateFileMappingA(
+        image->file_handle,
+        NULL,
+        map_writable ? PAGE_READWRITE : PAGE_READONLY,
+        0, 0, NULL);
+    if (image->map_handle == INVALID_HANDLE_VALUE) {
+        log_message(LOG_ERROR, "Error mapping disk:%s", path);
+        CloseHandle(image->file_handle);
+        image->file_handle = NULL;
+        return 1;
+    }
+
+    image->data = MapViewOfFile(
+        image->map_handle,
+        map_writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ,
+        0, 0, 0);
+    if (image->data == NULL) {
+        log_message(LOG_ERROR, "Error reading disk:%s", path);
+        CloseHandle(image->map_handle);
+        image->map_handle = NULL;
+        CloseHandle(image->file_handle);
+        image->file_handle = NULL;
+        return 1;
+    }
+#else
+    // on the media loader thread: the error is logged, the UI reports the failed load
+    int fd = open(path, map_writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        log_message(LOG_ERROR, "Error opening disk %s: %s", path, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        log_message(LOG_ERROR, "Error reading disk %s: %s", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    size_t disk_file_length = st.st_size;
+
+    if ((image->data = mmap(NULL, disk_file_length, map_writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Error mapping disk %s: %s", path, strerror(errno));
+        close(fd);
+        image->data = NULL;
+        return 1;
+    }
+    close(fd);
+#endif
+
+    image->length = disk_file_length;
+    return 0;
+}
+
+int disk_image_open(struct disk_image *image, const char *path, int write_mode) {
+    disk_image_close(image);
+
+    // with an overlay the writes never reach the file, so it doesn't have to be writable
+    image->is_write_protect = write_mode != DISK_WRITE_OVERLAY && !is_file_writable(path) ? 1 : 0;
+    if(image->is_write_protect) {
+        log_message(LOG_INFO, "Disk is readonly %s", path);
+    }
+    image->write_mode = write_mode;
+    bool map_writable = write_mode == DISK_WRITE_THROUGH && !image->is_write_protect;
+
+    // a host directory is turned into an RS-DOS disk in memory
+    int failed = disk_directory_is_directory(path) ? disk_directory_open(image, path) : _disk_image_map_file(image, path, map_writable);
+    if (failed) return 1;
+
+    for (int i = 0; i < (int)(sizeof(disk_formats) / sizeof(disk_formats[0])); i++) {
+        if (!disk_formats[i].probe(image)) continue;
+
+        image->format = &disk_formats[i];
+        if (image->format->build_index(image)) {
+            disk_image_close(image);
+            return 1;
+        }
+        image->path = strdup(path);
+        image->sector_cache = calloc(image->sector_count ? image->sector_count : 1, sizeof(uint8_t *));
+        _disk_image_check_sectors(image);
+        return 0;
+    }
+
+    disk_image_close(image);
+    return 1;
+}
@@ -9,8 +9,42 @@
 // Just by testing, I found that 70ms provide a stable keyboard with no misses with extended color basic
 #define KEYBOARD_POLL_PERIOD_NS 70000000
 
+// Color Basic cassette routines and variables used by the cassette fast loading
+#define CASSETTE_BLKIN_ADDR 0xa70b   // reads a block from the cassette
+#define CASSETTE_BLKTYP_ADDR 0x7c    // block type
+#define CASSETTE_BLKLEN_ADDR 0x7d    // block length
+#define CASSETTE_CBUFAD_ADDR 0x7e    // block buffer address
+#define CASSETTE_CSRERR_ADDR 0x81    // error status, 0 means no error
+
+// Disk Basic DSKCON transfer loops, the processor is halted by the controller until each byte is ready
+static const uint8_t disk_read_loop[] = {0xb6, 0xff, 0x4b, 0xa7, 0x80};   // LDA $FF4B; STA ,X+
+static const uint8_t disk_write_loop[] = {0xa6, 0x80, 0xb7, 0xff, 0x4b};  // LDA ,X+; STA $FF4B
+#define DISK_LOOP_CYCLES 14  // cycles of one loop iteration (with the BRA/DECB)
+
 int keyboard_buffer_empty();
 SDL_Event keyboard_buffer_pull();
+void _machine_reset_cartridge_port(struct machine_status *machine);
+void _machine_run_commands(struct machine_status *machine);
+void _machine_update_snapshot(struct machine_status *machine);
+
+
+// the installed RAM of the settings, 64K when it isn't a CoCo size
+uint32_t _machine_ram_size(void) {
+    switch (app_settings.ram_size) {
+        case 4:
+        case 16:
+        case 32:
+            return app_settings.ram_size * 1024;
+        default:
+            return 0x10000;
+    }
+}
+
+// the RAM size input of the PIA ($FF22 bit 2) is set with the 16K and 64K chips, the reset ROM sets the SAM from it
+void _machine_set_ram_size(struct machine_status *machine) {
+    machine->sam->ram_size = _machine_ram_size();
+    mc6821_peripheral_input(machine->sam->pia2, 1, machine->sam->ram_size > 0x1000 ? 0b100 : 0, 0b100);
+}
 
 
 void machine_init(struct machine_status *machine) {
@@ -23,15 +57,24 @@ void machine_init(struct machine_status *machine) {
     sam_load_rom(machine->sam, 3, app_settings.rom_disc_basic_path);
     machine->sam->pia1 = pia_create();
     machine->sam->pia2 = pia_create();
+    _machine_set_ram_size(machine);
+    sam_update_map(machine->sam);
 
     machine->keyboard = keyboard_initialize(machine->sam->pia1);
     machine->video = video_initialize(machine->sam, machine->sam->pia2, machine->renderer);
     machine->adc = adc_initialize(machine->sam->pia1, machine->sam->pia2);
 
     machine->disk_drive = disk_drive_create();
-    machine->sam->pia_cartridge = machine->disk_drive;
-    machine->sam->pia_cartridge_read = disk_drive_read_register;
-    machine->sam->pia_cartridge_write = disk_drive_write_register;
+    machine->disk_drive->clock_ns = &machine->p._virtual_time_nano;
+    machine->block_device = block_device_create();
+    machine->cartridge_devices[CARTRIDGE_DISK_CONTROLLER] = (struct cartridge_device){
+        "Disk controller", machine->disk_drive, disk_drive_read_register, disk_drive_write_register
+    };
+    machine->cartridge_devices[CARTRIDGE_BLOCK_DEVICE] = (struct cartridge_device){
+        "Block device", machine->block_device, block_device_read_register, block_device_write_register
+    };
+    rom_pak_init(&machine->cartridge_pak, machine->sam);
+    machine->multipak = multipak_create(machine->sam);
 
     machine->cart_sense = 0;
     machine->_next_disk_drive_call = 0;
@@ -39,43 +82,221 @@ void machine_init(struct machine_status *machine) {
 
     machine->_joy_emulation[0] = 0;
     machine->_joy_emulation[1] = 0;
+    for (int i = 0; i < 4; i++) machine->_joy_axes[i] = 2.5;
     machine->joysticks[0] = 0;
     machine->joysticks[1] = 0;
 
     machine->_next_keyboard_poll_ns = 0;
 
+    machine->thread = NULL;
+    SDL_SetAtomicInt(&machine->command_start, 0);
+    SDL_SetAtomicInt(&machine->command_end, 0);
+    machine->command_push_lock = 0;
+    SDL_SetAtomicInt(&machine->ui_command_start, 0);
+    SDL_SetAtomicInt(&machine->ui_command_end, 0);
+    machine->ui_command_push_lock = 0;
+    machine->snapshot_lock = SDL_CreateMutex();
+    SDL_SetAtomicInt(&machine->activity_request, 0);
+    machine->activity[0] = 0;
+    machine->loader = media_loader_create();
+
     for (int i = 0; i < 4; i++) {
         if (!app_settings.disks[i].path || !app_settings.disks[i].path[0]) continue;
         disk_drive_load_disk(machine->disk_drive, i, app_settings.disks[i].path);
     }
     if(app_settings.cartridge_path && app_settings.cartridge_path[0]) {
-        sam_load_rom(machine->sam, 2, app_settings.cartridge_path);
-        machine->cart_sense = 1;
+        rom_pak_load(&machine->cartridge_pak, app_settings.cartridge_path);
     }
     if(app_settings.cassette_path && app_settings.cassette_path[0]) {
         adc_load_cassette(machine->adc, app_settings.cassette_path);
     }
+    if (app_settings.block_device_path && app_settings.block_device_path[0]) {
+        block_device_open(machine->block_device, app_settings.block_device_path);
+    }
+    _machine_reset_cartridge_port(machine);
+}
+
+struct cartridge_device *_machine_cartridge_device(struct machine_status *machine, long device) {
+    if (device < 0 || device >= CARTRIDGE_DEVICE_COUNT) return NULL;
+    return &machine->cartridge_devices[device];
+}
+
+/*
+    Plugs the devices and the ROMs of the settings in the cartridge port, directly or through the Multi-Pak
+    The cartridge ROM takes the place of the Disk Basic ROM, which goes with the disk controller in a Multi-Pak slot
+*/
+void machine_update_cartridge_port(struct machine_status *machine) {
+    struct sam_status *sam = machine->sam;
+
+    if (!app_settings.multipak) {
+        struct rom_pak *pak = &machine->cartridge_pak;
+        long device = app_settings.cartridge_device;
+        if (device < 0 || device >= CARTRIDGE_DEVICE_COUNT) device = CARTRIDGE_DISK_CONTROLLER;
+        // a banked pak takes the port, its bank register is on SCS
+        sam->cartridge = rom_pak_is_banked(pak) ? &pak->bank_register : _machine_cartridge_device(machine, device);
+        sam->external = NULL;
+        if (rom_pak_bank(pak)) {
+            sam_set_cartridge_rom(sam, rom_pak_bank(pak), ROM_PAK_BANK_SIZE);
+        } else {
+            sam_set_cartridge_rom(sam, sam->rom_load_status[3] ? sam->rom_dsk : NULL, sizeof(sam->rom_dsk));
+        }
+        machine->cart_sense = rom_pak_bank(pak) != NULL;
+        return;
+    }
+
+    struct multipak *multipak = machine->multipak;
+    multipak->switch_slot = app_settings.multipak_switch >= 1 && app_settings.multipak_switch <= MULTIPAK_SLOTS ?
+        (int)app_settings.multipak_switch - 1 : MULTIPAK_SLOTS - 1;
+
+    // the UI can change the paths meanwhile, the ROM files are read without the lock
+    char *rom_paths[MULTIPAK_SLOTS];
+    settings_lock();
+    for (int i = 0; i < MULTIPAK_SLOTS; i++) {
+        const char *rom_path = app_settings.multipak_slots[i].rom_path;
+        rom_paths[i] = rom_path ? strdup(rom_path) : NULL;
+    }
+    settings_unlock();
+
+    for (int i = 0; i < MULTIPAK_SLOTS; i++) {
+        struct multipak_slot *slot = &multipak->slots[i];
+
+        slot->device = _machine_cartridge_device(machine, app_settings.multipak_slots[i].device);
+        rom_pak_load(&slot->pak, rom_paths[i]);
+        free(rom_paths[i]);
+        slot->autostart = rom_pak_bank(&slot->pak) != NULL;
+        // the disk controller comes with its Disk Basic ROM
+        bool disk_rom = slot->device == &machine->cartridge_devices[CARTRIDGE_DISK_CONTROLLER] && sam->rom_load_status[3];
+        slot->device_rom = disk_rom ? sam->rom_dsk : NULL;
+        slot->device_rom_length = sizeof(sam->rom_dsk);
+    }
+    sam->external = &multipak->select_device;
+    multipak_apply(multipak);
+    machine->cart_sense = 1;
+}
+
+// the paks restart on their first bank, the Multi-Pak selects the slot of its front switch
+void _machine_reset_cartridge_port(struct machine_status *machine) {
+    machine_update_cartridge_port(machine);
+    rom_pak_reset(&machine->cartridge_pak);
+    multipak_reset(machine->multipak);
+    if (app_settings.multipak) multipak_apply(machine->multipak);
 }
 
 void machine_reset(struct machine_status *machine) {
     bus_reset_pia(machine->sam->pia1);
     bus_reset_pia(machine->sam->pia2);
+    _machine_set_ram_size(machine);
     sam_reset(machine->sam);
     keyboard_reset(machine->keyboard);
     video_reset(machine->video);
     adc_reset(machine->adc);
+    block_device_reset(machine->block_device);
+    _machine_reset_cartridge_port(machine);
     processor_reset(&machine->p);
 }
 
+/*
+    Called when the processor is about to execute BLKIN
+    The whole block is decoded from the cassette and copied to the block buffer, then it returns to the caller
+    If the block can't be decoded (not a standard block) the ROM routine is executed normally with the cassette playback
+*/
+void _machine_cassette_fast_load(struct machine_status *machine) {
+    struct processor_state *p = &machine->p;
+    struct sam_status *sam = machine->sam;
+    uint8_t block_type, block_length;
+    uint8_t block_data[0x100];
+
+    if (p->_halt || p->_instruction_fault || sam->TY || !sam->rom_load_status[1] || !machine->adc->cassette_motor) return;
+
+    if (cassette_read_block(machine->adc->cassette, &block_type, &block_length, block_data)) return;
+
+    uint16_t buffer = ((uint16_t)sam_read(sam, CASSETTE_CBUFAD_ADDR) << 8) | sam_read(sam, CASSETTE_CBUFAD_ADDR + 1);
+    for (int i = 0; i < block_length; i++) {
+        sam_write(sam, buffer + i, block_data[i]);
+    }
+    sam_write(sam, CASSETTE_BLKTYP_ADDR, block_type);
+    sam_write(sam, CASSETTE_BLKLEN_ADDR, block_length);
+    sam_write(sam, CASSETTE_CSRERR_ADDR, 0);
+
+    // exit state of BLKIN: A=CSRERR, X points after the data
+    p->A = 0;
+    p->N = 0;
+    p->Z = 1;
+    p->V = 0;
+    p->X = buffer + block_length;
+
+    // rts
+    p->PC = ((uint16_t)sam_read(sam, p->S) << 8) | sam_read(sam, p->S + 1);
+    p->S += 2;
+}
+
+int _machine_code_matches(struct sam_status *sam, uint16_t address, const uint8_t *code, int length) {
+    for (int i = 0; i < length; i++) {
+        if (sam_read(sam, address + i) != code[i]) return 0;
+    }
+    return 1;
+}
+
+/*
+    Called when the disk controller drives the HALT line
+    If the processor is at the start of the Disk Basic transfer loop, the rest of the sector is moved at once,
+    the time of the skipped loop iterations is added in bulk and the processor waits in the loop for the end of the command
+*/
+void _machine_disk_fast_transfer(struct machine_status *machine) {
+    struct processor_state *p = &machine->p;
+    struct sam_status *sam = machine->sam;
+    uint8_t buffer[0x400];
+    int count = 0;
+
+    if (p->_instruction_fault || !machine->disk_drive->status_2_3.DATA_REQUEST) return;
+
+    if (_machine_code_matches(sam, p->PC, disk_read_loop, sizeof(disk_read_loop))) {
+        count = disk_drive_fast_read(machine->disk_drive, buffer, sizeof(buffer));
+        for (int i = 0; i < count; i++) {
+            sam_write(sam, p->X + i, buffer[i]);
+        }
+    } else if (_machine_code_matches(sam, p->PC, disk_write_loop, sizeof(disk_write_loop))) {
+        count = disk_drive_fast_write_length(machine->disk_drive);
+        if (count > (int)sizeof(buffer)) return;
+        for (int i = 0; i < count; i++) {
+            buffer[i] = sam_read(sam, p->X + i);
+        }
+        disk_drive_fast_write(machine->disk_drive, buffer, count);
+    }
+    if (!count) return;
+
+    // state after the last iteration: A holds the last byte, X points after the data
+    p->X += count;
+    p->A = buffer[count - 1];
+    p->N = p->A >> 7;
+    p->Z = p->A == 0;
+    p->V = 0;
+    p->_virtual_time_nano += (uint64_t)count * DISK_LOOP_CYCLES * cycle_nano;
+
+    // waits in the loop for the controller
+    p->_halt = 1;
+}
+
 /*
     Runs as much processor instructions that are equivalent to one vertical sync frame
     Also runs the devices according to the processor virtual time
     This includes the video rendering
 */
-int machine_process_frame(struct machine_status *machine) {
+void machine_process_frame(struct machine_status *machine) {
+    _machine_run_commands(machine);
+    media_loader_apply(machine->loader, machine);
+
     uint64_t next_video_call_after_ns = video_start_field(machine->video);
     uint64_t next_video_call = next_video_call_after_ns + machine->p._virtual_time_nano;
     while (next_video_call_after_ns > 0) {
+        if (machine->p.PC == CASSETTE_BLKIN_ADDR && app_settings.cassette_fast_load) {
+            _machine_cassette_fast_load(machine);
+        }
+
+        if (machine->disk_drive->HALT && app_settings.disk_fast_transfer) {
+            _machine_disk_fast_transfer(machine);
+        }
+
         processor_next_opcode(&machine->p);
 
         if (machine->p._virtual_time_nano >= machine->_next_keyboard_poll_ns && !keyboard_buffer_empty() ) {
@@ -97,7 +318,7 @@ int machine_process_frame(struct machine_status *machine) {
             mc6821_interrupt_1_input(machine->sam->pia1, 0, machine->video->h_sync);
             mc6821_interrupt_1_input(machine->sam->pia1, 1, machine->video->signal_fs);
 
-            if (machine->cart_sense) {
+            if (machine->cart_sense && (!app_settings.multipak || multipak_cart_sense(machine->multipak))) {
                 mc6821_interrupt_1_input(machine->sam->pia2, 1, 1);
                 mc6821_interrupt_1_input(machine->sam->pia2, 1, 0);
             }
@@ -122,33 +343,233 @@ int machine_process_frame(struct machine_status *machine) {
     if (!next_video_call_after_ns) {
         video_end_field(machine->video);
     }
-    return (int)next_video_call_after_ns;
+    media_loader_flush_disks(machine->loader, machine->disk_drive);
+    _machine_update_snapshot(machine);
+}
+
+// the audio device consumption paces the emulation instead of the host clock (when there is an audio device)
+bool machine_audio_paced(struct machine_status *machine) {
+    return app_settings.pacing_mode == Pacing_Mode_Audio && machine->adc->stream;
+}
+
+// the emulation is behind: the host clock passed the virtual time or the audio device needs more samples
+bool machine_frame_due(struct machine_status *machine) {
+    if (machine_audio_paced(machine)) {
+        return adc_sound_buffer_fill(machine->adc) < machine->adc->sound_target_samples;
+    }
+    return machine->p._virtual_time_nano <= nanos();
+}
+
+void machine_resync_time(struct machine_status *machine) {
+    uint64_t time_ns = nanos();
+    if (time_ns > machine->p._virtual_time_nano && time_ns - machine->p._virtual_time_nano > SEC_TO_NS(1)) {
+        // we are out of sync, so re-sync the processor time
+        log_message(LOG_INFO, "re-sync the processor time %ld", time_ns - machine->p._virtual_time_nano);
+        machine->p._virtual_time_nano = time_ns + 1;
+    }
+}
+
+static int SDLCALL _machine_thread(void *data) {
+    struct machine_status *machine = (struct machine_status *)data;
+
+    while (SDL_GetAtomicInt(&machine->thread_running)) {
+        if (!machine_frame_due(machine)) {
+            SDL_DelayNS(1000000);
+            continue;
+        }
+
+        machine_process_frame(machine);
+        machine_resync_time(machine);
+    }
+    return 0;
+}
+
+/*
+    Runs the emulation on its own thread, the main thread keeps the rendering, the UI and the events
+    The fields are exchanged through the video triple buffer, the keys through the lock free keyboard buffer,
+    anything else changing the machine is posted as a command and the UI reads the snapshot
+*/
+int machine_start_thread(struct machine_status *machine) {
+    SDL_SetAtomicInt(&machine->thread_running, 1);
+    machine->thread = SDL_CreateThread(_machine_thread, "emulation", machine);
+    if (!machine->thread) {
+        log_message(LOG_ERROR, "Can't create the emulation thread: %s", SDL_GetError());
+        SDL_SetAtomicInt(&machine->thread_running, 0);
+        return 1;
+    }
+    return 0;
+}
+
+void machine_stop_thread(struct machine_status *machine) {
+    if (machine->thread) {
+        SDL_SetAtomicInt(&machine->thread_running, 0);
+        SDL_WaitThread(machine->thread, NULL);
+        machine->thread = NULL;
+    }
+    // the commands posted after the last field
+    _machine_run_commands(machine);
+}
+
+/*
+    Queues a command for the emulation, it runs before the next field
+    The UI and the file dialog callbacks can post, so the producers take a short spin lock
+    Returns 1 when the queue is full
+*/
+int machine_post(struct machine_status *machine, machine_command_fn fn, int arg, float value, const char *text) {
+    SDL_LockSpinlock(&machine->command_push_lock);
+    int end = SDL_GetAtomicInt(&machine->command_end);
+    int next = (end + 1) % MACHINE_COMMAND_QUEUE_LENGTH;
+    if (next == SDL_GetAtomicInt(&machine->command_start)) {
+        SDL_UnlockSpinlock(&machine->command_push_lock);
+        log_message(LOG_ERROR, "Too many commands waiting for the emulation");
+        return 1;
+    }
+    machine->commands[end] = (struct machine_command){fn, arg, value, text ? strdup(text) : NULL};
+    SDL_MemoryBarrierRelease();
+    SDL_SetAtomicInt(&machine->command_end, next);
+    SDL_UnlockSpinlock(&machine->command_push_lock);
+    return 0;
+}
+
+void _machine_run_commands(struct machine_status *machine) {
+    int pos = SDL_GetAtomicInt(&machine->command_start);
+    int end = SDL_GetAtomicInt(&machine->command_end);
+    SDL_MemoryBarrierAcquire();
+    while (pos != end) {
+        struct machine_command command = machine->commands[pos];
+        pos = (pos + 1) % MACHINE_COMMAND_QUEUE_LENGTH;
+        SDL_SetAtomicInt(&machine->command_start, pos);
+
+        command.fn(machine, command.arg, command.value, command.text);
+        free(command.text);
+    }
+}
+
+/*
+    Queues a result for the main thread, it runs before the next UI pass
+    The emulation, the media loader and the file dialog callbacks can post. The data is freed after the call,
+    or here when the queue is full
+*/
+int machine_post_ui(struct machine_status *machine, machine_ui_fn fn, int arg, const char *text, void *data) {
+    SDL_LockSpinlock(&machine->ui_command_push_lock);
+    int end = SDL_GetAtomicInt(&machine->ui_command_end);
+    int next = (end + 1) % MACHINE_COMMAND_QUEUE_LENGTH;
+    if (next == SDL_GetAtomicInt(&machine->ui_command_start)) {
+        SDL_UnlockSpinlock(&machine->ui_command_push_lock);
+        log_message(LOG_INFO, "Too many results waiting for the UI");
+        free(data);
+        return 1;
+    }
+    machine->ui_commands[end] = (struct machine_ui_command){fn, arg, text ? strdup(text) : NULL, data};
+    SDL_MemoryBarrierRelease();
+    SDL_SetAtomicInt(&machine->ui_command_end, next);
+    SDL_UnlockSpinlock(&machine->ui_command_push_lock);
+    return 0;
+}
+
+// called by the main thread only
+void machine_run_ui_commands(struct machine_status *machine) {
+    int pos = SDL_GetAtomicInt(&machine->ui_command_start);
+    int end = SDL_GetAtomicInt(&machine->ui_command_end);
+    SDL_MemoryBarrierAcquire();
+    while (pos != end) {
+        struct machine_ui_command command = machine->ui_commands[pos];
+        pos = (pos + 1) % MACHINE_COMMAND_QUEUE_LENGTH;
+        SDL_SetAtomicInt(&machine->ui_command_start, pos);
+
+        command.fn(machine, command.arg, command.text, command.data);
+        free(command.text);
+        free(command.data);
+    }
+}
+
+void _machine_update_snapshot(struct machine_status *machine) {
+    struct adc_status *adc = machine->adc;
+    struct cassette_recorder *recorder = adc->cassette->recorder;
+    struct machine_snapshot snapshot = {
+        .instruction_fault = machine->p._instruction_fault,
+        .disk_busy = machine->disk_drive->status_1.BUSY,
+        .disk_motor_on = machine->disk_drive->MOTOR_ON,
+        .disk_loaded = machine->disk_drive->images[0].data != NULL,
+        .cassette_motor = adc->cassette_motor,
+        .cassette_location = adc->cassette->audio_location,
+        .cassette_length = adc->cassette->audio_len,
+        .recording = recorder != NULL,
+        .recording_error = recorder && SDL_GetAtomicInt(&recorder->write_error),
+        .recorded_length = recorder ? (uint32_t)SDL_GetAtomicInt(&recorder->data_length) : 0,
+        .sound_enabled = adc->sound_enabled,
+        .adc_level = adc->adc_level,
+        .switch_selection = adc->switch_selection,
+        .sound_latency_ms = adc_sound_latency_ms(adc),
+        .sound_rate_adjust = adc->sound_rate_adjust,
+    };
+    bool activity = SDL_SetAtomicInt(&machine->activity_request, 0);
+
+    SDL_LockMutex(machine->snapshot_lock);
+    machine->snapshot = snapshot;
+    if (activity) disk_drive_format_activity(machine->disk_drive, machine->activity, sizeof(machine->activity));
+    SDL_UnlockMutex(machine->snapshot_lock);
+}
+
+void machine_get_snapshot(struct machine_status *machine, struct machine_snapshot *snapshot) {
+    SDL_LockMutex(machine->snapshot_lock);
+    *snapshot = machine->snapshot;
+    SDL_UnlockMutex(machine->snapshot_lock);
+}
+
+// the disk activity as of the last field it was requested, the next field formats it again
+void machine_get_disk_activity(struct machine_status *machine, char *text, int length) {
+    SDL_SetAtomicInt(&machine->activity_request, 1);
+    SDL_LockMutex(machine->snapshot_lock);
+    SDL_strlcpy(text, machine->activity, length);
+    SDL_UnlockMutex(machine->snapshot_lock);
+}
+
+// arg: 1 for a reset without the cartridge autostart (F10)
+void machine_command_reset(struct machine_status *machine, int arg, float value, const char *text) {
+    machine_reset(machine);
+    if (arg) machine->cart_sense = 0;
+    disk_drive_reset(machine->disk_drive);
+}
+
+// from the UI, the reset centers the joysticks
+void machine_post_reset(struct machine_status *machine, bool autostart) {
+    for (int i = 0; i < 4; i++) machine->_joy_axes[i] = 2.5;
+    machine_post(machine, machine_command_reset, !autostart, 0, NULL);
 }
 
 #define KEY_BOARD_BUFFER_LENGTH 2000
-SDL_Event keyboard_buffer[KEY_BOARD_BUFFER_LENGTH];  // ring buffer
-int keyboard_buffer_start = 0;
-int keyboard_buffer_end = 0;
+/*
+    Lock free single producer (input handling) / single consumer (emulation) ring buffer
+    When it's full the new keys are dropped
+*/
+SDL_Event keyboard_buffer[KEY_BOARD_BUFFER_LENGTH];
+SDL_AtomicInt keyboard_buffer_start;
+SDL_AtomicInt keyboard_buffer_end;
+SDL_AtomicInt keyboard_buffer_flush;  // end + 1 of the keys to drop, 0 for none
 
+// drops the keys waiting, called by the producer: the consumer skips them on its next check
 void keyboard_buffer_reset() {
-    keyboard_buffer_start = 0;
-    keyboard_buffer_end = 0;
+    SDL_SetAtomicInt(&keyboard_buffer_flush, SDL_GetAtomicInt(&keyboard_buffer_end) + 1);
 }
 
 int keyboard_buffer_empty() {
-    return keyboard_buffer_start == keyboard_buffer_end;
+    int flush = SDL_SetAtomicInt(&keyboard_buffer_flush, 0);
+    if (flush) SDL_SetAtomicInt(&keyboard_buffer_start, flush - 1);
+    return SDL_GetAtomicInt(&keyboard_buffer_start) == SDL_GetAtomicInt(&keyboard_buffer_end);
 }
 
 void keyboard_buffer_push(SDL_Event *event) {
-    keyboard_buffer[keyboard_buffer_end] = *event;  // save a copy in the buffer
-    keyboard_buffer_end++;
+    int end = SDL_GetAtomicInt(&keyboard_buffer_end);
+    int next = end + 1;
+    if (next == KEY_BOARD_BUFFER_LENGTH) next = 0;
 
-    // extend the buffer
-    if (keyboard_buffer_end == KEY_BOARD_BUFFER_LENGTH) keyboard_buffer_end = 0;
+    // the buffer is already full
+    if (next == SDL_GetAtomicInt(&keyboard_buffer_start)) return;
 
-    // the buffer is already full, so drop from the start
-    if (keyboard_buffer_end == keyboard_buffer_start) keyboard_buffer_start++;
-    if (keyboard_buffer_start == KEY_BOARD_BUFFER_LENGTH) keyboard_buffer_start = 0;
+    keyboard_buffer[end] = *event;  // save a copy in the buffer
+    SDL_MemoryBarrierRelease();
+    SDL_SetAtomicInt(&keyboard_buffer_end, next);
 }
 
 void machine_send_key(uint32_t key_code) {
@@ -162,10 +583,11 @@ void machine_send_key(uint32_t key_code) {
 }
 
 SDL_Event keyboard_buffer_pull() {
-    int pos = keyboard_buffer_start;
-    keyboard_buffer_start++;
-    if (keyboard_buffer_start == KEY_BOARD_BUFFER_LENGTH) keyboard_buffer_start = 0;
-    return keyboard_buffer[pos];
+    int pos = SDL_GetAtomicInt(&keyboard_buffer_start);
+    SDL_MemoryBarrierAcquire();
+    SDL_Event event = keyboard_buffer[pos];
+    SDL_SetAtomicInt(&keyboard_buffer_start, pos + 1 == KEY_BOARD_BUFFER_LENGTH ? 0 : pos + 1);
+    return event;
 }
 
 void clipboard_copy() {
@@ -196,6 +618,31 @@ void machine_handle_input_begin(struct machine_status *machine) {
     // nothing for now
 }
 
+void _machine_axis_command(struct machine_status *machine, int axis, float value, const char *text) {
+    float *inputs[4] = {&machine->adc->input_joy_0, &machine->adc->input_joy_1, &machine->adc->input_joy_2, &machine->adc->input_joy_3};
+    *inputs[axis] = value;
+}
+
+// value: 1 when the button is pressed
+void _machine_button_command(struct machine_status *machine, int joy_number, float value, const char *text) {
+    uint8_t mask = joy_number ? 0b10 : 0b1;
+    if (value) machine->keyboard->other_inputs &= ~mask;
+    else machine->keyboard->other_inputs |= mask;
+    mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, mask);
+}
+
+// axis: 0/1 for the left joystick x/y, 2/3 for the right one, from 0 to 5V
+void _machine_set_axis(struct machine_status *machine, int axis, float value) {
+    if (value < 0) value = 0;
+    if (value > 5) value = 5;
+    machine->_joy_axes[axis] = value;
+    machine_post(machine, _machine_axis_command, axis, value, NULL);
+}
+
+void _machine_set_button(struct machine_status *machine, int joy_number, bool pressed) {
+    machine_post(machine, _machine_button_command, joy_number, pressed, NULL);
+}
+
 int machine_handle_joystick_event(struct machine_status *machine, SDL_Event *event) {
     int event_was_handled = 0;
     switch (event->type)
@@ -227,15 +674,8 @@ int machine_handle_joystick_event(struct machine_status *machine, SDL_Event *eve
                     (app_settings.joy_emulation_mode[joy_number] == Joy_Emulation_Joy1 && machine->joysticks[0] && machine->joystick_ids[0] == event->jaxis.which) ||
                     (app_settings.joy_emulation_mode[joy_number] == Joy_Emulation_Joy2 && machine->joysticks[1] && machine->joystick_ids[1] == event->jaxis.which)
                 ) {
-                    switch(joy_number) {
-                        case 0: // left
-                            if (event->jaxis.axis == 0) machine->adc->input_joy_0 = event->jaxis.value * 2.5 / 32767 + 2.5;
-                            if (event->jaxis.axis == 1) machine->adc->input_joy_1 = event->jaxis.value * 2.5 / 32767 + 2.5;
-                            break;
-                        case 1: // right
-                            if (event->jaxis.axis == 0) machine->adc->input_joy_2 = event->jaxis.value * 2.5 / 32767 + 2.5;
-                            if (event->jaxis.axis == 1) machine->adc->input_joy_3 = event->jaxis.value * 2.5 / 32767 + 2.5;
-                            break;
+                    if (event->jaxis.axis < 2) {
+                        _machine_set_axis(machine, joy_number * 2 + event->jaxis.axis, event->jaxis.value * 2.5 / 32767 + 2.5);
                     }
                     event_was_handled = 1;
                 }
@@ -250,19 +690,7 @@ int machine_handle_joystick_event(struct machine_status *machine, SDL_Event *eve
                     (app_settings.joy_emulation_mode[joy_number] == Joy_Emulation_Joy2 && machine->joysticks[1] && machine->joystick_ids[1] == event->jbutton.which)
                 ) {
                     event_was_handled = 1;
-
-                    switch(joy_number) {
-                        case 0: // left
-                            if (event->type == SDL_EVENT_JOYSTICK_BUTTON_DOWN) machine->keyboard->other_inputs &= 0b11111110;
-                            else machine->keyboard->other_inputs |= 0b1;
-                            mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, 0b1);
-                            break;
-                        case 1: // right
-                            if (event->type == SDL_EVENT_JOYSTICK_BUTTON_DOWN) machine->keyboard->other_inputs &= 0b11111101;
-                            else machine->keyboard->other_inputs |= 0b10;
-                            mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, 0b10);
-                            break;
-                    }
+                    _machine_set_button(machine, joy_number, event->type == SDL_EVENT_JOYSTICK_BUTTON_DOWN);
                 }
             }
             break;
@@ -274,24 +702,9 @@ int machine_handle_joystick_event(struct machine_status *machine, SDL_Event *eve
                 float scale_x = 5.0 / machine->video->_output_port.w;
                 float scale_y = 5.0 / machine->video->_output_port.h;
 
-                switch(joy_number) {
-                    case 0: // left
-                        machine->adc->input_joy_0 += event->motion.xrel * scale_x;
-                        machine->adc->input_joy_1 += event->motion.yrel * scale_y;
-                        if (machine->adc->input_joy_0 < 0) machine->adc->input_joy_0 = 0;
-                        if (machine->adc->input_joy_0 > 5) machine->adc->input_joy_0 = 5;
-                        if (machine->adc->input_joy_1 < 0) machine->adc->input_joy_1 = 0;
-                        if (machine->adc->input_joy_1 > 5) machine->adc->input_joy_1 = 5;
-                        break;
-                    case 1: // right
-                        machine->adc->input_joy_2 += event->motion.xrel * scale_x;
-                        machine->adc->input_joy_3 += event->motion.yrel * scale_y;
-                        if (machine->adc->input_joy_2 < 0) machine->adc->input_joy_2 = 0;
-                        if (machine->adc->input_joy_2 > 5) machine->adc->input_joy_2 = 5;
-                        if (machine->adc->input_joy_3 < 0) machine->adc->input_joy_3 = 0;
-                        if (machine->adc->input_joy_3 > 5) machine->adc->input_joy_3 = 5;
-                        break;
-                }
+                int axis = joy_number * 2;
+                if (event->motion.xrel) _machine_set_axis(machine, axis, machine->_joy_axes[axis] + event->motion.xrel * scale_x);
+                if (event->motion.yrel) _machine_set_axis(machine, axis + 1, machine->_joy_axes[axis + 1] + event->motion.yrel * scale_y);
             }
             break;
 
@@ -308,18 +721,7 @@ int machine_handle_joystick_event(struct machine_status *machine, SDL_Event *eve
                     continue;
                 }
 
-                switch(joy_number) {
-                    case 0: // left
-                        if (event->type == SDL_EVENT_MOUSE_BUTTON_DOWN) machine->keyboard->other_inputs &= 0b11111110;
-                        else machine->keyboard->other_inputs |= 0b1;
-                        mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, 0b1);
-                        break;
-                    case 1: // right
-                        if (event->type == SDL_EVENT_MOUSE_BUTTON_DOWN) machine->keyboard->other_inputs &= 0b11111101;
-                        else machine->keyboard->other_inputs |= 0b10;
-                        mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, 0b10);
-                        break;
-                }
+                _machine_set_button(machine, joy_number, event->type == SDL_EVENT_MOUSE_BUTTON_DOWN);
             }
             break;
 
@@ -332,34 +734,16 @@ int machine_handle_joystick_event(struct machine_status *machine, SDL_Event *eve
                     event->key.key == SDLK_SPACE || event->key.key == SDLK_RETURN)) continue;
                 event_was_handled = 1;
 
-                switch(joy_number) {
-                    case 0: // left
-                        switch(event->key.key) {
-                            case SDLK_LEFT: machine->adc->input_joy_0 = event->type == SDL_EVENT_KEY_DOWN ? 1 : 2.5; break;
-                            case SDLK_RIGHT: machine->adc->input_joy_0 = event->type == SDL_EVENT_KEY_DOWN ? 4 : 2.5; break;
-                            case SDLK_UP: machine->adc->input_joy_1 = event->type == SDL_EVENT_KEY_DOWN ? 1 : 2.5; break;
-                            case SDLK_DOWN: machine->adc->input_joy_1 = event->type == SDL_EVENT_KEY_DOWN ? 4 : 2.5; break;
-                            case SDLK_RETURN:
-                            case SDLK_SPACE:
-                                if (event->type == SDL_EVENT_KEY_DOWN) machine->keyboard->other_inputs &= 0b11111110;
-                                else machine->keyboard->other_inputs |= 0b1;
-                                mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, 0b1);
-                                break;
-                        }
-                        break;
-                    case 1: // right
-                        switch(event->key.key) {
-                            case SDLK_LEFT: machine->adc->input_joy_2 = event->type == SDL_EVENT_KEY_DOWN ? 1 : 2.5; break;
-                            case SDLK_RIGHT: machine->adc->input_joy_2 = event->type == SDL_EVENT_KEY_DOWN ? 4 : 2.5; break;
-                            case SDLK_UP: machine->adc->input_joy_3 = event->type == SDL_EVENT_KEY_DOWN ? 1 : 2.5; break;
-                            case SDLK_DOWN: machine->adc->input_joy_3 = event->type == SDL_EVENT_KEY_DOWN ? 4 : 2.5; break;
-                            case SDLK_RETURN:
-                            case SDLK_SPACE:
-                                if (event->type == SDL_EVENT_KEY_DOWN) machine->keyboard->other_inputs &= 0b11111101;
-                                else machine->keyboard->other_inputs |= 0b10;
-                                mc6821_peripheral_input(machine->sam->pia1, 0, machine->keyboard->other_inputs, 0b10);
-                                break;
-                        }
+                int axis = joy_number * 2;
+                bool down = event->type == SDL_EVENT_KEY_DOWN;
+                switch(event->key.key) {
+                    case SDLK_LEFT: _machine_set_axis(machine, axis, down ? 1 : 2.5); break;
+                    case SDLK_RIGHT: _machine_set_axis(machine, axis, down ? 4 : 2.5); break;
+                    case SDLK_UP: _machine_set_axis(machine, axis + 1, down ? 1 : 2.5); break;
+                    case SDLK_DOWN: _machine_set_axis(machine, axis + 1, down ? 4 : 2.5); break;
+                    case SDLK_RETURN:
+                    case SDLK_SPACE:
+                        _machine_set_button(machine, joy_number, down);
                         break;
                 }
             }
@@ -29,6 +29,8 @@ void segv_handler(int sig) {
 }
 #endif
 
+#define AUDIO_PACING_MAX_FRAMES 4  // fields emulated at most between two presents
+
 int main(int argc, char* argv[]) {
 #ifndef _WIN32
     signal(SIGSEGV, segv_handler);
@@ -75,29 +77,46 @@ int main(int argc, char* argv[]) {
 
     machine_init(machine);
 
+    if (app_settings.pacing_mode == Pacing_Mode_Audio) {
+        adc_open_audio(machine->adc);
+    }
+
     bool running = true;
     processor_reset(&machine->p);
     disk_drive_reset(machine->disk_drive);
 
+    if (app_settings.emulation_thread) {
+        machine_start_thread(machine);
+    }
+
     while (running) {
-        if (machine->p._instruction_fault)
+        struct machine_snapshot snapshot;
+        machine_get_snapshot(machine, &snapshot);
+        if (snapshot.instruction_fault)
             SDL_SetRenderDrawColor(machine->renderer, 100, 0, 0, 255);
         else
             SDL_SetRenderDrawColor(machine->renderer, 0, 0, 0, 255);
         SDL_RenderClear(machine->renderer);
 
-        if(machine_process_frame(machine)) {
+        // the emulation thread fills the video frames by itself
+        if (!machine->thread && machine_audio_paced(machine)) {
+            // emulate as many fields as the audio device consumed, and show the latest one
+            for (int frames = 0; frames < AUDIO_PACING_MAX_FRAMES && machine_frame_due(machine); frames++) {
+                machine_process_frame(machine);
+            }
+        } else if (!machine->thread) {
+            machine_process_frame(machine);
+        }
+        if (!video_render(machine->video)) {
             video_reinitialize(machine->video, machine->renderer);
             controls_reinit();
         }
 
+        machine_run_ui_commands(machine);
         controls_display();
 
-        uint64_t time_ns = nanos();
-        if (time_ns > machine->p._virtual_time_nano && time_ns - machine->p._virtual_time_nano > SEC_TO_NS(1)) {
-            // we are out of sync, so re-sync the processor time
-            log_message(LOG_INFO, "re-sync the processor time %ld", time_ns - machine->p._virtual_time_nano);
-            machine->p._virtual_time_nano = time_ns + 1;
+        if (!machine->thread) {
+            machine_resync_time(machine);
         }
 
         machine_handle_input_begin(machine);
@@ -126,17 +145,27 @@ int main(int argc, char* argv[]) {
                 }
 
                 if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_F10) {
-                    machine_reset(machine);
-                    machine->cart_sense = 0;
-                    disk_drive_reset(machine->disk_drive);
+                    machine_post_reset(machine, false);
                 }
-                time_ns = nanos();
             };
-        } while (machine->p._virtual_time_nano > time_ns && SDL_WaitEventTimeout(NULL, 5));
+        } while (machine->thread ?
+                    !video_frame_ready(machine->video) && SDL_WaitEventTimeout(NULL, 5) :
+                    !machine_frame_due(machine) && SDL_WaitEventTimeout(NULL, machine_audio_paced(machine) ? 1 : 5));
 
         controls_input_end();
     }
 
+    machine_stop_thread(machine);
+    media_loader_stop(machine->loader);
+    machine_run_ui_commands(machine);
+
+    // Write back the modified disk sectors
+    disk_drive_flush(machine->disk_drive, 1);
+    block_device_close(machine->block_device);
+
+    // Finish the cassette recording file
+    cassette_record_stop(machine->adc->cassette);
+
     // Clean up resources before exiting
     SDL_DestroyRenderer(machine->renderer);
     SDL_DestroyWindow(machine->window);
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "media_loader.h"
+#include "machine.h"
+#include "controls.h"
+#include "settings.h"
+#include "utils.h"
+
+
+void _media_job_free(struct media_job *job) {
+    if (job->path) free(job->path);
+    job->path = NULL;
+}
+
+void _media_job_close(struct media_job *job) {
+    if (job->type == MEDIA_CASSETTE) cassette_unload(&job->cassette);
+    else disk_image_close(&job->disk);
+}
+
+static int SDLCALL _media_loader_thread(void *data) {
+    struct media_loader *loader = data;
+    struct media_job *job = &loader->job;
+
+    SDL_LockMutex(loader->lock);
+    for (;;) {
+        int state = SDL_GetAtomicInt(&loader->state);
+        if (state == MEDIA_LOADER_SWAPPED) {
+            // the job now has the previous media, closing it can flush a disk
+            SDL_UnlockMutex(loader->lock);
+            _media_job_close(job);
+            SDL_LockMutex(loader->lock);
+            _media_job_free(job);
+            SDL_SetAtomicInt(&loader->state, MEDIA_LOADER_IDLE);
+            continue;
+        }
+        if (!SDL_GetAtomicInt(&loader->running)) {
+            // stopped while loading, the media was never swapped in
+            if (state == MEDIA_LOADER_READY) _media_job_close(job);
+            _media_job_free(job);
+            break;
+        }
+        if (state != MEDIA_LOADER_IDLE || !loader->queue_count) {
+            SDL_WaitCondition(loader->wake, loader->lock);
+            continue;
+        }
+
+        struct media_job *request = &loader->queue[loader->queue_start];
+        loader->queue_start = (loader->queue_start + 1) % MEDIA_LOADER_QUEUE_SIZE;
+        loader->queue_count--;
+        job->type = request->type;
+        job->drive_no = request->drive_no;
+        job->path = request->path;
+        job->flush_id = request->flush_id;
+        if (job->type == MEDIA_FLUSH) job->disk = request->disk;
+        SDL_SetAtomicInt(&job->cassette.load_progress, 0);
+        SDL_SetAtomicInt(&loader->state, MEDIA_LOADER_LOADING);
+        SDL_UnlockMutex(loader->lock);
+
+        if (job->type == MEDIA_DISK) {
+            job->result = job->path ? disk_image_open(&job->disk, job->path, disk_drive_write_mode(job->drive_no)) : 0;
+        } else if (job->type == MEDIA_FLUSH) {
+            job->result = disk_image_flush_copy(&job->disk);
+        } else {
+            job->result = cassette_load(&job->cassette, job->path);
+        }
+
+        SDL_LockMutex(loader->lock);
+        SDL_SetAtomicInt(&loader->state, MEDIA_LOADER_READY);
+    }
+    SDL_UnlockMutex(loader->lock);
+    return 0;
+}
+
+struct media_loader *media_loader_create(void) {
+    struct media_loader *loader = calloc(1, sizeof(struct media_loader));
+    loader->lock = SDL_CreateMutex();
+    loader->wake = SDL_CreateCondition();
+    SDL_SetAtomicInt(&loader->state, MEDIA_LOADER_IDLE);
+    SDL_SetAtomicInt(&loader->running, 1);
+
+    loader->thread = SDL_CreateThread(_media_loader_thread, "media loader", loader);
+    if (!loader->thread) {
+        log_message(LOG_ERROR, "Can't create the media loader thread: %s", SDL_GetError());
+        SDL_SetAtomicInt(&loader->running, 0);
+    }
+    return loader;
+}
+
+// the queued requests are dropped, a media loaded but not swapped in yet is closed
+void media_loader_stop(struct media_loader *loader) {
+    if (!loader->thread) return;
+
+    SDL_LockMutex(loader->lock);
+    SDL_SetAtomicInt(&loader->running, 0);
+    while (loader->queue_count) {
+        struct media_job *request = &loader->queue[loader->queue_start];
+        if (request->type == MEDIA_FLUSH) _media_job_close(request);
+        _media_job_free(request);
+        loader->queue_start = (loader->queue_start + 1) % MEDIA_LOADER_QUEUE_SIZE;
+        loader->queue_count--;
+    }
+    SDL_SignalCondition(loader->wake);
+    SDL_UnlockMutex(loader->lock);
+
+    SDL_WaitThread(loader->thread, NULL);
+    loader->thread = NULL;
+}
+
+struct media_job *_media_loader_push(struct media_loader *loader, int type, int drive_no, const char *path) {
+    struct media_job *request = &loader->queue[(loader->queue_start + loader->queue_count) % MEDIA_LOADER_QUEUE_SIZE];
+    request->type = type;
+    request->drive_no = drive_no;
+    request->path = path ? strdup(path) : NULL;
+    request->flush_id = 0;
+    loader->queue_count++;
+    return request;
+}
+
+/*
+    Queues the loading of a disk (drive_no) or of the cassette, a NULL path unloads it
+    The previous disk is ejected first, so its modified sectors are flushed before the file is opened again
+    Returns 1 when the queue is full
+*/
+int media_loader_request(struct media_loader *loader, int type, int drive_no, const char *path) {
+    if (!loader->thread) {
+        log_message(LOG_ERROR, "The media loader isn't running");
+        return 1;
+    }
+
+    int eject = type == MEDIA_DISK && path;
+    SDL_LockMutex(loader->lock);
+    if (loader->queue_count + eject >= MEDIA_LOADER_QUEUE_SIZE) {
+        SDL_UnlockMutex(loader->lock);
+        log_message(LOG_ERROR, "Too many media waiting to be loaded");
+        return 1;
+    }
+    if (eject) _media_loader_push(loader, type, drive_no, NULL);
+    _media_loader_push(loader, type, drive_no, path);
+    SDL_SignalCondition(loader->wake);
+    SDL_UnlockMutex(loader->lock);
+    return 0;
+}
+
+// queues the flush of a copy of the modified sectors, the worker owns the copy when it succeeds
+int _media_loader_request_flush(struct media_loader *loader, int drive_no, int flush_id, struct disk_image *copy) {
+    SDL_LockMutex(loader->lock);
+    if (loader->queue_count >= MEDIA_LOADER_QUEUE_SIZE) {
+        SDL_UnlockMutex(loader->lock);
+        log_message(LOG_ERROR, "Too many media waiting to be loaded");
+        return 1;
+    }
+    struct media_job *request = _media_loader_push(loader, MEDIA_FLUSH, drive_no, copy->path);
+    request->flush_id = flush_id;
+    request->disk = *copy;
+    SDL_SignalCondition(loader->wake);
+    SDL_UnlockMutex(loader->lock);
+    return 0;
+}
+
+/*
+    Called by the emulation between two fields: the write back disks idle for DISK_FLUSH_DELAY_NS are copied
+    and the worker writes the files, media_loader_apply then swaps the flushed images in
+*/
+void media_loader_flush_disks(struct media_loader *loader, struct disk_drive_status *drive) {
+    if (drive->status_1.BUSY) return;
+
+    for (int i = 0; i < 4; i++) {
+        struct disk_image *image = &drive->images[i];
+        if (!image->data || !image->dirty_count || image->flush_id) continue;
+        if (nanos() - image->last_write_ns < DISK_FLUSH_DELAY_NS) continue;
+
+        struct disk_image copy;
+        if (!loader->thread || disk_image_copy_writes(image, &copy)) {
+            // the directory disks write their host files in place
+            disk_image_flush(image);
+            continue;
+        }
+        if (_media_loader_request_flush(loader, i, loader->flush_count + 1, &copy)) {
+            disk_image_close(&copy);
+            image->last_write_ns = nanos();
+            continue;
+        }
+        image->flush_id = ++loader->flush_count;
+    }
+}
+
+// on the main thread, the settings follow the media swapped in. drive_no: -1 for the cassette
+static void _media_setting_ui(struct machine_status *machine, int drive_no, const char *path, void *data) {
+    char **setting = drive_no < 0 ? &app_settings.cassette_path : &app_settings.disks[drive_no].path;
+    if (*setting) free(*setting);
+    *setting = path ? strdup(path) : NULL;
+    settings_save();
+}
+
+// on the main thread, the reason is in the log
+static void _media_error_ui(struct machine_status *machine, int drive_no, const char *path, void *data) {
+    char message[2000];
+    snprintf(message, sizeof(message), "Error loading '%s', see the log for the details", path);
+    error_msg(message);
+}
+
+// called by the emulation between two instructions, swaps the opened media in
+void media_loader_apply(struct media_loader *loader, struct machine_status *machine) {
+    if (SDL_GetAtomicInt(&loader->state) != MEDIA_LOADER_READY) return;
+
+    struct media_job *job = &loader->job;
+    if (job->type == MEDIA_FLUSH) {
+        struct disk_drive_status *drive = machine->disk_drive;
+        struct disk_image *image = &drive->images[job->drive_no];
+        // waits for the end of the command
+        if (drive->status_1.BUSY) return;
+
+        // dropped when the disk was changed meanwhile, the file is written anyway
+        if (image->flush_id == job->flush_id) {
+            image->flush_id = 0;
+            if (job->result || disk_image_take_writes(image, &job->disk)) {
+                // tried again after the delay
+                image->last_write_ns = nanos();
+            } else {
+                disk_drive_swap_image(drive, job->drive_no, &job->disk);
+            }
+        }
+    } else if (job->type == MEDIA_DISK) {
+        if (!job->result) {
+            disk_drive_swap_image(machine->disk_drive, job->drive_no, &job->disk);
+            log_message(LOG_INFO, job->path ? "Disk %d loaded: %s" : "Disk %d unloaded", job->drive_no, job->path);
+            machine_post_ui(machine, _media_setting_ui, job->drive_no, job->path, NULL);
+        } else if (job->path) {
+            machine_post_ui(machine, _media_error_ui, job->drive_no, job->path, NULL);
+        }
+    } else {
+        if (!job->result) {
+            adc_swap_cassette(machine->adc, &job->cassette);
+            machine_post_ui(machine, _media_setting_ui, -1, job->path, NULL);
+        } else if (job->path) {
+            machine_post_ui(machine, _media_error_ui, -1, job->path, NULL);
+        }
+    }
+
+    SDL_LockMutex(loader->lock);
+    SDL_SetAtomicInt(&loader->state, MEDIA_LOADER_SWAPPED);
+    SDL_SignalCondition(loader->wake);
+    SDL_UnlockMutex(loader->lock);
+}
+
+// the media being loaded for the UI, returns false when the loader is idle
+bool media_loader_status(struct media_loader *loader, char *text, int length) {
+    SDL_LockMutex(loader->lock);
+    int state = SDL_GetAtomicInt(&loader->state);
+    bool busy = state == MEDIA_LOADER_LOADING || state == MEDIA_LOADER_READY;
+    if (busy && loader->job.path) {
+        const char *name = loader->job.path;
+        for (const char *c = name; *c; c++) {
+            if (*c == '/' || *c == '\\') name = c + 1;
+        }
+        int progress = SDL_GetAtomicInt(&loader->job.cassette.load_progress);
+        const char *action = loader->job.type == MEDIA_FLUSH ? "Flushing" : "Loading";
+        if (progress) snprintf(text, length, "%s %s %d%% (%d queued)", action, name, progress, loader->queue_count);
+        else snprintf(text, length, "%s %s (%d queued)", action, name, loader->queue_count);
+    } else {
+        busy = busy || loader->queue_count;
+        snprintf(text, length, "%d queued", loader->queue_count);
+    }
+    SDL_UnlockMutex(loader->lock);
+    return busy;
+}
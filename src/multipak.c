@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "multipak.h"
+#include "utils.h"
+
+
+struct multipak *multipak_create(struct sam_status *sam) {
+    struct multipak *multipak = malloc(sizeof(struct multipak));
+    memset(multipak, 0, sizeof(struct multipak));
+    multipak->sam = sam;
+    for (int i = 0; i < MULTIPAK_SLOTS; i++) rom_pak_init(&multipak->slots[i].pak, sam);
+    multipak->switch_slot = MULTIPAK_SLOTS - 1;
+    multipak->select_device = (struct cartridge_device){
+        "Multi-Pak", multipak, multipak_read_register, multipak_write_register
+    };
+    multipak_reset(multipak);
+    return multipak;
+}
+
+void multipak_reset(struct multipak *multipak) {
+    multipak->select = (multipak->switch_slot << 4) | multipak->switch_slot;
+    for (int i = 0; i < MULTIPAK_SLOTS; i++) rom_pak_reset(&multipak->slots[i].pak);
+}
+
+// the sam sees the device and the ROM of the selected slots
+void multipak_apply(struct multipak *multipak) {
+    struct multipak_slot *scs = &multipak->slots[multipak->select & 3];
+    struct multipak_slot *cts = &multipak->slots[(multipak->select >> 4) & 3];
+
+    multipak->sam->cartridge = rom_pak_is_banked(&scs->pak) ? &scs->pak.bank_register : scs->device;
+    if (rom_pak_bank(&cts->pak)) {
+        sam_set_cartridge_rom(multipak->sam, rom_pak_bank(&cts->pak), ROM_PAK_BANK_SIZE);
+    } else {
+        sam_set_cartridge_rom(multipak->sam, cts->device_rom, cts->device_rom_length);
+    }
+}
+
+// the CART line of the slot on CTS
+bool multipak_cart_sense(struct multipak *multipak) {
+    return multipak->slots[(multipak->select >> 4) & 3].autostart;
+}
+
+uint8_t multipak_read_register(void *data, uint16_t addr) {
+    struct multipak *multipak = data;
+    if (addr != MULTIPAK_SELECT_REGISTER) return 0xff;
+    return multipak->select;
+}
+
+void multipak_write_register(void *data, uint16_t addr, uint8_t value) {
+    struct multipak *multipak = data;
+    if (addr != MULTIPAK_SELECT_REGISTER) return;
+
+    multipak->select = value & 0x33;
+    multipak_apply(multipak);
+}
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ring_buffer.h"
+
+
+int ring_buffer_init(struct ring_buffer *rb, uint32_t size) {
+    memset(rb, 0, sizeof(struct ring_buffer));
+    if (!size || (size & (size - 1))) return 1;
+
+    rb->data = malloc(size);
+    if (!rb->data) return 1;
+    rb->size = size;
+    return 0;
+}
+
+void ring_buffer_free(struct ring_buffer *rb) {
+    if (rb->data) {
+        free(rb->data);
+        rb->data = NULL;
+    }
+    rb->size = 0;
+}
+
+// only safe when neither the producer nor the consumer are using the buffer
+void ring_buffer_clear(struct ring_buffer *rb) {
+    SDL_SetAtomicInt(&rb->head, 0);
+    SDL_SetAtomicInt(&rb->tail, 0);
+}
+
+uint32_t ring_buffer_available(struct ring_buffer *rb) {
+    return (uint32_t)SDL_GetAtomicInt(&rb->head) - (uint32_t)SDL_GetAtomicInt(&rb->tail);
+}
+
+uint32_t ring_buffer_free_space(struct ring_buffer *rb) {
+    return rb->size - ring_buffer_available(rb);
+}
+
+// producer side, returns the number of bytes written (less than length when the buffer is full)
+uint32_t ring_buffer_write(struct ring_buffer *rb, const uint8_t *data, uint32_t length) {
+    uint32_t head = (uint32_t)SDL_GetAtomicInt(&rb->head);
+    uint32_t tail = (uint32_t)SDL_GetAtomicInt(&rb->tail);
+    uint32_t free_space = rb->size - (head - tail);
+    if (length > free_space) length = free_space;
+
+    uint32_t pos = head & (rb->size - 1);
+    uint32_t first = rb->size - pos;
+    if (first > length) first = length;
+    memcpy(rb->data + pos, data, first);
+    memcpy(rb->data, data + first, length - first);
+
+    // the data must be visible before the head moves
+    SDL_MemoryBarrierRelease();
+    SDL_SetAtomicInt(&rb->head, (int)(head + length));
+    return length;
+}
+
+// consumer side, returns the number of bytes read (less than length when the buffer doesn't have enough data)
+uint32_t ring_buffer_read(struct ring_buffer *rb, uint8_t *data, uint32_t length) {
+    uint32_t tail = (uint32_t)SDL_GetAtomicInt(&rb->tail);
+    uint32_t head = (uint32_t)SDL_GetAtomicInt(&rb->head);
+    SDL_MemoryBarrierAcquire();
+    uint32_t available = head - tail;
+    if (length > available) length = available;
+
+    uint32_t pos = tail & (rb->size - 1);
+    uint32_t first = rb->size - pos;
+    if (first > length) first = length;
+    memcpy(data, rb->data + pos, first);
+    memcpy(data + first, rb->data, length - first);
+
+    SDL_MemoryBarrierRelease();
+    SDL_SetAtomicInt(&rb->tail, (int)(tail + length));
+    return length;
+}
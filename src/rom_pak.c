@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "rom_pak.h"
+#include "utils.h"
+
+
+void rom_pak_init(struct rom_pak *pak, struct sam_status *sam) {
+    memset(pak, 0, sizeof(struct rom_pak));
+    pak->sam = sam;
+    pak->bank_register = (struct cartridge_device){
+        "Bank register", pak, rom_pak_read_register, rom_pak_write_register
+    };
+}
+
+void _rom_pak_free(struct rom_pak *pak) {
+    if (pak->data) free(pak->data);
+    if (pak->path) free(pak->path);
+    pak->data = NULL;
+    pak->path = NULL;
+    pak->length = 0;
+    pak->mtime = 0;
+    pak->bank_count = 0;
+    pak->bank = 0;
+}
+
+/*
+    Loads the ROM, unless the same file is already there. A NULL path removes it
+    The pak is only changed when the file is read, and the sam follows when it was showing the pak
+*/
+int rom_pak_load(struct rom_pak *pak, const char *path) {
+    if (path && !*path) path = NULL;
+
+    struct stat st;
+    if (path && stat(path, &st)) {
+        log_message(LOG_ERROR, "error reading rom from file %s: %s", path, strerror(errno));
+        return 1;
+    }
+    if (path && pak->path && !strcmp(path, pak->path) && pak->length == (size_t)st.st_size && pak->mtime == st.st_mtime) return 0;
+
+    uint8_t *data = NULL;
+    int bank_count = 0;
+    long size = 0;
+    if (path) {
+        size = (long)st.st_size;
+        if (size <= 0 || size > ROM_PAK_MAX_LENGTH) {
+            log_message(LOG_ERROR, "file %s isn't a program pak: %ld bytes", path, size);
+            return 1;
+        }
+
+        bank_count = (size + ROM_PAK_BANK_SIZE - 1) / ROM_PAK_BANK_SIZE;
+        data = calloc(bank_count, ROM_PAK_BANK_SIZE);
+        if (!data || sam_read_rom_file(path, data, size)) {
+            if (data) free(data);
+            return 1;
+        }
+
+        // a 2K, 4K or 8K ROM isn't fully decoded, it's repeated in the 16K
+        if (size < ROM_PAK_BANK_SIZE && !(size & (size - 1))) {
+            for (long i = size; i < ROM_PAK_BANK_SIZE; i++) data[i] = data[i & (size - 1)];
+        }
+    }
+
+    const uint8_t *previous = rom_pak_bank(pak);
+    bool mapped = previous && pak->sam->cartridge_rom == previous;
+    _rom_pak_free(pak);
+    if (path) {
+        pak->data = data;
+        pak->bank_count = bank_count;
+        pak->length = size;
+        pak->mtime = st.st_mtime;
+        pak->path = strdup(path);
+        log_message(LOG_INFO, "Loaded program pak %s, %d bank(s)", path, pak->bank_count);
+    }
+    if (mapped) sam_set_cartridge_rom(pak->sam, rom_pak_bank(pak), ROM_PAK_BANK_SIZE);
+    return 0;
+}
+
+const uint8_t *rom_pak_bank(struct rom_pak *pak) {
+    if (!pak->data) return NULL;
+    return pak->data + (size_t)pak->bank * ROM_PAK_BANK_SIZE;
+}
+
+bool rom_pak_is_banked(struct rom_pak *pak) {
+    return pak->bank_count > 1;
+}
+
+// the sam only sees the bank when the pak is on CTS
+void _rom_pak_select_bank(struct rom_pak *pak, int bank) {
+    const uint8_t *previous = rom_pak_bank(pak);
+    pak->bank = bank;
+    if (previous && pak->sam->cartridge_rom == previous) {
+        sam_set_cartridge_rom(pak->sam, rom_pak_bank(pak), ROM_PAK_BANK_SIZE);
+    }
+}
+
+void rom_pak_reset(struct rom_pak *pak) {
+    _rom_pak_select_bank(pak, 0);
+}
+
+uint8_t rom_pak_read_register(void *data, uint16_t addr) {
+    return 0xff;  // write only
+}
+
+void rom_pak_write_register(void *data, uint16_t addr, uint8_t value) {
+    struct rom_pak *pak = data;
+    if (addr != ROM_PAK_BANK_REGISTER || !pak->bank_count) return;
+    _rom_pak_select_bank(pak, value % pak->bank_count);
+}
@@ -30,6 +30,7 @@ void _sam_register_write(struct sam_status *data, uint16_t addr, uint8_t value)
         set_sam_bit(14, M1)
         set_sam_bit(15, TY)
     }
+    if (bit_pos == 10 || bit_pos >= 13) sam_update_map(data);
 
     switch(data->V) {
         case 0:
@@ -75,15 +76,90 @@ void sam_reset(struct sam_status *sam) {
     sam->M = 0;
     sam->TY = 0;
     memset(sam->ram, 0, sizeof(sam->ram));
+    sam_update_map(sam);
 }
 
 struct sam_status *bus_create_sam() {
     struct sam_status *sam = malloc(sizeof(struct sam_status));
     memset(sam, 0, sizeof(struct sam_status));
+    memset(sam->unmapped, 0xff, sizeof(sam->unmapped));
+    sam->ram_size = 0x10000;
+    sam_update_map(sam);
 
     return sam;
 }
 
+// the address lines the SAM drives to the RAM chips for the memory size M, the next one selects the bank (RAS1)
+static const int sam_chip_address_bits[4] = {
+    12,  // 4K: two banks of 4K
+    14,  // 16K: two banks of 16K
+    16,  // 64K dynamic: one bank
+    16,  // 64K static
+};
+
+/*
+    The RAM cell of an address, from the memory size M and the installed RAM, -1 when no chip answers
+    4K and 16K chips only see their own address lines, the RAM is repeated above them. The 64K boards
+    take the bank select as their extra address line, so they see 8K in the 4K mode and 32K in the 16K mode
+*/
+int _sam_ram_address(struct sam_status *sam, uint16_t addr) {
+    int bits = sam_chip_address_bits[sam->M & 3];
+    int chip_addr = addr & ((1 << bits) - 1);
+    int bank = bits < 16 ? (addr >> bits) & 1 : 0;
+    if (sam->ram_size == 0x10000) return bank << bits | chip_addr;
+
+    // 4K: one bank of 4K chips, 16K: one bank of 16K chips, 32K: two banks of 16K chips
+    int chip_size = sam->ram_size == 0x1000 ? 0x1000 : 0x4000;
+    int banks = sam->ram_size == 0x8000 ? 2 : 1;
+    if (bank >= banks) return -1;
+    return bank * chip_size + (chip_addr & (chip_size - 1));
+}
+
+/*
+    The memory seen by the processor for each page below $FF00, from the map type, the page select bit,
+    the memory size, the loaded ROMs and the ROM of the cartridge port
+*/
+void _sam_map_page(struct sam_status *sam, int page) {
+    uint16_t addr = page << 8;
+    const uint8_t *read = sam->unmapped;
+    uint8_t *write = sam->discarded;
+
+    if (sam->TY || addr <= 0x7fff) {
+        // the page select only exists with the 64K chips
+        int ram_addr = _sam_ram_address(sam, !sam->TY && sam->P && sam->M >= 2 ? addr | 0x8000 : addr);
+        if (ram_addr >= 0) {
+            read = sam->ram + ram_addr;
+            write = sam->ram + ram_addr;
+        }
+    } else if (addr <= 0x9fff) {
+        if (sam->rom_load_status[0]) read = sam->rom0 + (addr & 0x1fff);
+    } else if (addr <= 0xbfff) {
+        if (sam->rom_load_status[1]) read = sam->rom1 + (addr & 0x1fff);
+    } else if (sam->cartridge_rom && (size_t)(addr & 0x3fff) < sam->cartridge_rom_length) {
+        read = sam->cartridge_rom + (addr & 0x3fff);
+    }
+    sam->read_pages[page] = read;
+    sam->write_pages[page] = write;
+}
+
+void sam_update_map(struct sam_status *sam) {
+    for (int page = 0; page < 0xff; page++) _sam_map_page(sam, page);
+    // the VDG always reads the RAM, without the page select
+    for (int page = 0; page < 0x100; page++) {
+        int ram_addr = _sam_ram_address(sam, page << 8);
+        sam->_vdg_pages[page] = ram_addr >= 0 ? sam->ram + ram_addr : sam->unmapped;
+    }
+    sam->read_pages[0xff] = NULL;
+    sam->write_pages[0xff] = NULL;
+}
+
+// a bank switch of the cartridge, only the pages of $C000-$FEFF change
+void sam_set_cartridge_rom(struct sam_status *sam, const uint8_t *rom, size_t length) {
+    sam->cartridge_rom = rom;
+    sam->cartridge_rom_length = rom ? length : 0;
+    for (int page = 0xc0; page < 0xff; page++) _sam_map_page(sam, page);
+}
+
 void sam_vdg_hs_reset(struct sam_status *sam) {
     if (sam->V == 7) return;
     sam->_vdg_address_0_3 &= 0xfff0;
@@ -98,7 +174,7 @@ void sam_vdg_fs_reset(struct sam_status *sam) {
 
 uint8_t sam_get_vdg_data(struct sam_status *sam) {
     uint16_t addr = (sam->_vdg_address_0_3 & 0b1111) | (sam->_vdg_address_4 & 0b10000) | (sam->_vdg_address_5_15 & 0xffe0);
-    return sam->ram[addr];
+    return sam->_vdg_pages[addr >> 8][addr & 0xff];
 }
 
 void sam_vdg_increment(struct sam_status *sam) {
@@ -113,111 +189,101 @@ void sam_vdg_increment(struct sam_status *sam) {
     }
 }
 
-uint8_t sam_read(struct sam_status *sam, uint16_t addr) {
-    if (sam->TY == 0) {
-        if (addr <= 0x7fff) {
-            addr = addr | (0x8000 ? sam->P : 0);
-            return sam->ram[addr];
-        } else if (addr <= 0x9fff) {
-            addr = addr & 0x1fff;
-            if (!sam->rom_load_status[0]) return 0xff;
-            return sam->rom0[addr];
-        } else if (addr <= 0xbfff) {
-            addr = addr & 0x1fff;
-            if (!sam->rom_load_status[1]) return 0xff;
-            return sam->rom1[addr];
-        } else if (addr <= 0xfeff) {
-            addr = addr & 0x3fff;
-            if (sam->rom_load_status[2]) {
-                return sam->rom2[addr];
-            }
-            if (sam->rom_load_status[3]) {
-                return sam->rom_dsk[addr];
-            }
-            return 0xff;
-        }
-    } else {
-        if (addr <= 0xfeff) {
-            return sam->ram[addr];
-        }
-    }
+// the I/O page by 32 bytes blocks
+uint8_t _sam_read_pia1(struct sam_status *sam, uint16_t addr) {
+    if (!sam->pia1) return 0xff;
+    return mc6821_read_register(sam->pia1, addr & 0x1f);
+}
 
-    if (addr <= 0xff1f) {
-        addr = addr & 0x1f;
-        if (!sam->pia1) return 0xff;
-        return mc6821_read_register(sam->pia1, addr);
-    } else if (addr <= 0xff3f) {
-        addr = addr & 0x1f;
-        if (!sam->pia2) return 0xff;
-        return mc6821_read_register(sam->pia2, addr);
-    } else if (addr <= 0xff5f) {
-        addr = addr & 0x1f;
-        if (!sam->pia_cartridge || !sam->pia_cartridge_read) return 0xff;
-        return sam->pia_cartridge_read(sam->pia_cartridge, addr);
-    } else if (addr >= 0xffe0) {
-        addr = addr & 0x1fff;
-        if (!sam->rom_load_status[1]) return 0xff;
-        return sam->rom1[addr];
-    }
+uint8_t _sam_read_pia2(struct sam_status *sam, uint16_t addr) {
+    if (!sam->pia2) return 0xff;
+    return mc6821_read_register(sam->pia2, addr & 0x1f);
+}
 
+uint8_t _sam_read_cartridge(struct sam_status *sam, uint16_t addr) {
+    if (!sam->cartridge || !sam->cartridge->read) return 0xff;
+    return sam->cartridge->read(sam->cartridge->data, addr & 0x1f);
+}
+
+uint8_t _sam_read_external(struct sam_status *sam, uint16_t addr) {
+    if (!sam->external || !sam->external->read) return 0xff;
+    return sam->external->read(sam->external->data, addr - 0xff60);
+}
+
+uint8_t _sam_read_none(struct sam_status *sam, uint16_t addr) {
     return 0xff;
 }
 
+// the interrupt vectors come from the end of the Basic ROM
+uint8_t _sam_read_vectors(struct sam_status *sam, uint16_t addr) {
+    if (!sam->rom_load_status[1]) return 0xff;
+    return sam->rom1[addr & 0x1fff];
+}
+
+static uint8_t (*const sam_io_read[8])(struct sam_status *sam, uint16_t addr) = {
+    _sam_read_pia1,       // $FF00
+    _sam_read_pia2,       // $FF20
+    _sam_read_cartridge,  // $FF40
+    _sam_read_external,   // $FF60
+    _sam_read_external,   // $FF80
+    _sam_read_external,   // $FFA0
+    _sam_read_none,       // $FFC0, the SAM registers are write only
+    _sam_read_vectors,    // $FFE0
+};
+
+void _sam_write_pia1(struct sam_status *sam, uint16_t addr, uint8_t data) {
+    if (sam->pia1) mc6821_write_register(sam->pia1, addr & 0x1f, data);
+}
+
+void _sam_write_pia2(struct sam_status *sam, uint16_t addr, uint8_t data) {
+    if (sam->pia2) mc6821_write_register(sam->pia2, addr & 0x1f, data);
+}
+
+void _sam_write_cartridge(struct sam_status *sam, uint16_t addr, uint8_t data) {
+    if (sam->cartridge && sam->cartridge->write) sam->cartridge->write(sam->cartridge->data, addr & 0x1f, data);
+}
+
+void _sam_write_external(struct sam_status *sam, uint16_t addr, uint8_t data) {
+    if (sam->external && sam->external->write) sam->external->write(sam->external->data, addr - 0xff60, data);
+}
+
+void _sam_write_registers(struct sam_status *sam, uint16_t addr, uint8_t data) {
+    _sam_register_write(sam, addr, data);
+}
+
+void _sam_write_none(struct sam_status *sam, uint16_t addr, uint8_t data) {
+}
+
+static void (*const sam_io_write[8])(struct sam_status *sam, uint16_t addr, uint8_t data) = {
+    _sam_write_pia1,
+    _sam_write_pia2,
+    _sam_write_cartridge,
+    _sam_write_external,
+    _sam_write_external,
+    _sam_write_external,
+    _sam_write_registers,
+    _sam_write_none,
+};
+
+uint8_t sam_read(struct sam_status *sam, uint16_t addr) {
+    const uint8_t *page = sam->read_pages[addr >> 8];
+    if (page) return page[addr & 0xff];
+    return sam_io_read[(addr >> 5) & 7](sam, addr);
+}
+
 void sam_write(struct sam_status *sam, uint16_t addr, uint8_t data) {
-    if (sam->TY == 0) {
-        if (addr <= 0x7fff) {
-            addr = addr | (sam->P ? 0x8000 : 0);
-            sam->ram[addr] = data;
-            return;
-        } else if (addr <= 0xfeff) {
-            return;
-        }
-    } else {
-        if (addr <= 0xfeff) {
-            sam->ram[addr] = data;
-            return;
-        }
-    }
-    if (addr <= 0xff1f) {
-        addr = addr & 0x1f;
-        if (!sam->pia1) return;
-        mc6821_write_register(sam->pia1, addr, data);
-    } else if (addr <= 0xff3f) {
-        addr = addr & 0x1f;
-        if (!sam->pia2) return;
-        mc6821_write_register(sam->pia2, addr, data);
-    } else if (addr <= 0xff5f) {
-        addr = addr & 0x1f;
-        if (!sam->pia_cartridge || !sam->pia_cartridge_write) return;
-        sam->pia_cartridge_write(sam->pia_cartridge, addr, data);
-    } else if (addr <= 0xffbf) {
+    uint8_t *page = sam->write_pages[addr >> 8];
+    if (page) {
+        page[addr & 0xff] = data;
         return;
-    } else if (addr <= 0xffdf) {
-        _sam_register_write(sam, addr, data);
     }
+    sam_io_write[(addr >> 5) & 7](sam, addr, data);
 }
 
-int sam_load_rom(struct sam_status *sam, int rom_no, const char *path) {
-    sam->rom_load_status[rom_no] = 0;
-    if (!path || !*path) {
-        return 0;
-    }
-
+// reads a ROM file in buffer, the end of a file bigger than max_length is ignored
+int sam_read_rom_file(const char *path, uint8_t *buffer, size_t max_length) {
     size_t size = 0;
     FILE *fp = fopen(path, "rb");
-    uint8_t *rom_contents = sam->rom0;
-    size_t max_rom_size = sizeof(sam->rom0);
-
-    if (rom_no == 1) {
-        rom_contents = sam->rom1;
-        max_rom_size = sizeof(sam->rom1);
-    } else if (rom_no == 2) {
-        rom_contents = sam->rom2;
-        max_rom_size = sizeof(sam->rom2);
-    } else if (rom_no == 3) {
-        rom_contents = sam->rom_dsk;
-        max_rom_size = sizeof(sam->rom_dsk);
-    }
 
     if (!fp) {
         log_message(LOG_ERROR, "error reading rom from file %s: %s", path, strerror(errno));
@@ -226,17 +292,17 @@ int sam_load_rom(struct sam_status *sam, int rom_no, const char *path) {
 
     fseek(fp, 0L, SEEK_END);
     size = ftell(fp);
-    if (size > max_rom_size) {
+    if (size > max_length) {
         log_message(LOG_ERROR, "file %s is too big %ld ", path, size);
-        size = max_rom_size;
+        size = max_length;
         log_message(LOG_INFO, "Updated size %ld", size);
     }
     fseek(fp, 0L, SEEK_SET);
 
     size_t remaining = size;
-    uint16_t pos = 0;
+    size_t pos = 0;
     while (remaining > 0) {
-        size_t ret = fread(rom_contents + pos, 1, remaining > 1024 ? 1024: remaining, fp);
+        size_t ret = fread(buffer + pos, 1, remaining > 1024 ? 1024: remaining, fp);
         if (ret <=0) {
             log_message(LOG_ERROR, "fread() failed: %zu", ret);
             fclose(fp);
@@ -246,8 +312,32 @@ int sam_load_rom(struct sam_status *sam, int rom_no, const char *path) {
         pos += ret;
     }
     fclose(fp);
+    return 0;
+}
+
+int sam_load_rom(struct sam_status *sam, int rom_no, const char *path) {
+    sam->rom_load_status[rom_no] = 0;
+    sam_update_map(sam);
+    if (!path || !*path) {
+        return 0;
+    }
+
+    uint8_t *rom_contents = sam->rom0;
+    size_t max_rom_size = sizeof(sam->rom0);
+
+    if (rom_no == 1) {
+        rom_contents = sam->rom1;
+        max_rom_size = sizeof(sam->rom1);
+    } else if (rom_no == 3) {
+        rom_contents = sam->rom_dsk;
+        max_rom_size = sizeof(sam->rom_dsk);
+    }
+
+    int ret = sam_read_rom_file(path, rom_contents, max_rom_size);
+    if (ret) return ret;
 
     sam->rom_load_status[rom_no] = 1;
+    sam_update_map(sam);
 
     log_message(LOG_INFO, "Loaded rom%d %s", rom_no, path);
 
@@ -256,4 +346,5 @@ int sam_load_rom(struct sam_status *sam, int rom_no, const char *path) {
 
 void sam_unload_rom(struct sam_status *sam, int rom_no) {
     sam->rom_load_status[rom_no] = 0;
+    sam_update_map(sam);
 }
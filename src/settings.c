@@ -4,6 +4,7 @@
 #include <confuse.h>
 #include <errno.h>
 #include <SDL3/SDL_filesystem.h>
+#include <SDL3/SDL_mutex.h>
 #include "settings.h"
 #include "utils.h"
 
@@ -16,9 +17,11 @@
 
 struct app_settings app_settings;
 cfg_t *cfg;
+SDL_Mutex *settings_mutex;
 
 void settings_init(void) {
     memset(&app_settings, 0, sizeof(struct app_settings));
+    settings_mutex = SDL_CreateMutex();
 
     app_settings.joy_emulation_mode[0] = Joy_Emulation_Keyboard;
     app_settings.joy_emulation_mode[1] = Joy_Emulation_None;
@@ -29,6 +32,16 @@ void settings_init(void) {
     if (is_file_readable(ROM_DISK_BASIC_DEFAULT_PATH))
         app_settings.rom_disc_basic_path = strdup(ROM_DISK_BASIC_DEFAULT_PATH);
     app_settings.artifact_colors = 1;
+    app_settings.cassette_fast_load = 1;
+    app_settings.disk_fast_transfer = 1;
+    app_settings.disk_write_mode = 1;  // DISK_WRITE_BACK
+    app_settings.disk_interleave = 4;  // DSKINI default
+    app_settings.disk_rotation_timing = 1;
+    app_settings.sound_latency_ms = 40;
+    app_settings.ram_size = 64;
+    app_settings.multipak_switch = 4;
+    for (int i = 0; i < 3; i++) app_settings.multipak_slots[i].device = -1;  // CARTRIDGE_NONE
+    app_settings.multipak_slots[3].device = 0;  // CARTRIDGE_DISK_CONTROLLER
 
     cfg_opt_t opts[] = {
         CFG_SIMPLE_STR("rom_basic_path", &app_settings.rom_basic_path),
@@ -36,13 +49,40 @@ void settings_init(void) {
         CFG_SIMPLE_STR("rom_disc_basic_path", &app_settings.rom_disc_basic_path),
         CFG_SIMPLE_STR("cartridge_path", &app_settings.cartridge_path),
         CFG_SIMPLE_STR("cassette_path", &app_settings.cassette_path),
+        CFG_SIMPLE_INT("cartridge_device", &app_settings.cartridge_device),
+        CFG_SIMPLE_STR("block_device_path", &app_settings.block_device_path),
+        CFG_SIMPLE_BOOL("multipak", &app_settings.multipak),
+        CFG_SIMPLE_INT("multipak_switch", &app_settings.multipak_switch),
+        CFG_SIMPLE_INT("multipak_slots_0_device", &app_settings.multipak_slots[0].device),
+        CFG_SIMPLE_INT("multipak_slots_1_device", &app_settings.multipak_slots[1].device),
+        CFG_SIMPLE_INT("multipak_slots_2_device", &app_settings.multipak_slots[2].device),
+        CFG_SIMPLE_INT("multipak_slots_3_device", &app_settings.multipak_slots[3].device),
+        CFG_SIMPLE_STR("multipak_slots_0_rom", &app_settings.multipak_slots[0].rom_path),
+        CFG_SIMPLE_STR("multipak_slots_1_rom", &app_settings.multipak_slots[1].rom_path),
+        CFG_SIMPLE_STR("multipak_slots_2_rom", &app_settings.multipak_slots[2].rom_path),
+        CFG_SIMPLE_STR("multipak_slots_3_rom", &app_settings.multipak_slots[3].rom_path),
         CFG_SIMPLE_STR("disks_0_path", &app_settings.disks[0].path),
         CFG_SIMPLE_STR("disks_1_path", &app_settings.disks[1].path),
         CFG_SIMPLE_STR("disks_2_path", &app_settings.disks[2].path),
         CFG_SIMPLE_STR("disks_3_path", &app_settings.disks[3].path),
+        CFG_SIMPLE_BOOL("disks_0_overlay", &app_settings.disks[0].overlay),
+        CFG_SIMPLE_BOOL("disks_1_overlay", &app_settings.disks[1].overlay),
+        CFG_SIMPLE_BOOL("disks_2_overlay", &app_settings.disks[2].overlay),
+        CFG_SIMPLE_BOOL("disks_3_overlay", &app_settings.disks[3].overlay),
         CFG_SIMPLE_BOOL("video_artifact_colors", &app_settings.artifact_colors),
+        CFG_SIMPLE_BOOL("cassette_fast_load", &app_settings.cassette_fast_load),
+        CFG_SIMPLE_BOOL("disk_fast_transfer", &app_settings.disk_fast_transfer),
+        CFG_SIMPLE_INT("disk_write_mode", &app_settings.disk_write_mode),
+        CFG_SIMPLE_INT("disk_interleave", &app_settings.disk_interleave),
+        CFG_SIMPLE_BOOL("disk_rotation_timing", &app_settings.disk_rotation_timing),
+        CFG_SIMPLE_BOOL("disk_trace", &app_settings.disk_trace),
+        CFG_SIMPLE_BOOL("cassette_wav_demodulate", &app_settings.cassette_wav_demodulate),
         CFG_SIMPLE_INT("joy_1_emulation_mode", &app_settings.joy_emulation_mode[0]),
         CFG_SIMPLE_INT("joy_2_emulation_mode", &app_settings.joy_emulation_mode[1]),
+        CFG_SIMPLE_INT("ram_size", &app_settings.ram_size),
+        CFG_SIMPLE_INT("sound_latency_ms", &app_settings.sound_latency_ms),
+        CFG_SIMPLE_INT("pacing_mode", &app_settings.pacing_mode),
+        CFG_SIMPLE_BOOL("emulation_thread", &app_settings.emulation_thread),
         CFG_END()
     };
 
@@ -67,6 +107,19 @@ void settings_init(void) {
     }
 }
 
+/*
+    Only the main thread changes the settings, so it reads them without the lock.
+    The lock is held to change the Multi-Pak ROM paths, and by the emulation to copy them. It's recursive
+*/
+void settings_lock(void) {
+    SDL_LockMutex(settings_mutex);
+}
+
+void settings_unlock(void) {
+    SDL_UnlockMutex(settings_mutex);
+}
+
+// on the main thread
 void settings_save(void) {
 	for (int i = 0; cfg->opts[i].name; i++) {
         // This is a workaround to make sure the option is saved
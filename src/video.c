@@ -86,11 +86,8 @@ uint64_t video_start_field(struct video_status *v) {
     v->_h_time_ns = H_HS_START_NS;
     v->signal_fs = 1;
 
-    if(!SDL_LockTexture( v->texture, NULL, (void**)&v->_pixels, &v->_pitch )) {
-        log_message(LOG_ERROR, "SDL_LockTexture failed %s %p", SDL_GetError(), v->texture);
-        return -1;
-    }
-    v->_pitch = v->_pitch >> 2;
+    v->_pixels = v->_frames[v->_frame_back];
+    v->_pitch = VIDEO_WIDTH;
 
     return H_HS_START_NS;
 }
@@ -99,9 +96,34 @@ uint64_t video_start_field(struct video_status *v) {
 #define screen_margins 20
 #define toolbar_height 40
 
+/*
+    The fields are drawn in CPU memory with 3 buffers so the emulation (that may run on its own thread)
+    never waits for the renderer: the back buffer is being drawn, the middle one holds the latest
+    complete field and the front one is in the texture. Complete fields are exchanged with the middle one
+*/
 void video_end_field(struct video_status *v) {
-    SDL_UnlockTexture(v->texture);
+    int middle = SDL_SetAtomicInt(&v->_frame_middle, v->_frame_back | VIDEO_FRAME_FRESH);
+    v->_frame_back = middle & ~VIDEO_FRAME_FRESH;
+}
+
+// a complete field wasn't rendered yet
+int video_frame_ready(struct video_status *v) {
+    return (SDL_GetAtomicInt(&v->_frame_middle) & VIDEO_FRAME_FRESH) != 0;
+}
+
+// draws the latest complete field, must be called from the renderer thread
+// on the main thread, returns false when the texture was lost and the video must be reinitialized
+bool video_render(struct video_status *v) {
+    if (video_frame_ready(v)) {
+        int middle = SDL_SetAtomicInt(&v->_frame_middle, v->_frame_front);
+        v->_frame_front = middle & ~VIDEO_FRAME_FRESH;
+    }
+    if (!SDL_UpdateTexture(v->texture, NULL, v->_frames[v->_frame_front], VIDEO_WIDTH * sizeof(uint32_t))) {
+        log_message(LOG_INFO, "Video texture lost: %s", SDL_GetError());
+        return false;
+    }
     SDL_RenderTexture(v->renderer, v->texture, NULL, &v->_output_port);
+    return true;
 }
 
 #define fs_start 13 + 25 + 192
@@ -340,6 +362,14 @@ struct video_status *video_initialize(struct sam_status *sam, struct mc6821_stat
     v->signal_fs = 1;
     v->h_sync = 1;
 
+    for (int i = 0; i < 3; i++) {
+        v->_frames[i] = malloc(VIDEO_WIDTH * VIDEO_HEIGHT * sizeof(uint32_t));
+        memset(v->_frames[i], 0, VIDEO_WIDTH * VIDEO_HEIGHT * sizeof(uint32_t));
+    }
+    v->_frame_back = 0;
+    SDL_SetAtomicInt(&v->_frame_middle, 1);
+    v->_frame_front = 2;
+
     v->renderer = renderer;
     v->texture = SDL_CreateTexture( renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 256, 192 );
     _calculate_output_port(v);